@@ -1,9 +1,13 @@
 import esphome.codegen as cg
 import esphome.config_validation as cv
+from esphome import automation
 from esphome.components import climate, select
 from esphome.components.logger import HARDWARE_UART_TO_SERIAL
 from esphome.const import (
     CONF_ID,
+    CONF_ADDRESS,
+    CONF_PORT,
+    CONF_INTERVAL,
     CONF_HARDWARE_UART,
     CONF_BAUD_RATE,
     CONF_RX_PIN,
@@ -12,6 +16,7 @@ from esphome.const import (
     CONF_MODE,
     CONF_FAN_MODE,
     CONF_SWING_MODE,
+    CONF_TRIGGER_ID,
     PLATFORM_ESP8266
 )
 from esphome.core import CORE, coroutine
@@ -40,14 +45,145 @@ CONF_REMOTE_OPERATING_TIMEOUT = "remote_temperature_operating_timeout_minutes"
 CONF_REMOTE_IDLE_TIMEOUT = "remote_temperature_idle_timeout_minutes"
 CONF_REMOTE_PING_TIMEOUT = "remote_temperature_ping_timeout_minutes"
 
+# Fail-safe policy applied when the ping timeout fires
+CONF_FAILSAFE = "ping_timeout_failsafe"
+CONF_FAILSAFE_TARGET_TEMPERATURE = "target_temperature"
+CONF_FAILSAFE_MIN_ROOM_TEMPERATURE = "min_room_temperature"
+CONF_FAILSAFE_MAX_ROOM_TEMPERATURE = "max_room_temperature"
+
+# Leave debug and verbose log strings of this component out of the build
+CONF_COMPACT_LOGGING = "compact_logging"
+
+# Binary state snapshots pushed over UDP
+CONF_SNAPSHOT = "snapshot"
+
+# Compressor start staggering and demand limiting across units
+CONF_COORDINATION = "coordination"
+CONF_START_SPACING = "start_spacing"
+CONF_MAX_OPERATING_UNITS = "max_operating_units"
+CONF_SETPOINT_RELAXATION = "setpoint_relaxation"
+CONF_PEER_PORT = "peer_port"
+CONF_PEER_KEY = "peer_key"
+
+# Downsampled history kept on the device
+CONF_HISTORY = "history"
+CONF_FINE_INTERVAL = "fine_interval"
+CONF_FINE_DURATION = "fine_duration"
+CONF_COARSE_INTERVAL = "coarse_interval"
+CONF_COARSE_DURATION = "coarse_duration"
+
+# Predictive preheat and precool
+CONF_PREHEAT = "preheat"
+CONF_DEFAULT_RATE = "default_rate"
+CONF_MAX_LEAD_TIME = "max_lead_time"
+
+# Authenticated local UDP commands
+CONF_COMMAND_ENDPOINT = "command_endpoint"
+CONF_COMMAND_KEY = "key"
+
+# Groups performing one call on several units
+CONF_MEMBERS = "members"
+CONF_ON_MEMBER_RESULT = "on_member_result"
+
 MitsubishiHeatPump = cg.global_ns.class_(
     "MitsubishiHeatPump", climate.Climate, cg.PollingComponent
 )
 
+MitsubishiHeatPumpGroup = cg.global_ns.class_(
+    "MitsubishiHeatPumpGroup", climate.Climate, cg.Component
+)
+
+MemberResultTrigger = cg.global_ns.class_(
+    "MemberResultTrigger", automation.Trigger.template(cg.uint32, cg.std_string)
+)
+
 MitsubishiACSelect = cg.global_ns.class_(
     "MitsubishiACSelect", select.Select, cg.Component
 )
 
+def validate_failsafe(config):
+    if (CONF_FAILSAFE_MIN_ROOM_TEMPERATURE in config and
+            CONF_FAILSAFE_MAX_ROOM_TEMPERATURE in config and
+            config[CONF_FAILSAFE_MIN_ROOM_TEMPERATURE] >=
+            config[CONF_FAILSAFE_MAX_ROOM_TEMPERATURE]):
+        raise cv.Invalid(
+            f"{CONF_FAILSAFE_MIN_ROOM_TEMPERATURE} must be lower than "
+            f"{CONF_FAILSAFE_MAX_ROOM_TEMPERATURE}"
+        )
+    return config
+
+
+def validate_failsafe_requires_ping(config):
+    if CONF_FAILSAFE in config and CONF_REMOTE_PING_TIMEOUT not in config:
+        raise cv.Invalid(
+            f"{CONF_FAILSAFE} requires {CONF_REMOTE_PING_TIMEOUT} to be set"
+        )
+    return config
+
+
+SNAPSHOT_SCHEMA = cv.Schema(
+    {
+        cv.Required(CONF_ADDRESS): cv.ipv4,
+        cv.Optional(CONF_PORT, default=9998): cv.port,
+        cv.Optional(CONF_INTERVAL, default="60s"): cv.positive_time_period_milliseconds,
+    }
+)
+
+
+COORDINATION_SCHEMA = cv.Schema(
+    {
+        cv.Optional(CONF_START_SPACING, default="30s"): cv.positive_time_period_milliseconds,
+        cv.Optional(CONF_MAX_OPERATING_UNITS): cv.int_range(min=1, max=16),
+        cv.Optional(CONF_SETPOINT_RELAXATION, default=2.0): cv.float_range(min=0.5, max=10.0),
+        # Peer statuses decide when units may start, so they are
+        # authenticated with a key shared by every node.
+        cv.Inclusive(CONF_PEER_PORT, "peers"): cv.port,
+        cv.Inclusive(CONF_PEER_KEY, "peers"): cv.All(cv.string, cv.Length(min=16)),
+    }
+)
+
+
+COMMAND_ENDPOINT_SCHEMA = cv.Schema(
+    {
+        cv.Optional(CONF_PORT, default=9997): cv.port,
+        # Shared with the clients; long enough not to be guessed.
+        cv.Required(CONF_COMMAND_KEY): cv.All(cv.string, cv.Length(min=16)),
+    }
+)
+
+
+def validate_history(config):
+    for interval, duration in (
+        (CONF_FINE_INTERVAL, CONF_FINE_DURATION),
+        (CONF_COARSE_INTERVAL, CONF_COARSE_DURATION),
+    ):
+        buckets = config[duration].total_milliseconds // config[interval].total_milliseconds
+        if not 1 <= buckets <= 65535:
+            raise cv.Invalid(f"{duration} must hold between 1 and 65535 {interval}s")
+    return config
+
+
+HISTORY_SCHEMA = cv.All(
+    cv.Schema(
+        {
+            cv.Optional(CONF_FINE_INTERVAL, default="10min"): cv.positive_time_period_milliseconds,
+            cv.Optional(CONF_FINE_DURATION, default="24h"): cv.positive_time_period_milliseconds,
+            cv.Optional(CONF_COARSE_INTERVAL, default="1h"): cv.positive_time_period_milliseconds,
+            cv.Optional(CONF_COARSE_DURATION, default="7d"): cv.positive_time_period_milliseconds,
+        }
+    ),
+    validate_history,
+)
+
+
+PREHEAT_SCHEMA = cv.Schema(
+    {
+        cv.Optional(CONF_DEFAULT_RATE, default=2.0): cv.float_range(min=0.1, max=20.0),
+        cv.Optional(CONF_MAX_LEAD_TIME, default="4h"): cv.positive_time_period_milliseconds,
+    }
+)
+
+
 def valid_uart(uart):
     if CORE.is_esp8266:
         uarts = ["UART0"]  # UART1 is tx-only
@@ -63,7 +199,19 @@ SELECT_SCHEMA = select.SELECT_SCHEMA.extend(
     {cv.GenerateID(CONF_ID): cv.declare_id(MitsubishiACSelect)}
 )
 
-CONFIG_SCHEMA = climate.CLIMATE_SCHEMA.extend(
+FAILSAFE_SCHEMA = cv.All(
+    cv.Schema(
+        {
+            cv.Optional(CONF_MODE): climate.validate_climate_mode,
+            cv.Optional(CONF_FAILSAFE_TARGET_TEMPERATURE): cv.temperature,
+            cv.Optional(CONF_FAILSAFE_MIN_ROOM_TEMPERATURE): cv.temperature,
+            cv.Optional(CONF_FAILSAFE_MAX_ROOM_TEMPERATURE): cv.temperature,
+        }
+    ),
+    validate_failsafe,
+)
+
+HEATPUMP_SCHEMA = cv.All(climate.CLIMATE_SCHEMA.extend(
     {
         cv.GenerateID(): cv.declare_id(MitsubishiHeatPump),
         cv.Optional(CONF_HARDWARE_UART, default="UART0"): valid_uart,
@@ -71,6 +219,13 @@ CONFIG_SCHEMA = climate.CLIMATE_SCHEMA.extend(
         cv.Optional(CONF_REMOTE_OPERATING_TIMEOUT): cv.positive_int,
         cv.Optional(CONF_REMOTE_IDLE_TIMEOUT): cv.positive_int,
         cv.Optional(CONF_REMOTE_PING_TIMEOUT): cv.positive_int,
+        cv.Optional(CONF_FAILSAFE): FAILSAFE_SCHEMA,
+        cv.Optional(CONF_SNAPSHOT): SNAPSHOT_SCHEMA,
+        cv.Optional(CONF_COORDINATION): COORDINATION_SCHEMA,
+        cv.Optional(CONF_HISTORY): HISTORY_SCHEMA,
+        cv.Optional(CONF_PREHEAT): PREHEAT_SCHEMA,
+        cv.Optional(CONF_COMMAND_ENDPOINT): COMMAND_ENDPOINT_SCHEMA,
+        cv.Optional(CONF_COMPACT_LOGGING, default=False): cv.boolean,
         cv.Optional(CONF_RX_PIN): cv.positive_int,
         cv.Optional(CONF_TX_PIN): cv.positive_int,
         # If polling interval is greater than 9 seconds, the HeatPump library
@@ -93,11 +248,97 @@ CONFIG_SCHEMA = climate.CLIMATE_SCHEMA.extend(
             }
         ),
     }
+).extend(cv.COMPONENT_SCHEMA), validate_failsafe_requires_ping)
+
+GROUP_SCHEMA = climate.CLIMATE_SCHEMA.extend(
+    {
+        cv.GenerateID(): cv.declare_id(MitsubishiHeatPumpGroup),
+        cv.Required(CONF_MEMBERS): cv.All(
+            cv.ensure_list(cv.use_id(MitsubishiHeatPump)), cv.Length(min=1, max=16)
+        ),
+        # Peer messages carry commands, so they are authenticated with a
+        # key shared by the groups on every node.
+        cv.Inclusive(CONF_PEER_PORT, "peers"): cv.port,
+        cv.Inclusive(CONF_PEER_KEY, "peers"): cv.All(cv.string, cv.Length(min=16)),
+        cv.Optional(CONF_ON_MEMBER_RESULT): automation.validate_automation(
+            {
+                cv.GenerateID(CONF_TRIGGER_ID): cv.declare_id(MemberResultTrigger),
+            }
+        ),
+    }
 ).extend(cv.COMPONENT_SCHEMA)
 
 
+def claim_port(port, use):
+    # Ports listened on by the entries validated so far on this node. The
+    # coordination and group peer ports are shared by all units or groups
+    # using them, but a command endpoint belongs to one unit.
+    ports = CORE.data.setdefault("mitsubishi_heatpump_ports", {})
+    if port in ports and (ports[port] != use or use == "command endpoint"):
+        raise cv.Invalid(f"Port {port} is already used by a {ports[port]} on this node")
+    ports[port] = use
+
+
+def validate_ports(config):
+    if CONF_MEMBERS in config:
+        if CONF_PEER_PORT in config:
+            claim_port(config[CONF_PEER_PORT], "group peer port")
+        return config
+    if CONF_PEER_PORT in config.get(CONF_COORDINATION, {}):
+        claim_port(config[CONF_COORDINATION][CONF_PEER_PORT], "coordination peer port")
+    if CONF_COMMAND_ENDPOINT in config:
+        claim_port(config[CONF_COMMAND_ENDPOINT][CONF_PORT], "command endpoint")
+    return config
+
+
+def validate_platform(config):
+    # A list of members declares a group rather than a heatpump.
+    if isinstance(config, dict) and CONF_MEMBERS in config:
+        return validate_ports(GROUP_SCHEMA(config))
+    return validate_ports(HEATPUMP_SCHEMA(config))
+
+
+CONFIG_SCHEMA = validate_platform
+
+
+def supported_mask(enum_values, names):
+    """Bit mask over the climate enum values of names, as a constant C++
+    expression."""
+    if not names:
+        return cg.RawExpression("0")
+    return cg.RawExpression(" | ".join(
+        f"(1 << {enum_values[name]})" for name in sorted(names)
+    ))
+
+
+@coroutine
+def group_to_code(config):
+    var = cg.new_Pvariable(config[CONF_ID])
+
+    for member in config[CONF_MEMBERS]:
+        member_var = yield cg.get_variable(member)
+        cg.add(var.add_member(member_var))
+
+    if CONF_PEER_PORT in config:
+        cg.add_define("USE_ESPMHP_GROUP_PEERS")
+        cg.add(var.set_peers(config[CONF_PEER_PORT], config[CONF_PEER_KEY]))
+
+    for conf in config.get(CONF_ON_MEMBER_RESULT, []):
+        trigger = cg.new_Pvariable(conf[CONF_TRIGGER_ID], var)
+        yield automation.build_automation(
+            trigger, [(cg.uint32, "unit_id"), (cg.std_string, "result")], conf
+        )
+
+    yield cg.register_component(var, config)
+    yield climate.register_climate(var, config)
+
+
 @coroutine
 def to_code(config):
+    if CONF_MEMBERS in config:
+        yield group_to_code(config)
+        return
+
     serial = HARDWARE_UART_TO_SERIAL[PLATFORM_ESP8266][config[CONF_HARDWARE_UART]]
     var = cg.new_Pvariable(config[CONF_ID], cg.RawExpression(f"&{serial}"))
 
@@ -119,22 +360,105 @@ def to_code(config):
     if CONF_REMOTE_PING_TIMEOUT in config:
         cg.add(var.set_remote_ping_timeout_minutes(config[CONF_REMOTE_PING_TIMEOUT]))
 
+    if CONF_FAILSAFE in config:
+        failsafe = config[CONF_FAILSAFE]
+        if CONF_MODE in failsafe:
+            cg.add(var.set_failsafe_mode(climate.CLIMATE_MODES[failsafe[CONF_MODE]]))
+        if CONF_FAILSAFE_TARGET_TEMPERATURE in failsafe:
+            cg.add(var.set_failsafe_target_temperature(
+                failsafe[CONF_FAILSAFE_TARGET_TEMPERATURE]
+            ))
+        if CONF_FAILSAFE_MIN_ROOM_TEMPERATURE in failsafe:
+            cg.add(var.set_failsafe_min_room_temperature(
+                failsafe[CONF_FAILSAFE_MIN_ROOM_TEMPERATURE]
+            ))
+        if CONF_FAILSAFE_MAX_ROOM_TEMPERATURE in failsafe:
+            cg.add(var.set_failsafe_max_room_temperature(
+                failsafe[CONF_FAILSAFE_MAX_ROOM_TEMPERATURE]
+            ))
 
-    supports = config[CONF_SUPPORTS]
-    traits = var.config_traits()
+    if CONF_SNAPSHOT in config:
+        snapshot = config[CONF_SNAPSHOT]
+        cg.add_define("USE_ESPMHP_SNAPSHOT")
+        cg.add(var.set_snapshot_target(
+            str(snapshot[CONF_ADDRESS]),
+            snapshot[CONF_PORT],
+            snapshot[CONF_INTERVAL].total_milliseconds,
+        ))
 
-    for mode in supports[CONF_MODE]:
-        if mode == "OFF":
-            continue
-        cg.add(traits.add_supported_mode(climate.CLIMATE_MODES[mode]))
+    if CONF_COORDINATION in config:
+        coordination = config[CONF_COORDINATION]
+        cg.add_define("USE_ESPMHP_COORDINATION")
+        cg.add(var.set_start_spacing(
+            coordination[CONF_START_SPACING].total_milliseconds
+        ))
+        cg.add(var.set_setpoint_relaxation(coordination[CONF_SETPOINT_RELAXATION]))
+        if CONF_MAX_OPERATING_UNITS in coordination:
+            cg.add(var.set_max_operating_units(coordination[CONF_MAX_OPERATING_UNITS]))
+        if CONF_PEER_PORT in coordination:
+            cg.add(var.set_peers(coordination[CONF_PEER_PORT], coordination[CONF_PEER_KEY]))
 
-    for mode in supports[CONF_FAN_MODE]:
-        cg.add(traits.add_supported_fan_mode(climate.CLIMATE_FAN_MODES[mode]))
+    if CONF_HISTORY in config:
+        history = config[CONF_HISTORY]
+        fine = history[CONF_FINE_INTERVAL].total_milliseconds
+        coarse = history[CONF_COARSE_INTERVAL].total_milliseconds
+        fine_count = history[CONF_FINE_DURATION].total_milliseconds // fine
+        coarse_count = history[CONF_COARSE_DURATION].total_milliseconds // coarse
+        cg.add_define("USE_ESPMHP_HISTORY")
+        # Each unit gets rings of its own size, statically allocated.
+        prefix = f"{config[CONF_ID].id}_history"
+        cg.add_global(cg.RawStatement(
+            f"static espmhp::HistoryBucket {prefix}_fine[{fine_count}];"
+        ))
+        cg.add_global(cg.RawStatement(
+            f"static espmhp::HistoryBucket {prefix}_coarse[{coarse_count}];"
+        ))
+        cg.add(var.set_history_storage(
+            cg.RawExpression(f"{prefix}_fine"), fine_count,
+            cg.RawExpression(f"{prefix}_coarse"), coarse_count,
+        ))
+        cg.add(var.set_history_periods(fine, coarse))
+
+    if CONF_PREHEAT in config:
+        preheat = config[CONF_PREHEAT]
+        cg.add_define("USE_ESPMHP_PREHEAT")
+        cg.add(var.set_preheat_default_rate(preheat[CONF_DEFAULT_RATE]))
+        cg.add(var.set_preheat_max_lead_time(
+            preheat[CONF_MAX_LEAD_TIME].total_milliseconds
+        ))
+
+    if CONF_COMMAND_ENDPOINT in config:
+        endpoint = config[CONF_COMMAND_ENDPOINT]
+        cg.add_define("USE_ESPMHP_COMMAND_ENDPOINT")
+        cg.add(var.set_command_endpoint(
+            endpoint[CONF_PORT], endpoint[CONF_COMMAND_KEY]
+        ))
 
-    for mode in supports[CONF_SWING_MODE]:
-        cg.add(traits.add_supported_swing_mode(
-            climate.CLIMATE_SWING_MODES[mode]
+    if config[CONF_COMPACT_LOGGING]:
+        # Applies to every unit on the node.
+        cg.add_define("USE_ESPMHP_COMPACT_LOGGING")
+
+    # The defaults are built into the component; only differences are
+    # generated, as one constant mask each.
+    supports = config[CONF_SUPPORTS]
+    # OFF is always supported, whether it is listed or not.
+    modes = set(supports[CONF_MODE]) | {"OFF"}
+    if modes != set(DEFAULT_CLIMATE_MODES) | {"OFF"}:
+        cg.add(var.set_supported_modes(
+            supported_mask(climate.CLIMATE_MODES, modes)
+        ))
+    if set(supports[CONF_FAN_MODE]) != set(DEFAULT_FAN_MODES):
+        cg.add(var.set_supported_fan_modes(
+            supported_mask(climate.CLIMATE_FAN_MODES, supports[CONF_FAN_MODE])
         ))
+    if set(supports[CONF_SWING_MODE]) != set(DEFAULT_SWING_MODES):
+        cg.add(var.set_supported_swing_modes(
+            supported_mask(climate.CLIMATE_SWING_MODES, supports[CONF_SWING_MODE])
+        ))
+
+    if (CONF_HORIZONTAL_SWING_SELECT in config or
+            CONF_VERTICAL_SWING_SELECT in config):
+        cg.add_define("USE_ESPMHP_VANE_SELECT")
 
     if CONF_HORIZONTAL_SWING_SELECT in config:
         conf = config[CONF_HORIZONTAL_SWING_SELECT]
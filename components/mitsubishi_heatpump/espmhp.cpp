@@ -21,6 +21,58 @@
 #include "espmhp.h"
 using namespace esphome;
 
+// The core mirrors the ESPHome climate enums so values can be cast directly.
+static_assert(int(espmhp::MODE_HEAT_COOL) == int(climate::CLIMATE_MODE_HEAT_COOL) &&
+              int(espmhp::MODE_DRY) == int(climate::CLIMATE_MODE_DRY),
+              "espmhp::Mode must match climate::ClimateMode");
+static_assert(int(espmhp::ACTION_COOLING) == int(climate::CLIMATE_ACTION_COOLING) &&
+              int(espmhp::ACTION_FAN) == int(climate::CLIMATE_ACTION_FAN),
+              "espmhp::Action must match climate::ClimateAction");
+static_assert(int(espmhp::FAN_AUTO) == int(climate::CLIMATE_FAN_AUTO) &&
+              int(espmhp::FAN_DIFFUSE) == int(climate::CLIMATE_FAN_DIFFUSE),
+              "espmhp::FanMode must match climate::ClimateFanMode");
+static_assert(int(espmhp::SWING_BOTH) == int(climate::CLIMATE_SWING_BOTH) &&
+              int(espmhp::SWING_HORIZONTAL) == int(climate::CLIMATE_SWING_HORIZONTAL),
+              "espmhp::SwingMode must match climate::ClimateSwingMode");
+// Info pages are passed to HeatPump::sync() as they are.
+static_assert(espmhp::PAGE_SETTINGS == RQST_PKT_SETTINGS &&
+              espmhp::PAGE_ROOM_TEMP == RQST_PKT_ROOM_TEMP &&
+              espmhp::PAGE_TIMERS == RQST_PKT_TIMERS &&
+              espmhp::PAGE_STATUS == RQST_PKT_STATUS &&
+              espmhp::PAGE_STANDBY == RQST_PKT_STANDBY,
+              "espmhp::InfoPage must match the HeatPump RQST_PKT_* constants");
+static_assert(espmhp::POLL_READ_DELAY == PACKET_SENT_INTERVAL_MS,
+              "espmhp::POLL_READ_DELAY must match PACKET_SENT_INTERVAL_MS");
+
+// Settings strings may be null, which printf() doesn't handle everywhere.
+static const char* or_unknown(const char* value) {
+    return value != nullptr ? value : "(unknown)";
+}
+
+// Convert the HeatPump library's settings for the core.
+static espmhp::UnitSettings to_unit_settings(const heatpumpSettings& settings) {
+    return espmhp::UnitSettings{
+        settings.power,
+        settings.mode,
+        settings.temperature,
+        settings.fan,
+        settings.vane,
+        settings.wideVane,
+    };
+}
+
+#ifdef USE_ESPMHP_COORDINATION
+// Shared by every coordinated unit on this node.
+espmhp::StartCoordinator MitsubishiHeatPump::coordinator_;
+WiFiUDP MitsubishiHeatPump::peer_udp_;
+uint16_t MitsubishiHeatPump::peer_port_ = 0;
+std::string MitsubishiHeatPump::peer_key_;
+bool MitsubishiHeatPump::peer_listening_ = false;
+uint32_t MitsubishiHeatPump::peer_session_ = 0;
+uint32_t MitsubishiHeatPump::peer_sequence_ = 0;
+espmhp::ReplayGuard MitsubishiHeatPump::peer_replay_guard_;
+#endif
+
 /**
  * Create a new MitsubishiHeatPump object
  *
@@ -41,6 +93,9 @@ MitsubishiHeatPump::MitsubishiHeatPump(
     this->traits_.set_visual_min_temperature(ESPMHP_MIN_TEMPERATURE);
     this->traits_.set_visual_max_temperature(ESPMHP_MAX_TEMPERATURE);
     this->traits_.set_visual_temperature_step(ESPMHP_TEMPERATURE_STEP);
+    this->set_supported_modes(espmhp::DEFAULT_SUPPORTED_MODES);
+    this->set_supported_fan_modes(espmhp::DEFAULT_SUPPORTED_FAN_MODES);
+    this->set_supported_swing_modes(espmhp::DEFAULT_SUPPORTED_SWING_MODES);
 
     // Assume a succesful connection was made to the ESPHome controller on
     // launch.
@@ -75,16 +130,155 @@ void MitsubishiHeatPump::banner() {
             ESPMHP_VERSION);
 }
 
+bool MitsubishiHeatPump::send_update() {
+    if (this->command_pending_) {
+        // Whatever is sent now includes the queued command.
+        uint32_t wait = millis() - this->command_queued_at_;
+        this->counters_.command_wait_last = wait;
+        if (wait > this->counters_.command_wait_max) {
+            this->counters_.command_wait_max = wait;
+        }
+        this->command_pending_ = false;
+        this->counters_.queue_depth = 0;
+    }
+
+    this->counters_.updates_sent++;
+    bool acknowledged = hp.update();
+    if (!acknowledged) {
+        this->counters_.updates_failed++;
+    }
+    // Confirm the new settings with the next info request.
+    this->poll_scheduler_.expedite(espmhp::PAGE_SETTINGS);
+    return acknowledged;
+}
+
+void MitsubishiHeatPump::queue_command() {
+    if (!this->command_pending_) {
+        this->command_pending_ = true;
+        this->command_queued_at_ = millis();
+    }
+    this->counters_.queue_depth++;
+    if (this->counters_.queue_depth > this->counters_.queue_depth_max) {
+        this->counters_.queue_depth_max = this->counters_.queue_depth;
+    }
+    this->last_update_result_ = espmhp::UPDATE_QUEUED;
+    if (this->commands_held_) {
+        // Sent from update().
+        return;
+    }
+    this->defer("flush_commands", [this]() {
+        this->flush_commands();
+    });
+}
+
+void MitsubishiHeatPump::flush_commands() {
+    if (!this->command_pending_) {
+        return;
+    }
+    this->last_update_result_ = this->send_update() ?
+        espmhp::UPDATE_SENT : espmhp::UPDATE_FAILED;
+    this->update_result_callback_.call(this->last_update_result_);
+}
+
+void MitsubishiHeatPump::hold_commands(bool hold) {
+    this->commands_held_ = hold;
+}
+
+void MitsubishiHeatPump::add_on_update_result_callback(
+        std::function<void(espmhp::UpdateResult)> &&callback) {
+    this->update_result_callback_.add(std::move(callback));
+}
+
+void MitsubishiHeatPump::request_update(bool starts_compressor) {
+#ifdef USE_ESPMHP_COORDINATION
+    if (this->start_pending_) {
+        if (espmhp::uses_compressor(static_cast<espmhp::Mode>(this->mode))) {
+            // The library sends every wanted setting at once, so this has to
+            // go along with the pending start.
+            ESPMHP_LOGD(TAG, "Waiting for a compressor start slot.");
+            this->last_update_result_ = espmhp::UPDATE_DEFERRED;
+            return;
+        }
+        // E.g. turned off meanwhile: there is nothing left to start, and
+        // this must not wait for the slot.
+        ESP_LOGI(TAG, "Cancelling the staggered compressor start.");
+        this->cancel_timeout("staggered_start");
+        this->start_pending_ = false;
+        coordinator_.cancel_start(this->pending_start_);
+    } else if (starts_compressor && this->coordinated_) {
+        uint32_t now = millis();
+        uint32_t wait = coordinator_.reserve_start(now);
+        if (peer_port_ != 0) {
+            // Tell the peers right away, so they don't take the same slot.
+            this->send_peer_status();
+        }
+        if (wait > 0) {
+            ESP_LOGI(TAG, "Staggering compressor start by %u ms.", (unsigned) wait);
+            this->start_pending_ = true;
+            this->pending_start_ = now + wait;
+            this->last_update_result_ = espmhp::UPDATE_DEFERRED;
+            this->set_timeout("staggered_start", wait, [this]() {
+                this->start_pending_ = false;
+                this->queue_command();
+                this->flush_commands();
+            });
+            return;
+        }
+    }
+#else
+    (void) starts_compressor;
+#endif
+    this->queue_command();
+}
+
+bool MitsubishiHeatPump::setpoint_relaxed() const {
+#ifdef USE_ESPMHP_COORDINATION
+    return this->relaxed_;
+#else
+    return false;
+#endif
+}
+
 void MitsubishiHeatPump::update() {
     // This will be called every "update_interval" milliseconds.
     //this->dump_config();
-    this->hp->sync();
+    uint32_t free_heap_before = ESP.getFreeHeap();
+
+    // Commands go out ahead of info requests.
+    this->flush_commands();
+
+    uint32_t now = millis();
+    if (this->poll_scheduler_.should_poll(now)) {
+        this->hp.sync(this->poll_scheduler_.next(now));
+    }
 #ifndef USE_CALLBACKS
     this->hpSettingsChanged();
-    heatpumpStatus currentStatus = hp->getStatus();
+    heatpumpStatus currentStatus = hp.getStatus();
     this->hpStatusChanged(currentStatus);
 #endif
     this->enforce_remote_temperature_sensor_timeout();
+#ifdef USE_ESPMHP_PREHEAT
+    this->check_scheduled_target();
+#endif
+#ifdef USE_ESPMHP_HISTORY
+    // Status callbacks only come on changes; close buckets on time anyway.
+    this->history_.advance(millis());
+#endif
+#ifdef USE_ESPMHP_COORDINATION
+    if (this->coordinated_) {
+        if (peer_port_ != 0) {
+            this->receive_peer_status();
+        }
+        this->enforce_demand_limit();
+    }
+#endif
+
+    // Steady state updates shouldn't allocate; report the worst case seen.
+    int32_t heap_used = free_heap_before - ESP.getFreeHeap();
+    if (heap_used > this->update_heap_used_max_) {
+        this->update_heap_used_max_ = heap_used;
+        ESPMHP_LOGD(TAG, "update() used %d bytes of heap", heap_used);
+    }
 }
 
 void MitsubishiHeatPump::set_baud_rate(int baud) {
@@ -123,27 +317,83 @@ climate::ClimateTraits& MitsubishiHeatPump::config_traits() {
     return traits_;
 }
 
-void MitsubishiHeatPump::update_swing_horizontal(const std::string &swing) {
+void MitsubishiHeatPump::set_supported_modes(uint16_t modes) {
+    // Turning the unit off is always possible, whatever the supports block
+    // says; without it ClimateCall::validate_() would reject OFF.
+    modes |= 1 << climate::CLIMATE_MODE_OFF;
+    this->supported_modes_ = modes;
+    std::set<climate::ClimateMode> supported;
+    for (uint8_t mode = 0; mode < 16; mode++) {
+        if (modes & (1 << mode)) {
+            supported.insert(static_cast<climate::ClimateMode>(mode));
+        }
+    }
+    this->traits_.set_supported_modes(supported);
+}
+
+void MitsubishiHeatPump::set_supported_fan_modes(uint16_t fan_modes) {
+    this->supported_fan_modes_ = fan_modes;
+    std::set<climate::ClimateFanMode> supported;
+    for (uint8_t fan_mode = 0; fan_mode < 16; fan_mode++) {
+        if (fan_modes & (1 << fan_mode)) {
+            supported.insert(static_cast<climate::ClimateFanMode>(fan_mode));
+        }
+    }
+    this->traits_.set_supported_fan_modes(supported);
+}
+
+void MitsubishiHeatPump::set_supported_swing_modes(uint8_t swing_modes) {
+    this->supported_swing_modes_ = swing_modes;
+    std::set<climate::ClimateSwingMode> supported;
+    for (uint8_t swing_mode = 0; swing_mode < 8; swing_mode++) {
+        if (swing_modes & (1 << swing_mode)) {
+            supported.insert(static_cast<climate::ClimateSwingMode>(swing_mode));
+        }
+    }
+    this->traits_.set_supported_swing_modes(supported);
+}
+
+bool MitsubishiHeatPump::supports_mode(climate::ClimateMode mode) const {
+    return mode < 16 && (this->supported_modes_ & (1 << mode));
+}
+
+bool MitsubishiHeatPump::supports_fan_mode(
+        climate::ClimateFanMode fan_mode) const {
+    return fan_mode < 16 && (this->supported_fan_modes_ & (1 << fan_mode));
+}
+
+bool MitsubishiHeatPump::supports_swing_mode(
+        climate::ClimateSwingMode swing_mode) const {
+    return swing_mode < 8 &&
+        (this->supported_swing_modes_ & (1 << swing_mode));
+}
+
+void MitsubishiHeatPump::update_swing_horizontal(const char* swing) {
     this->horizontal_swing_state_ = swing;
 
+#ifdef USE_ESPMHP_VANE_SELECT
     if (this->horizontal_vane_select_ != nullptr &&
         this->horizontal_vane_select_->state != this->horizontal_swing_state_) {
         this->horizontal_vane_select_->publish_state(
             this->horizontal_swing_state_);  // Set current horizontal swing
                                              // position
     }
+#endif
 }
 
-void MitsubishiHeatPump::update_swing_vertical(const std::string &swing) {
+void MitsubishiHeatPump::update_swing_vertical(const char* swing) {
     this->vertical_swing_state_ = swing;
 
+#ifdef USE_ESPMHP_VANE_SELECT
     if (this->vertical_vane_select_ != nullptr &&
         this->vertical_vane_select_->state != this->vertical_swing_state_) {
         this->vertical_vane_select_->publish_state(
             this->vertical_swing_state_);  // Set current vertical swing position
     }
+#endif
 }
 
+#ifdef USE_ESPMHP_VANE_SELECT
 void MitsubishiHeatPump::set_vertical_vane_select(
     select::Select *vertical_vane_select) {
     this->vertical_vane_select_ = vertical_vane_select;
@@ -163,76 +413,45 @@ void MitsubishiHeatPump::set_horizontal_vane_select(
               this->on_horizontal_swing_change(value);
           });
 }
+#endif
 
 void MitsubishiHeatPump::on_vertical_swing_change(const std::string &swing) {
-    ESP_LOGD(TAG, "Setting vertical swing position");
+    ESPMHP_LOGD(TAG, "Setting vertical swing position");
     bool updated = false;
 
-    if (swing == "swing") {
-        hp->setVaneSetting("SWING");
-        updated = true;
-    } else if (swing == "auto") {
-        hp->setVaneSetting("AUTO");
-        updated = true;
-    } else if (swing == "up") {
-        hp->setVaneSetting("1");
-        updated = true;
-    } else if (swing == "up_center") {
-        hp->setVaneSetting("2");
-        updated = true;
-    } else if (swing == "center") {
-        hp->setVaneSetting("3");
-        updated = true;
-    } else if (swing == "down_center") {
-        hp->setVaneSetting("4");
-        updated = true;
-    } else if (swing == "down") {
-        hp->setVaneSetting("5");
+    uint8_t index = espmhp::find_option(swing.c_str(),
+            espmhp::VERTICAL_VANE_OPTIONS, espmhp::VANE_OPTION_COUNT);
+    if (index != espmhp::VANE_UNKNOWN) {
+        hp.setVaneSetting(espmhp::VERTICAL_VANE_SETTINGS[index]);
         updated = true;
     } else {
-        ESP_LOGW(TAG, "Invalid vertical vane position %s", swing);
+        ESP_LOGW(TAG, "Invalid vertical vane position %s", swing.c_str());
     }
 
-    ESP_LOGD(TAG, "Vertical vane - Was HeatPump updated? %s", YESNO(updated));
+    ESPMHP_LOGD(TAG, "Vertical vane - Was HeatPump updated? %s", YESNO(updated));
 
     // and the heat pump:
-    hp->update();
+    this->request_update(false);
 }
 
 void MitsubishiHeatPump::on_horizontal_swing_change(const std::string &swing) {
-    ESP_LOGD(TAG, "Setting horizontal swing position");
+    ESPMHP_LOGD(TAG, "Setting horizontal swing position");
     bool updated = false;
 
-    if (swing == "swing") {
-        hp->setWideVaneSetting("SWING");
-        updated = true;
-    } else if (swing == "auto") {
-        hp->setWideVaneSetting("<>");
-        updated = true;
-    } else if (swing == "left") {
-        hp->setWideVaneSetting("<<");
-        updated = true;
-    } else if (swing == "left_center") {
-        hp->setWideVaneSetting("<");
-        updated = true;
-    } else if (swing == "center") {
-        hp->setWideVaneSetting("|");
-        updated = true;
-    } else if (swing == "right_center") {
-        hp->setWideVaneSetting(">");
-        updated = true;
-    } else if (swing == "right") {
-        hp->setWideVaneSetting(">>");
+    uint8_t index = espmhp::find_option(swing.c_str(),
+            espmhp::HORIZONTAL_VANE_OPTIONS, espmhp::VANE_OPTION_COUNT);
+    if (index != espmhp::VANE_UNKNOWN) {
+        hp.setWideVaneSetting(espmhp::HORIZONTAL_VANE_SETTINGS[index]);
         updated = true;
     } else {
-        ESP_LOGW(TAG, "Invalid horizontal vane position %s", swing);
+        ESP_LOGW(TAG, "Invalid horizontal vane position %s", swing.c_str());
     }
 
-    ESP_LOGD(TAG, "Horizontal vane - Was HeatPump updated? %s", YESNO(updated));
+    ESPMHP_LOGD(TAG, "Horizontal vane - Was HeatPump updated? %s", YESNO(updated));
 
     // and the heat pump:
-    hp->update();
- }
+    this->request_update(false);
+}
 
 /**
  * Implement control of a MitsubishiHeatPump.
@@ -240,448 +459,730 @@ void MitsubishiHeatPump::on_horizontal_swing_change(const std::string &swing) {
  * Maps HomeAssistant/ESPHome modes to Mitsubishi modes.
  */
 void MitsubishiHeatPump::control(const climate::ClimateCall &call) {
-    ESP_LOGV(TAG, "Control called.");
+    ESPMHP_LOGV(TAG, "Control called.");
 
     bool updated = false;
     bool has_mode = call.get_mode().has_value();
     bool has_temp = call.get_target_temperature().has_value();
+    espmhp::Mode previous_mode = static_cast<espmhp::Mode>(this->mode);
     if (has_mode){
         this->mode = *call.get_mode();
     }
 
-    if (last_remote_temperature_sensor_update_.has_value()) {
-        // Some remote temperature sensors will only issue updates when a change
-        // in temperature occurs. 
-
-        // Assume a case where the idle sensor timeout is 12hrs and operating 
-        // timeout is 1hr. If the user changes the HP setpoint after 1.5hrs, the
-        // machine will switch to operating mode, the remote temperature 
-        // reading will expire and the HP will revert to it's internal 
-        // temperature sensor.
-
-        // This change ensures that if the user changes the machine setpoint,
-        // the remote sensor has an opportunity to issue an update to reflect
-        // the new change in temperature.
-        last_remote_temperature_sensor_update_ =
-            std::chrono::steady_clock::now();
+    // Some remote temperature sensors will only issue updates when a change
+    // in temperature occurs.
+
+    // Assume a case where the idle sensor timeout is 12hrs and operating
+    // timeout is 1hr. If the user changes the HP setpoint after 1.5hrs, the
+    // machine will switch to operating mode, the remote temperature
+    // reading will expire and the HP will revert to it's internal
+    // temperature sensor.
+
+    // This ensures that if the user changes the machine setpoint, the remote
+    // sensor has an opportunity to issue an update to reflect the new change
+    // in temperature.
+    this->remote_temperature_monitor_.refresh_remote_temperature(millis());
+
+    espmhp::Mode core_mode = static_cast<espmhp::Mode>(this->mode);
+    const char* hp_mode = espmhp::mode_to_setting(core_mode);
+    if (hp_mode != nullptr) {
+        hp.setModeSetting(hp_mode);
+        hp.setPowerSetting("ON");
     }
 
-    switch (this->mode) {
-        case climate::CLIMATE_MODE_COOL:
-            hp->setModeSetting("COOL");
-            hp->setPowerSetting("ON");
+    if (has_mode) {
+        if (hp_mode == nullptr) {
+            hp.setPowerSetting("OFF");
+        }
 
-            if (has_mode){
-                if (cool_setpoint.has_value() && !has_temp) {
-                    hp->setTemperature(cool_setpoint.value());
-                    this->target_temperature = cool_setpoint.value();
-                }
-                this->action = climate::CLIMATE_ACTION_IDLE;
-                updated = true;
-            }
-            break;
-        case climate::CLIMATE_MODE_HEAT:
-            hp->setModeSetting("HEAT");
-            hp->setPowerSetting("ON");
-            if (has_mode){
-                if (heat_setpoint.has_value() && !has_temp) {
-                    hp->setTemperature(heat_setpoint.value());
-                    this->target_temperature = heat_setpoint.value();
-                }
-                this->action = climate::CLIMATE_ACTION_IDLE;
-                updated = true;
-            }
-            break;
-        case climate::CLIMATE_MODE_DRY:
-            hp->setModeSetting("DRY");
-            hp->setPowerSetting("ON");
-            if (has_mode){
-                this->action = climate::CLIMATE_ACTION_DRYING;
-                updated = true;
-            }
-            break;
-        case climate::CLIMATE_MODE_HEAT_COOL:
-            hp->setModeSetting("AUTO");
-            hp->setPowerSetting("ON");
-            if (has_mode){
-                if (auto_setpoint.has_value() && !has_temp) {
-                    hp->setTemperature(auto_setpoint.value());
-                    this->target_temperature = auto_setpoint.value();
-                }
-                this->action = climate::CLIMATE_ACTION_IDLE;
-            }
-            updated = true;
-            break;
-        case climate::CLIMATE_MODE_FAN_ONLY:
-            hp->setModeSetting("FAN");
-            hp->setPowerSetting("ON");
-            if (has_mode){
-                this->action = climate::CLIMATE_ACTION_FAN;
-                updated = true;
-            }
-            break;
-        case climate::CLIMATE_MODE_OFF:
-        default:
-            if (has_mode){
-                hp->setPowerSetting("OFF");
-                this->action = climate::CLIMATE_ACTION_OFF;
-                updated = true;
-            }
-            break;
+        // Restore the last setpoint used in this mode, akin to the IR remote.
+        optional<float> saved_setpoint;
+        switch (this->mode) {
+            case climate::CLIMATE_MODE_COOL:
+                saved_setpoint = cool_setpoint;
+                break;
+            case climate::CLIMATE_MODE_HEAT:
+                saved_setpoint = heat_setpoint;
+                break;
+            case climate::CLIMATE_MODE_HEAT_COOL:
+                saved_setpoint = auto_setpoint;
+                break;
+            default:
+                break;
+        }
+        if (saved_setpoint.has_value() && !has_temp) {
+            hp.setTemperature(saved_setpoint.value());
+            this->target_temperature = saved_setpoint.value();
+        }
+
+        this->action = static_cast<climate::ClimateAction>(
+            espmhp::idle_action(core_mode));
+        updated = true;
     }
 
     if (has_temp){
-        ESP_LOGV(
+        ESPMHP_LOGV(
             "control", "Sending target temp: %.1f",
             *call.get_target_temperature()
         );
-        hp->setTemperature(*call.get_target_temperature());
+        hp.setTemperature(*call.get_target_temperature());
         this->target_temperature = *call.get_target_temperature();
         updated = true;
     }
 
-    //const char* FAN_MAP[6]         = {"AUTO", "QUIET", "1", "2", "3", "4"};
     if (call.get_fan_mode().has_value()) {
-        ESP_LOGV("control", "Requested fan mode is %s",
+        ESPMHP_LOGV("control", "Requested fan mode is %s",
                  climate::climate_fan_mode_to_string(*call.get_fan_mode()));
         this->fan_mode = *call.get_fan_mode();
-        switch(*call.get_fan_mode()) {
-            case climate::CLIMATE_FAN_OFF:
-                hp->setPowerSetting("OFF");
-                updated = true;
-                break;
-            case climate::CLIMATE_FAN_DIFFUSE:
-                hp->setFanSpeed("QUIET");
-                updated = true;
-                break;
-            case climate::CLIMATE_FAN_LOW:
-                hp->setFanSpeed("1");
-                updated = true;
-                break;
-            case climate::CLIMATE_FAN_MEDIUM:
-                hp->setFanSpeed("2");
-                updated = true;
-                break;
-            case climate::CLIMATE_FAN_MIDDLE:
-                hp->setFanSpeed("3");
-                updated = true;
-                break;
-            case climate::CLIMATE_FAN_HIGH:
-                hp->setFanSpeed("4");
-                updated = true;
-                break;
-            case climate::CLIMATE_FAN_ON:
-            case climate::CLIMATE_FAN_AUTO:
-            default:
-                hp->setFanSpeed("AUTO");
-                updated = true;
-                break;
+        const char* hp_fan = espmhp::fan_to_setting(
+            static_cast<espmhp::FanMode>(*call.get_fan_mode()));
+        if (hp_fan == nullptr) {
+            hp.setPowerSetting("OFF");
+        } else {
+            hp.setFanSpeed(hp_fan);
         }
+        updated = true;
     }
 
-
-    ESP_LOGV(TAG, "in the swing mode stage");
-    //const char* VANE_MAP[7]        = {"AUTO", "1", "2", "3", "4", "5", "SWING"};
+    ESPMHP_LOGV(TAG, "in the swing mode stage");
     if (call.get_swing_mode().has_value()) {
-        ESP_LOGV(TAG, "control - requested swing mode is %s",
+        ESPMHP_LOGV(TAG, "control - requested swing mode is %s",
                 climate::climate_swing_mode_to_string(*call.get_swing_mode()));
 
         this->swing_mode = *call.get_swing_mode();
-        switch(*call.get_swing_mode()) {
-            case climate::CLIMATE_SWING_OFF:
-                hp->setVaneSetting("AUTO");
-                hp->setWideVaneSetting("|");
-                updated = true;
-                break;
-            case climate::CLIMATE_SWING_VERTICAL:
-                hp->setVaneSetting("SWING");
-                hp->setWideVaneSetting("|");
-                updated = true;
-                break;
-            case climate::CLIMATE_SWING_HORIZONTAL:
-                hp->setVaneSetting("3");
-                hp->setWideVaneSetting("SWING");
-                updated = true;
-                break;
-            case climate::CLIMATE_SWING_BOTH:
-                hp->setVaneSetting("SWING");
-                hp->setWideVaneSetting("SWING");
-                updated = true;
-                break;
-            default:
-                ESP_LOGW(TAG, "control - received unsupported swing mode request.");
-
+        const char* vane;
+        const char* wide_vane;
+        if (espmhp::swing_to_settings(
+                static_cast<espmhp::SwingMode>(*call.get_swing_mode()),
+                &vane, &wide_vane)) {
+            hp.setVaneSetting(vane);
+            hp.setWideVaneSetting(wide_vane);
+            updated = true;
+        } else {
+            ESP_LOGW(TAG, "control - received unsupported swing mode request.");
         }
     }
-    ESP_LOGD(TAG, "control - Was HeatPump updated? %s", YESNO(updated));
+    ESPMHP_LOGD(TAG, "control - Was HeatPump updated? %s", YESNO(updated));
+
+#ifdef USE_ESPMHP_COORDINATION
+    if (this->relaxed_ && (has_mode || has_temp)) {
+        // The user's setpoint wins, until the budget is checked again.
+        hp.setTemperature(this->target_temperature);
+        this->relaxed_ = false;
+    }
+#endif
 
     // send the update back to esphome:
     this->publish_state();
     // and the heat pump:
-    hp->update();
+    this->request_update(
+        has_mode && espmhp::starts_compressor(previous_mode, core_mode));
 }
 
 void MitsubishiHeatPump::hpSettingsChanged() {
-    heatpumpSettings currentSettings = hp->getSettings();
+    this->poll_scheduler_.last_answer_changed();
+    heatpumpSettings currentSettings = hp.getSettings();
 
     if (currentSettings.power == NULL) {
         /*
          * We should always get a valid pointer here once the HeatPump
          * component fully initializes. If HeatPump hasn't read the settings
-         * from the unit yet (hp->connect() doesn't do this, sadly), we'll need
+         * from the unit yet (hp.connect() doesn't do this, sadly), we'll need
          * to punt on the update. Likely not an issue when run in callback
          * mode, but that isn't working right yet.
          */
         ESP_LOGW(TAG, "Waiting for HeatPump to read the settings the first time.");
-        esphome::delay(10);
         return;
     }
+    this->counters_.settings_changes++;
+
+    if (this->provisional_) {
+        ESP_LOGI(TAG, "Settings read from the unit, state is no longer provisional.");
+        this->provisional_ = false;
+    }
+
+    espmhp::DecodedSettings decoded =
+        espmhp::decode_settings(to_unit_settings(currentSettings));
 
     /*
      * ************ HANDLE POWER AND MODE CHANGES ***********
-     * https://github.com/geoffdavis/HeatPump/blob/stream/src/HeatPump.h#L125
-     * const char* POWER_MAP[2]       = {"OFF", "ON"};
-     * const char* MODE_MAP[5]        = {"HEAT", "DRY", "COOL", "FAN", "AUTO"};
      */
-    if (strcmp(currentSettings.power, "ON") == 0) {
-        if (strcmp(currentSettings.mode, "HEAT") == 0) {
-            this->mode = climate::CLIMATE_MODE_HEAT;
-            if (heat_setpoint != currentSettings.temperature) {
-                heat_setpoint = currentSettings.temperature;
-                save(currentSettings.temperature, heat_storage);
-            }
-            this->action = climate::CLIMATE_ACTION_IDLE;
-        } else if (strcmp(currentSettings.mode, "DRY") == 0) {
-            this->mode = climate::CLIMATE_MODE_DRY;
-            this->action = climate::CLIMATE_ACTION_DRYING;
-        } else if (strcmp(currentSettings.mode, "COOL") == 0) {
-            this->mode = climate::CLIMATE_MODE_COOL;
-            if (cool_setpoint != currentSettings.temperature) {
-                cool_setpoint = currentSettings.temperature;
-                save(currentSettings.temperature, cool_storage);
-            }
-            this->action = climate::CLIMATE_ACTION_IDLE;
-        } else if (strcmp(currentSettings.mode, "FAN") == 0) {
-            this->mode = climate::CLIMATE_MODE_FAN_ONLY;
-            this->action = climate::CLIMATE_ACTION_FAN;
-        } else if (strcmp(currentSettings.mode, "AUTO") == 0) {
-            this->mode = climate::CLIMATE_MODE_HEAT_COOL;
-            if (auto_setpoint != currentSettings.temperature) {
-                auto_setpoint = currentSettings.temperature;
-                save(currentSettings.temperature, auto_storage);
-            }
-            this->action = climate::CLIMATE_ACTION_IDLE;
-        } else {
-            ESP_LOGW(
-                    TAG,
-                    "Unknown climate mode value %s received from HeatPump",
-                    currentSettings.mode
-            );
+    if (decoded.mode_known) {
+        this->mode = static_cast<climate::ClimateMode>(decoded.mode);
+        this->action = static_cast<climate::ClimateAction>(decoded.action);
+
+        // Remember the setpoint used in each mode, akin to the IR remote,
+        // as long as it is one the hardware accepts and the user chose.
+        switch (espmhp::setpoint_slot(decoded, this->setpoint_relaxed(),
+                                      this->failsafe_active_)) {
+            case espmhp::SETPOINT_HEAT:
+                if (heat_setpoint != decoded.temperature) {
+                    heat_setpoint = decoded.temperature;
+                    save(decoded.temperature, heat_storage);
+                }
+                break;
+            case espmhp::SETPOINT_COOL:
+                if (cool_setpoint != decoded.temperature) {
+                    cool_setpoint = decoded.temperature;
+                    save(decoded.temperature, cool_storage);
+                }
+                break;
+            case espmhp::SETPOINT_AUTO:
+                if (auto_setpoint != decoded.temperature) {
+                    auto_setpoint = decoded.temperature;
+                    save(decoded.temperature, auto_storage);
+                }
+                break;
+            default:
+                break;
         }
     } else {
-        this->mode = climate::CLIMATE_MODE_OFF;
-        this->action = climate::CLIMATE_ACTION_OFF;
+        ESP_LOGW(
+                TAG,
+                "Unknown climate mode value %s received from HeatPump",
+                or_unknown(currentSettings.mode)
+        );
     }
 
     ESP_LOGI(TAG, "Climate mode is: %i", this->mode);
 
     /*
      * ******* HANDLE FAN CHANGES ********
-     *
-     * const char* FAN_MAP[6]         = {"AUTO", "QUIET", "1", "2", "3", "4"};
      */
-    if (strcmp(currentSettings.fan, "QUIET") == 0) {
-        this->fan_mode = climate::CLIMATE_FAN_DIFFUSE;
-    } else if (strcmp(currentSettings.fan, "1") == 0) {
-            this->fan_mode = climate::CLIMATE_FAN_LOW;
-    } else if (strcmp(currentSettings.fan, "2") == 0) {
-            this->fan_mode = climate::CLIMATE_FAN_MEDIUM;
-    } else if (strcmp(currentSettings.fan, "3") == 0) {
-            this->fan_mode = climate::CLIMATE_FAN_MIDDLE;
-    } else if (strcmp(currentSettings.fan, "4") == 0) {
-            this->fan_mode = climate::CLIMATE_FAN_HIGH;
-    } else { //case "AUTO" or default:
-        this->fan_mode = climate::CLIMATE_FAN_AUTO;
-    }
+    this->fan_mode = static_cast<climate::ClimateFanMode>(decoded.fan);
     ESP_LOGI(TAG, "Fan mode is: %i", this->fan_mode.value_or(-1));
 
-    /* ******** HANDLE MITSUBISHI VANE CHANGES ********
-     * const char* VANE_MAP[7]        = {"AUTO", "1", "2", "3", "4", "5", "SWING"};
-     */
-    if (strcmp(currentSettings.vane, "SWING") == 0 &&
-        strcmp(currentSettings.wideVane, "SWING") == 0) {
-        this->swing_mode = climate::CLIMATE_SWING_BOTH;
-    } else if (strcmp(currentSettings.vane, "SWING") == 0) {
-        this->swing_mode = climate::CLIMATE_SWING_VERTICAL;
-    } else if (strcmp(currentSettings.wideVane, "SWING") == 0) {
-        this->swing_mode = climate::CLIMATE_SWING_HORIZONTAL;
-    } else {
-        this->swing_mode = climate::CLIMATE_SWING_OFF;
-    }
+    /* ******** HANDLE MITSUBISHI VANE CHANGES ******** */
+    this->swing_mode = static_cast<climate::ClimateSwingMode>(decoded.swing);
     ESP_LOGI(TAG, "Swing mode is: %i", this->swing_mode);
-    if (strcmp(currentSettings.vane, "SWING") == 0) {
-        this->update_swing_vertical("swing");
-    } else if (strcmp(currentSettings.vane, "AUTO") == 0) {
-        this->update_swing_vertical("auto");
-    } else if (strcmp(currentSettings.vane, "1") == 0) {
-        this->update_swing_vertical("up");
-    } else if (strcmp(currentSettings.vane, "2") == 0) {
-        this->update_swing_vertical("up_center");
-    } else if (strcmp(currentSettings.vane, "3") == 0) {
-        this->update_swing_vertical("center");
-    } else if (strcmp(currentSettings.vane, "4") == 0) {
-        this->update_swing_vertical("down_center");
-    } else if (strcmp(currentSettings.vane, "5") == 0) {
-        this->update_swing_vertical("down");
-    }
-
-    ESP_LOGI(TAG, "Vertical vane mode is: %s", currentSettings.vane);
-
-    if (strcmp(currentSettings.wideVane, "SWING") == 0) {
-        this->update_swing_horizontal("swing");
-    } else if (strcmp(currentSettings.wideVane, "<>") == 0) {
-        this->update_swing_horizontal("auto");
-    } else if (strcmp(currentSettings.wideVane, "<<") == 0) {
-        this->update_swing_horizontal("left");
-    } else if (strcmp(currentSettings.wideVane, "<") == 0) {
-        this->update_swing_horizontal("left_center");
-    } else if (strcmp(currentSettings.wideVane, "|") == 0) {
-        this->update_swing_horizontal("center");
-    } else if (strcmp(currentSettings.wideVane, ">") == 0) {
-        this->update_swing_horizontal("right_center");
-    } else if (strcmp(currentSettings.wideVane, ">>") == 0) {
-        this->update_swing_horizontal("right");
-    }
-
-    ESP_LOGI(TAG, "Horizontal vane mode is: %s", currentSettings.wideVane);
+
+    if (decoded.vertical_vane != espmhp::VANE_UNKNOWN) {
+        this->update_swing_vertical(
+            espmhp::VERTICAL_VANE_OPTIONS[decoded.vertical_vane]);
+    }
+    ESP_LOGI(TAG, "Vertical vane mode is: %s", or_unknown(currentSettings.vane));
+
+    if (decoded.horizontal_vane != espmhp::VANE_UNKNOWN) {
+        this->update_swing_horizontal(
+            espmhp::HORIZONTAL_VANE_OPTIONS[decoded.horizontal_vane]);
+    }
+    ESP_LOGI(TAG, "Horizontal vane mode is: %s", or_unknown(currentSettings.wideVane));
 
     /*
      * ******** HANDLE TARGET TEMPERATURE CHANGES ********
      */
-    this->target_temperature = currentSettings.temperature;
+    if (this->setpoint_relaxed()) {
+        // Keep publishing the setpoint the user asked for.
+        ESPMHP_LOGD(TAG, "Unit setpoint relaxed to %f", decoded.temperature);
+    } else if (decoded.temperature_valid) {
+        this->target_temperature = decoded.temperature;
+    } else {
+        ESP_LOGW(TAG, "Ignoring out of range target temp %f", decoded.temperature);
+    }
     ESP_LOGI(TAG, "Target temp is: %f", this->target_temperature);
 
     /*
      * ******** Publish state back to ESPHome. ********
      */
     this->publish_state();
+    this->persist_state();
 }
 
 /**
  * Report changes in the current temperature sensed by the HeatPump.
  */
 void MitsubishiHeatPump::hpStatusChanged(heatpumpStatus currentStatus) {
+    this->poll_scheduler_.last_answer_changed();
+    this->counters_.status_changes++;
     this->current_temperature = currentStatus.roomTemperature;
-    switch (this->mode) {
-        case climate::CLIMATE_MODE_HEAT:
-            if (currentStatus.operating) {
-                this->action = climate::CLIMATE_ACTION_HEATING;
-            }
-            else {
-                this->action = climate::CLIMATE_ACTION_IDLE;
-            }
-            break;
-        case climate::CLIMATE_MODE_COOL:
-            if (currentStatus.operating) {
-                this->action = climate::CLIMATE_ACTION_COOLING;
-            }
-            else {
-                this->action = climate::CLIMATE_ACTION_IDLE;
-            }
-            break;
-        case climate::CLIMATE_MODE_HEAT_COOL:
-            this->action = climate::CLIMATE_ACTION_IDLE;
-            if (currentStatus.operating) {
-              if (this->current_temperature > this->target_temperature) {
-                  this->action = climate::CLIMATE_ACTION_COOLING;
-              } else if (this->current_temperature < this->target_temperature) {
-                  this->action = climate::CLIMATE_ACTION_HEATING;
-              }
-            }
-            break;
-        case climate::CLIMATE_MODE_DRY:
-            if (currentStatus.operating) {
-                this->action = climate::CLIMATE_ACTION_DRYING;
-            }
-            else {
-                this->action = climate::CLIMATE_ACTION_IDLE;
-            }
-            break;
-        case climate::CLIMATE_MODE_FAN_ONLY:
-            this->action = climate::CLIMATE_ACTION_FAN;
-            break;
-        default:
-            this->action = climate::CLIMATE_ACTION_OFF;
-    }
+    this->action = static_cast<climate::ClimateAction>(espmhp::status_action(
+        static_cast<espmhp::Mode>(this->mode), currentStatus.operating,
+        this->current_temperature, this->target_temperature));
 
     this->operating_ = currentStatus.operating;
 
+#ifdef USE_ESPMHP_HISTORY
+    this->record_history();
+#endif
+
+#ifdef USE_ESPMHP_PREHEAT
+    if (this->thermal_model_.observe(millis(),
+            static_cast<espmhp::Mode>(this->mode), this->operating_,
+            this->regulated_temperature(), this->target_temperature)) {
+        espmhp::ThermalModelState state = this->thermal_model_.save();
+        if (this->thermal_save_schedule_.due(millis(), state)) {
+            this->thermal_storage_.save(&state);
+        }
+    }
+#endif
+
     this->publish_state();
 }
 
-void MitsubishiHeatPump::set_remote_temperature(float temp) {
-    ESP_LOGD(TAG, "Setting remote temp: %.1f", temp);
-    if (temp > 0) {
-        last_remote_temperature_sensor_update_ = 
-            std::chrono::steady_clock::now();
-    } else {
-        last_remote_temperature_sensor_update_.reset();
+bool MitsubishiHeatPump::is_provisional() const {
+    return this->provisional_;
+}
+
+uint32_t MitsubishiHeatPump::get_unit_id() const {
+    return this->unit_id_;
+}
+
+espmhp::UpdateResult MitsubishiHeatPump::last_update_result() const {
+    return this->last_update_result_;
+}
+
+/**
+ * Publish the last state confirmed by the unit before we rebooted, so that
+ * the climate entity doesn't show bogus values until the first settings
+ * frame is read. The state is marked provisional until then.
+ */
+void MitsubishiHeatPump::restore_state() {
+    espmhp::PersistedState state;
+    if (!this->state_storage_.load(&state)) {
+        ESPMHP_LOGD(TAG, "No saved state to restore.");
+        return;
+    }
+    if (state.mode > espmhp::MODE_DRY || state.fan > espmhp::FAN_DIFFUSE ||
+            state.swing > espmhp::SWING_HORIZONTAL) {
+        ESP_LOGW(TAG, "Ignoring invalid saved state.");
+        return;
+    }
+    this->persisted_state_ = state;
+
+    this->mode = static_cast<climate::ClimateMode>(state.mode);
+    this->fan_mode = static_cast<climate::ClimateFanMode>(state.fan);
+    this->swing_mode = static_cast<climate::ClimateSwingMode>(state.swing);
+    this->target_temperature = espmhp::decode_tenths(state.target_temperature);
+
+    if (state.vertical_vane < espmhp::VANE_OPTION_COUNT) {
+        this->update_swing_vertical(
+            espmhp::VERTICAL_VANE_OPTIONS[state.vertical_vane]);
+    }
+    if (state.horizontal_vane < espmhp::VANE_OPTION_COUNT) {
+        this->update_swing_horizontal(
+            espmhp::HORIZONTAL_VANE_OPTIONS[state.horizontal_vane]);
+    }
+
+    this->provisional_ = true;
+    ESP_LOGI(TAG, "Publishing provisional state saved before the last reboot.");
+    this->publish_state();
+}
+
+void MitsubishiHeatPump::persist_state() {
+    if (this->provisional_) {
+        // Only persist state which was confirmed by the unit.
+        return;
+    }
+    if (this->failsafe_active_) {
+        // Not the user's settings; those are restored when the fail-safe
+        // policy is lifted, and persisted then.
+        return;
     }
 
-    this->hp->setRemoteTemperature(temp);
+    espmhp::PersistedState state{};
+    state.mode = this->mode;
+    state.fan = this->fan_mode.value_or(climate::CLIMATE_FAN_AUTO);
+    state.swing = this->swing_mode;
+    state.vertical_vane = espmhp::find_option(this->vertical_swing_state_,
+            espmhp::VERTICAL_VANE_OPTIONS, espmhp::VANE_OPTION_COUNT);
+    state.horizontal_vane = espmhp::find_option(this->horizontal_swing_state_,
+            espmhp::HORIZONTAL_VANE_OPTIONS, espmhp::VANE_OPTION_COUNT);
+    state.target_temperature = espmhp::encode_tenths(this->target_temperature);
+
+    // Skip identical writes; flash backed preferences are additionally
+    // coalesced by ESPHome's flash_write_interval.
+    if (state == this->persisted_state_) {
+        return;
+    }
+    this->persisted_state_ = state;
+    this->state_storage_.save(&state);
+}
+
+#ifdef USE_ESPMHP_PREHEAT
+void MitsubishiHeatPump::set_preheat_default_rate(float rate) {
+    this->thermal_model_.set_default_rate(rate);
+}
+
+void MitsubishiHeatPump::set_preheat_max_lead_time(uint32_t ms) {
+    this->preheat_max_lead_time_ = ms;
+}
+
+float MitsubishiHeatPump::regulated_temperature() const {
+    const espmhp::RemoteTemperatureMonitor& remote =
+        this->remote_temperature_monitor_;
+    return remote.remote_temperature_active() ?
+        remote.remote_temperature() : this->current_temperature;
+}
+
+void MitsubishiHeatPump::schedule_target(climate::ClimateMode mode,
+                                         float temperature, uint32_t seconds) {
+    if (seconds > ESPMHP_MAX_SCHEDULE_SECONDS) {
+        // Also catches negative durations converted from int.
+        ESP_LOGW(TAG, "Not scheduling a target %u s away, the limit is %u s",
+                 (unsigned) seconds, (unsigned) ESPMHP_MAX_SCHEDULE_SECONDS);
+        return;
+    }
+    ESP_LOGI(TAG, "Scheduling %s at %.1f in %u s",
+             climate::climate_mode_to_string(mode), temperature,
+             (unsigned) seconds);
+    this->target_scheduled_ = true;
+    this->scheduled_mode_ = mode;
+    this->scheduled_temperature_ = espmhp::clamp_setpoint(temperature);
+    this->scheduled_deadline_ = millis() + seconds * 1000;
+    this->check_scheduled_target();
+}
+
+void MitsubishiHeatPump::cancel_scheduled_target() {
+    this->target_scheduled_ = false;
+}
+
+uint32_t MitsubishiHeatPump::predict_lead_time(climate::ClimateMode mode,
+                                               float temperature) {
+    return this->thermal_model_.lead_time(static_cast<espmhp::Mode>(mode),
+            this->regulated_temperature(), temperature) / 1000;
+}
+
+/**
+ * Start the scheduled target once the predicted time to reach it is about
+ * what is left before the deadline.
+ */
+void MitsubishiHeatPump::check_scheduled_target() {
+    if (!this->target_scheduled_) {
+        return;
+    }
+
+    uint32_t now = millis();
+    uint32_t lead = this->thermal_model_.lead_time(
+        static_cast<espmhp::Mode>(this->scheduled_mode_),
+        this->regulated_temperature(), this->scheduled_temperature_);
+    if (lead > this->preheat_max_lead_time_) {
+        lead = this->preheat_max_lead_time_;
+    }
+    // Signed, so that a deadline in the past starts right away.
+    int32_t remaining = (int32_t) (this->scheduled_deadline_ - now);
+    if (remaining > (int32_t) lead) {
+        return;
+    }
+
+    ESP_LOGI(TAG, "Starting scheduled target %.1f, predicted to take %u s",
+             this->scheduled_temperature_, (unsigned) (lead / 1000));
+    this->target_scheduled_ = false;
+    auto call = this->make_call();
+    call.set_mode(this->scheduled_mode_);
+    call.set_target_temperature(this->scheduled_temperature_);
+    call.perform();
+}
+#endif
+
+#ifdef USE_ESPMHP_HISTORY
+void MitsubishiHeatPump::record_history() {
+    espmhp::HistorySample sample;
+    sample.room_temperature = this->current_temperature;
+    sample.target_temperature = this->target_temperature;
+    sample.operating = this->operating_;
+    sample.remote_temperature =
+        this->remote_temperature_monitor_.remote_temperature_active();
+    this->history_.record(millis(), sample);
+}
+
+void MitsubishiHeatPump::set_history_storage(espmhp::HistoryBucket* fine,
+                                             size_t fine_count,
+                                             espmhp::HistoryBucket* coarse,
+                                             size_t coarse_count) {
+    this->history_.set_storage(fine, fine_count, coarse, coarse_count);
+}
+
+void MitsubishiHeatPump::set_history_periods(uint32_t fine_ms,
+                                             uint32_t coarse_ms) {
+    this->history_.set_periods(fine_ms, coarse_ms);
+}
+
+size_t MitsubishiHeatPump::export_history(uint8_t tier, size_t first,
+                                          uint8_t* buffer, size_t length) {
+    return this->history_.export_tier(
+        tier == espmhp::HISTORY_COARSE ? espmhp::HISTORY_COARSE : espmhp::HISTORY_FINE,
+        millis(), first, buffer, length);
+}
+#endif
+
+void MitsubishiHeatPump::set_remote_temperature(float temp) {
+    ESPMHP_LOGD(TAG, "Setting remote temp: %.1f", temp);
+    this->remote_temperature_monitor_.set_remote_temperature(millis(), temp);
+    this->hp.setRemoteTemperature(temp);
 }
 
 void MitsubishiHeatPump::ping() {
-    ESP_LOGD(TAG, "Ping request received");
-    last_ping_request_ = std::chrono::steady_clock::now();
+    ESPMHP_LOGD(TAG, "Ping request received");
+    this->remote_temperature_monitor_.ping(millis());
+
+    if (this->failsafe_active_) {
+        this->exit_failsafe();
+    }
 }
 
 void MitsubishiHeatPump::set_remote_operating_timeout_minutes(int minutes) {
-    ESP_LOGD(TAG, "Setting remote operating timeout time: %d minutes", minutes);
-    remote_operating_timeout_ = std::chrono::minutes(minutes);
+    ESPMHP_LOGD(TAG, "Setting remote operating timeout time: %d minutes", minutes);
+    this->remote_temperature_monitor_.set_operating_timeout_minutes(minutes);
 }
 
 void MitsubishiHeatPump::set_remote_idle_timeout_minutes(int minutes) {
-    ESP_LOGD(TAG, "Setting remote idle timeout time: %d minutes", minutes);
-    remote_idle_timeout_ = std::chrono::minutes(minutes);
+    ESPMHP_LOGD(TAG, "Setting remote idle timeout time: %d minutes", minutes);
+    this->remote_temperature_monitor_.set_idle_timeout_minutes(minutes);
 }
 
 void MitsubishiHeatPump::set_remote_ping_timeout_minutes(int minutes) {
-    ESP_LOGD(TAG, "Setting remote ping timeout time: %d minutes", minutes);
-    remote_ping_timeout_ = std::chrono::minutes(minutes);
+    ESPMHP_LOGD(TAG, "Setting remote ping timeout time: %d minutes", minutes);
+    this->remote_temperature_monitor_.set_ping_timeout_minutes(minutes);
+}
+
+void MitsubishiHeatPump::set_failsafe_mode(climate::ClimateMode mode) {
+    this->failsafe_.mode = static_cast<espmhp::Mode>(mode);
+}
+
+void MitsubishiHeatPump::set_failsafe_target_temperature(float temperature) {
+    this->failsafe_.target_temperature = espmhp::clamp_setpoint(temperature);
+}
+
+void MitsubishiHeatPump::set_failsafe_min_room_temperature(float temperature) {
+    this->failsafe_.min_room_temperature = temperature;
+}
+
+void MitsubishiHeatPump::set_failsafe_max_room_temperature(float temperature) {
+    this->failsafe_.max_room_temperature = temperature;
+}
+
+/**
+ * Apply the fail-safe profile after the controller stopped pinging us,
+ * remembering the current settings so they can be restored later.
+ */
+void MitsubishiHeatPump::enter_failsafe() {
+    ESP_LOGW(TAG, "Controller unreachable, applying fail-safe policy.");
+    this->failsafe_saved_settings_ = hp.getSettings();
+    this->failsafe_active_ = true;
+
+    bool updated = false;
+    if (this->failsafe_.mode.has_value()) {
+        const char* hp_mode = espmhp::mode_to_setting(*this->failsafe_.mode);
+        if (hp_mode == nullptr) {
+            hp.setPowerSetting("OFF");
+        } else {
+            hp.setModeSetting(hp_mode);
+            hp.setPowerSetting("ON");
+        }
+        updated = true;
+    }
+
+    if (this->failsafe_.target_temperature.has_value()) {
+        hp.setTemperature(*this->failsafe_.target_temperature);
+        updated = true;
+    }
+
+    ESPMHP_LOGD(TAG, "Fail-safe - Was HeatPump updated? %s", YESNO(updated));
+    if (updated) {
+        this->send_update();
+    }
+
+    this->enforce_failsafe_guards();
+}
+
+/**
+ * Keep the room within the configured fail-safe bounds, forcing the unit to
+ * heat or cool when it drifts outside of them.
+ */
+void MitsubishiHeatPump::enforce_failsafe_guards() {
+    espmhp::GuardDecision decision = espmhp::failsafe_guard(
+        this->failsafe_, this->current_temperature,
+        to_unit_settings(hp.getSettings()));
+
+    switch (decision.action) {
+        case espmhp::GUARD_HEAT:
+            ESP_LOGW(TAG, "Fail-safe - room at %.1f, forcing HEAT to %.1f",
+                     this->current_temperature, decision.setpoint);
+            hp.setModeSetting("HEAT");
+            break;
+        case espmhp::GUARD_COOL:
+            ESP_LOGW(TAG, "Fail-safe - room at %.1f, forcing COOL to %.1f",
+                     this->current_temperature, decision.setpoint);
+            hp.setModeSetting("COOL");
+            break;
+        case espmhp::GUARD_NONE:
+        default:
+            return;
+    }
+    hp.setPowerSetting("ON");
+    hp.setTemperature(decision.setpoint);
+    this->send_update();
+}
+
+/**
+ * Restore the settings that were in effect before the fail-safe policy was
+ * applied.
+ */
+void MitsubishiHeatPump::exit_failsafe() {
+    ESP_LOGI(TAG, "Controller reachable again, leaving fail-safe mode.");
+    this->failsafe_active_ = false;
+
+    if (!espmhp::settings_complete(
+            to_unit_settings(this->failsafe_saved_settings_))) {
+        // Nothing usable had been read from the unit, keep the current
+        // settings.
+        return;
+    }
+    hp.setSettings(this->failsafe_saved_settings_);
+    this->send_update();
 }
 
 void MitsubishiHeatPump::enforce_remote_temperature_sensor_timeout() {
-    // Handle ping timeouts.
-    if (remote_ping_timeout_.has_value() && last_ping_request_.has_value()) {
-        auto time_since_last_ping =
-            std::chrono::steady_clock::now() - last_ping_request_.value();
-        if(time_since_last_ping > remote_ping_timeout_.value()) {
+    if (this->failsafe_active_) {
+        this->enforce_failsafe_guards();
+    }
+
+    switch (this->remote_temperature_monitor_.check(millis(), this->operating_)) {
+        case espmhp::RemoteTemperatureMonitor::EVENT_PING_TIMEOUT:
             ESP_LOGW(TAG, "Ping timeout.");
+            this->counters_.ping_timeouts++;
             this->set_remote_temperature(0);
-            last_ping_request_.reset();
-            return;
+            if (this->failsafe_.configured()) {
+                this->enter_failsafe();
+            }
+            break;
+        case espmhp::RemoteTemperatureMonitor::EVENT_REMOTE_TEMPERATURE_TIMEOUT:
+            ESP_LOGW(TAG, "Set remote temperature timeout, operating=%d", this->operating_);
+            this->counters_.remote_temperature_timeouts++;
+            this->set_remote_temperature(0);
+            break;
+        case espmhp::RemoteTemperatureMonitor::EVENT_NONE:
+        default:
+            break;
+    }
+}
+
+#ifdef USE_ESPMHP_COORDINATION
+void MitsubishiHeatPump::set_start_spacing(uint32_t ms) {
+    coordinator_.set_start_spacing(ms);
+    this->coordinated_ = true;
+}
+
+void MitsubishiHeatPump::set_max_operating_units(uint8_t units) {
+    coordinator_.set_max_operating_units(units);
+    this->coordinated_ = true;
+}
+
+void MitsubishiHeatPump::set_peers(uint16_t port, const std::string& key) {
+    peer_port_ = port;
+    peer_key_ = key;
+    this->coordinated_ = true;
+}
+
+void MitsubishiHeatPump::set_setpoint_relaxation(float degrees) {
+    this->setpoint_relaxation_ = degrees;
+    this->coordinated_ = true;
+}
+
+/**
+ * Relax the setpoint while more units are operating than the budget allows,
+ * and go back to the user's setpoint once there is room again.
+ */
+void MitsubishiHeatPump::enforce_demand_limit() {
+    uint32_t now = millis();
+    coordinator_.set_operating(this->unit_id_, this->operating_, true, now);
+    if (this->start_pending_ || this->failsafe_active_ || this->provisional_) {
+        return;
+    }
+
+    if (this->relaxed_) {
+        if (coordinator_.may_restore(this->unit_id_, now)) {
+            ESP_LOGI(TAG, "Operating units within budget, restoring setpoint %.1f",
+                     this->target_temperature);
+            this->relaxed_ = false;
+            hp.setTemperature(this->target_temperature);
+            this->request_update(true);
         }
+        return;
     }
 
-    // Handle set_remote_temperature timeouts.
-    auto remote_set_temperature_timeout =
-        this->operating_ ? remote_operating_timeout_ : remote_idle_timeout_;
-    if (remote_set_temperature_timeout.has_value() &&
-            last_remote_temperature_sensor_update_.has_value()) {
-        auto time_since_last_temperature_update =
-            std::chrono::steady_clock::now() - last_remote_temperature_sensor_update_.value();
-        if (time_since_last_temperature_update > remote_set_temperature_timeout.value()) {
-            ESP_LOGW(TAG, "Set remote temperature timeout, operating=%d", this->operating_);
-            this->set_remote_temperature(0);
+    if (!coordinator_.should_relax(this->unit_id_, now)) {
+        return;
+    }
+    float setpoint;
+    switch (this->action) {
+        case climate::CLIMATE_ACTION_HEATING:
+            setpoint = this->target_temperature - this->setpoint_relaxation_;
+            break;
+        case climate::CLIMATE_ACTION_COOLING:
+        case climate::CLIMATE_ACTION_DRYING:
+            setpoint = this->target_temperature + this->setpoint_relaxation_;
+            break;
+        default:
             return;
+    }
+    setpoint = espmhp::clamp_setpoint(setpoint);
+    ESP_LOGI(TAG, "%u units operating, relaxing setpoint to %.1f",
+             coordinator_.operating_units(now), setpoint);
+    this->relaxed_ = true;
+    hp.setTemperature(setpoint);
+    this->send_update();
+}
+
+void MitsubishiHeatPump::receive_peer_status() {
+    uint32_t now = millis();
+    uint8_t buffer[espmhp::PEER_STATUS_SIZE];
+
+    while (peer_udp_.parsePacket() > 0) {
+        int length = peer_udp_.read(buffer, sizeof(buffer));
+        espmhp::PeerStatus status;
+        if (length <= 0 || !espmhp::decode_peer_status(buffer, length,
+                (const uint8_t*) peer_key_.data(), peer_key_.size(), &status)) {
+            ESPMHP_LOGV(TAG, "Dropping unauthenticated peer status.");
+            continue;
+        }
+        if (status.session == peer_session_) {
+            // Our own broadcast.
+            continue;
+        }
+        if (!peer_replay_guard_.accept(status.session, status.sequence)) {
+            ESPMHP_LOGV(TAG, "Dropping replayed peer status.");
+            continue;
+        }
+        coordinator_.set_operating(status.unit_id, status.operating, false, now);
+        if (status.last_start_age != espmhp::PEER_NO_START) {
+            coordinator_.note_peer_start(now, status.last_start_age);
         }
     }
 }
 
+void MitsubishiHeatPump::send_peer_status() {
+    uint32_t now = millis();
+    uint32_t last_start;
+
+    espmhp::PeerStatus status{};
+    status.unit_id = this->unit_id_;
+    status.operating = this->operating_;
+    status.last_start_age = coordinator_.last_start(&last_start) ?
+        now - last_start : espmhp::PEER_NO_START;
+    status.session = peer_session_;
+    status.sequence = ++peer_sequence_;
+
+    uint8_t buffer[espmhp::PEER_STATUS_SIZE];
+    size_t length = espmhp::encode_peer_status(status,
+            (const uint8_t*) peer_key_.data(), peer_key_.size(), buffer,
+            sizeof(buffer));
+    if (!peer_udp_.beginPacket(IPAddress(255, 255, 255, 255), peer_port_)) {
+        ESPMHP_LOGV(TAG, "Unable to send peer status, network not ready.");
+        return;
+    }
+    peer_udp_.write(buffer, length);
+    peer_udp_.endPacket();
+}
+#endif
+
 void MitsubishiHeatPump::setup() {
     // This will be called by App.setup()
+    uint32_t free_heap_before = ESP.getFreeHeap();
     this->banner();
+    // Unique across nodes, as long as the node names are.
+    this->unit_id_ = fnv1_hash(App.get_name() + "/" + this->get_object_id());
+
     ESP_LOGCONFIG(TAG, "Setting up UART...");
 
     if (!this->verify_serial()) {
@@ -689,8 +1190,7 @@ void MitsubishiHeatPump::setup() {
         return;
     }
 
-    ESP_LOGCONFIG(TAG, "Initializing new HeatPump object.");
-    this->hp = new HeatPump();
+    ESP_LOGCONFIG(TAG, "Initializing HeatPump object.");
     this->current_temperature = NAN;
     this->target_temperature = NAN;
     this->fan_mode = climate::CLIMATE_FAN_OFF;
@@ -698,20 +1198,31 @@ void MitsubishiHeatPump::setup() {
     this->vertical_swing_state_ = "auto";
     this->horizontal_swing_state_ = "auto";
 
+    // Stored in RTC memory where available (ESP8266 unless
+    // esp8266_restore_from_flash is set), in flash otherwise.
+    state_storage_ = global_preferences->make_preference<espmhp::PersistedState>(
+            this->get_object_id_hash() + 4);
+    this->restore_state();
+
 #ifdef USE_CALLBACKS
-    hp->setSettingsChangedCallback(
+    hp.setSettingsChangedCallback(
             [this]() {
                 this->hpSettingsChanged();
             }
     );
 
-    hp->setStatusChangedCallback(
+    hp.setStatusChangedCallback(
             [this](heatpumpStatus currentStatus) {
                 this->hpStatusChanged(currentStatus);
             }
     );
 
-    hp->setPacketCallback(this->log_packet);    
+    hp.setPacketCallback(
+            [this](byte* packet, unsigned int length, char* packetDirection) {
+                log_packet(packet, length, packetDirection);
+                this->on_packet(packet, length);
+            }
+    );
 #endif
 
     ESP_LOGCONFIG(
@@ -722,9 +1233,9 @@ void MitsubishiHeatPump::setup() {
             YESNO((void *)this->get_hw_serial_() == (void *)&Serial)
     );
 
-    ESP_LOGCONFIG(TAG, "Calling hp->connect(%p)", this->get_hw_serial_());
-    if (hp->connect(this->get_hw_serial_(), this->baud_, this->rx_pin_, this->tx_pin_)) {
-        hp->sync();
+    ESP_LOGCONFIG(TAG, "Calling hp.connect(%p)", this->get_hw_serial_());
+    if (hp.connect(this->get_hw_serial_(), this->baud_, this->rx_pin_, this->tx_pin_)) {
+        hp.sync();
     }
     else {
         ESP_LOGCONFIG(
@@ -735,6 +1246,18 @@ void MitsubishiHeatPump::setup() {
         this->mark_failed();
     }
 
+#ifdef USE_ESPMHP_PREHEAT
+    thermal_storage_ = global_preferences->make_preference<espmhp::ThermalModelState>(
+            this->get_object_id_hash() + 5);
+    espmhp::ThermalModelState thermal_state;
+    if (thermal_storage_.load(&thermal_state)) {
+        this->thermal_model_.restore(thermal_state);
+    } else {
+        thermal_state = this->thermal_model_.save();
+    }
+    this->thermal_save_schedule_.loaded(millis(), thermal_state);
+#endif
+
     // create various setpoint persistence:
     cool_storage = global_preferences->make_preference<uint8_t>(this->get_object_id_hash() + 1);
     heat_storage = global_preferences->make_preference<uint8_t>(this->get_object_id_hash() + 2);
@@ -745,15 +1268,312 @@ void MitsubishiHeatPump::setup() {
     heat_setpoint = load(heat_storage);
     auto_setpoint = load(auto_storage);
 
+#ifdef USE_ESPMHP_SNAPSHOT
+    if (this->snapshot_port_ != 0) {
+        this->set_interval("snapshot", this->snapshot_interval_,
+                [this]() { this->send_snapshot(); });
+    }
+#endif
+
+#ifdef USE_ESPMHP_COMMAND_ENDPOINT
+    if (this->command_port_ != 0) {
+        // Commands from before a reboot carry another session id.
+        this->command_session_ = random_uint32();
+        if (!this->command_udp_.begin(this->command_port_)) {
+            ESP_LOGE(TAG, "Unable to listen for commands on port %u",
+                     this->command_port_);
+        }
+    }
+#endif
+
+#ifdef USE_ESPMHP_COORDINATION
+    if (this->coordinated_) {
+        if (peer_port_ != 0) {
+            // 0 until the first coordinated unit sets up, never after.
+            while (peer_session_ == 0) {
+                peer_session_ = random_uint32();
+            }
+            if (!peer_listening_) {
+                peer_listening_ = peer_udp_.begin(peer_port_);
+                if (!peer_listening_) {
+                    ESP_LOGE(TAG, "Unable to listen for peers on port %u",
+                             peer_port_);
+                }
+            }
+            this->set_interval("peer_status", ESPMHP_PEER_STATUS_INTERVAL,
+                    [this]() { this->send_peer_status(); });
+        }
+    }
+#endif
+
+    this->setup_heap_used_ = free_heap_before - ESP.getFreeHeap();
     this->dump_config();
 }
 
+/**
+ * Build a binary snapshot of the component state.
+ *
+ * See espmhp_snapshot.h for the layout.
+ */
+size_t MitsubishiHeatPump::build_snapshot(uint8_t* buffer, size_t length) {
+    uint32_t now = millis();
+    const espmhp::RemoteTemperatureMonitor& remote =
+        this->remote_temperature_monitor_;
+
+    espmhp::SnapshotState state{};
+    state.unit_id = this->unit_id_;
+    state.uptime = now;
+    state.mode = this->mode;
+    state.action = this->action;
+    state.fan_mode = this->fan_mode.has_value() ? *this->fan_mode : 0xFF;
+    state.swing_mode = this->swing_mode;
+    state.vertical_vane = espmhp::find_option(this->vertical_swing_state_,
+            espmhp::VERTICAL_VANE_OPTIONS, espmhp::VANE_OPTION_COUNT);
+    state.horizontal_vane = espmhp::find_option(this->horizontal_swing_state_,
+            espmhp::HORIZONTAL_VANE_OPTIONS, espmhp::VANE_OPTION_COUNT);
+
+    if (this->operating_) {
+        state.flags |= ESPMHP_SNAPSHOT_FLAG_OPERATING;
+    }
+    if (this->hp.isConnected()) {
+        state.flags |= ESPMHP_SNAPSHOT_FLAG_CONNECTED;
+    }
+    if (remote.remote_temperature_active()) {
+        state.flags |= ESPMHP_SNAPSHOT_FLAG_REMOTE_TEMPERATURE;
+    }
+    if (this->failsafe_active_) {
+        state.flags |= ESPMHP_SNAPSHOT_FLAG_FAILSAFE;
+    }
+    if (this->provisional_) {
+        state.flags |= ESPMHP_SNAPSHOT_FLAG_PROVISIONAL;
+    }
+
+    state.target_temperature = this->target_temperature;
+    state.current_temperature = this->current_temperature;
+    state.remote_temperature = remote.remote_temperature_active() ?
+        remote.remote_temperature() : NAN;
+    state.operating_timeout = remote.operating_timeout_minutes();
+    state.idle_timeout = remote.idle_timeout_minutes();
+    state.ping_timeout = remote.ping_timeout_minutes();
+    state.remote_temperature_age = remote.remote_temperature_age(now);
+    state.ping_age = remote.ping_age(now);
+    state.counters = this->counters_;
+
+    return espmhp::encode_snapshot(state, buffer, length);
+}
+
+#ifdef USE_ESPMHP_SNAPSHOT
+void MitsubishiHeatPump::set_snapshot_target(const char* address,
+                                             uint16_t port,
+                                             uint32_t interval_ms) {
+    this->snapshot_address_.fromString(address);
+    this->snapshot_port_ = port;
+    this->snapshot_interval_ = interval_ms;
+}
+
+void MitsubishiHeatPump::send_snapshot() {
+    uint8_t buffer[ESPMHP_SNAPSHOT_SIZE];
+    size_t length = this->build_snapshot(buffer, sizeof(buffer));
+
+    if (!this->snapshot_udp_.beginPacket(this->snapshot_address_,
+                                         this->snapshot_port_)) {
+        ESPMHP_LOGV(TAG, "Unable to send snapshot, network not ready.");
+        return;
+    }
+    this->snapshot_udp_.write(buffer, length);
+    this->snapshot_udp_.endPacket();
+}
+#endif
+
+#ifdef USE_ESPMHP_COMMAND_ENDPOINT
+void MitsubishiHeatPump::set_command_endpoint(uint16_t port,
+                                              const std::string& key) {
+    this->command_port_ = port;
+    this->command_key_ = key;
+}
+
+void MitsubishiHeatPump::loop() {
+    if (this->command_port_ != 0) {
+        this->receive_commands();
+    }
+}
+
+void MitsubishiHeatPump::receive_commands() {
+    const uint8_t* key = (const uint8_t*) this->command_key_.data();
+    size_t key_length = this->command_key_.size();
+    uint8_t buffer[espmhp::COMMAND_HISTORY_MAX_SIZE];
+
+    while (this->command_udp_.parsePacket() > 0) {
+        uint32_t received = millis();
+        int length = this->command_udp_.read(buffer, sizeof(buffer));
+        espmhp::Command command;
+        espmhp::HistoryRequest request;
+        espmhp::CommandAck ack{};
+        if (length > 0 && espmhp::decode_command(buffer, length, key,
+                                                 key_length, &command)) {
+            CommandCheck check = this->check_command(
+                command.unit_id, command.session, command.client_id,
+                command.sequence, &ack);
+            if (check == COMMAND_DROP) {
+                continue;
+            }
+            if (check == COMMAND_CARRY_OUT) {
+                ack.result = this->handle_command(command);
+            }
+            length = 0;
+        } else if (length > 0 && espmhp::decode_history_request(
+                       buffer, length, key, key_length, &request)) {
+            CommandCheck check = this->check_command(
+                request.unit_id, request.session, request.client_id,
+                request.sequence, &ack);
+            if (check == COMMAND_DROP) {
+                continue;
+            }
+            length = 0;
+            if (check == COMMAND_CARRY_OUT) {
+#ifdef USE_ESPMHP_HISTORY
+                espmhp::HistoryReply reply{ack.unit_id, ack.session,
+                                           ack.client_id, ack.sequence,
+                                           nullptr, 0};
+                length = espmhp::encode_history_reply(
+                    reply, this->history_, request.tier, request.first,
+                    millis(), key, key_length, buffer, sizeof(buffer));
+#else
+                ack.result = espmhp::UPDATE_UNSUPPORTED;
+#endif
+            }
+        } else {
+            ESPMHP_LOGD(TAG, "Dropping unauthenticated command.");
+            continue;
+        }
+        if (length == 0) {
+            ack.elapsed = millis() - received;
+            length = espmhp::encode_command_ack(ack, key, key_length, buffer,
+                                                sizeof(buffer));
+        }
+
+        if (!this->command_udp_.beginPacket(this->command_udp_.remoteIP(),
+                                            this->command_udp_.remotePort())) {
+            ESPMHP_LOGV(TAG, "Unable to send command ack, network not ready.");
+            continue;
+        }
+        this->command_udp_.write(buffer, length);
+        this->command_udp_.endPacket();
+    }
+}
+
+MitsubishiHeatPump::CommandCheck MitsubishiHeatPump::check_command(
+        uint32_t unit_id, uint32_t session, uint32_t client_id,
+        uint32_t sequence, espmhp::CommandAck* ack) {
+    if (unit_id != this->unit_id_) {
+        ESPMHP_LOGD(TAG, "Dropping command for unit %08X.", unit_id);
+        return COMMAND_DROP;
+    }
+
+    ack->unit_id = this->unit_id_;
+    ack->session = this->command_session_;
+    ack->client_id = client_id;
+    ack->sequence = sequence;
+    if (this->command_challenge_ != 0 &&
+            client_id == this->command_challenge_client_ &&
+            session == this->command_challenge_) {
+        // Bound to a challenge only this client was sent, so it can't be a
+        // replay.
+        this->command_challenge_ = 0;
+        this->command_replay_guard_.accept(client_id, sequence);
+        return COMMAND_CARRY_OUT;
+    }
+    if (session != this->command_session_) {
+        ack->result = espmhp::COMMAND_STALE_SESSION;
+        return COMMAND_ANSWER;
+    }
+    if (!this->command_replay_guard_.knows(client_id)) {
+        // Nothing accepted from this client in the session, or it was
+        // forgotten since, so this could be a replay. Have it sent again
+        // bound to a challenge.
+        this->command_challenge_ = 0;
+        while (this->command_challenge_ == 0) {
+            this->command_challenge_ = random_uint32();
+        }
+        this->command_challenge_client_ = client_id;
+        ack->session = this->command_challenge_;
+        ack->result = espmhp::COMMAND_CHALLENGE;
+        return COMMAND_ANSWER;
+    }
+    if (!this->command_replay_guard_.accept(client_id, sequence)) {
+        ESPMHP_LOGD(TAG, "Dropping replayed command %u from client %08X.",
+                    sequence, client_id);
+        return COMMAND_DROP;
+    }
+    return COMMAND_CARRY_OUT;
+}
+
+uint8_t MitsubishiHeatPump::handle_command(const espmhp::Command& command) {
+    const uint8_t climate_fields = espmhp::COMMAND_FIELD_MODE |
+        espmhp::COMMAND_FIELD_TARGET_TEMPERATURE |
+        espmhp::COMMAND_FIELD_FAN_MODE | espmhp::COMMAND_FIELD_SWING_MODE;
+    climate::ClimateMode mode = static_cast<climate::ClimateMode>(command.mode);
+
+    if (command.fields == 0) {
+        return espmhp::UPDATE_SENT;
+    }
+    if ((command.fields & espmhp::COMMAND_FIELD_MODE) &&
+            !this->supports_mode(mode)) {
+        return espmhp::UPDATE_UNSUPPORTED;
+    }
+    // control() would quietly leave these out, and ack the rest as sent.
+    if ((command.fields & espmhp::COMMAND_FIELD_FAN_MODE) &&
+            !this->supports_fan_mode(
+                static_cast<climate::ClimateFanMode>(command.fan))) {
+        return espmhp::UPDATE_REJECTED;
+    }
+    if ((command.fields & espmhp::COMMAND_FIELD_SWING_MODE) &&
+            !this->supports_swing_mode(
+                static_cast<climate::ClimateSwingMode>(command.swing))) {
+        return espmhp::UPDATE_REJECTED;
+    }
+
+    if (command.fields & climate_fields) {
+        // Goes through the same validation and control() as the API.
+        auto call = this->make_call();
+        if (command.fields & espmhp::COMMAND_FIELD_MODE) {
+            call.set_mode(mode);
+        }
+        if (command.fields & espmhp::COMMAND_FIELD_TARGET_TEMPERATURE) {
+            call.set_target_temperature(command.target_temperature);
+        }
+        if (command.fields & espmhp::COMMAND_FIELD_FAN_MODE) {
+            call.set_fan_mode(static_cast<climate::ClimateFanMode>(command.fan));
+        }
+        if (command.fields & espmhp::COMMAND_FIELD_SWING_MODE) {
+            call.set_swing_mode(
+                static_cast<climate::ClimateSwingMode>(command.swing));
+        }
+        call.perform();
+    }
+    if (command.fields & espmhp::COMMAND_FIELD_VERTICAL_VANE) {
+        this->on_vertical_swing_change(
+            espmhp::VERTICAL_VANE_OPTIONS[command.vertical_vane]);
+    }
+    if (command.fields & espmhp::COMMAND_FIELD_HORIZONTAL_VANE) {
+        this->on_horizontal_swing_change(
+            espmhp::HORIZONTAL_VANE_OPTIONS[command.horizontal_vane]);
+    }
+
+    // Everything above was queued; send it as one packet and ack the
+    // unit's answer.
+    this->flush_commands();
+    return this->last_update_result();
+}
+#endif
+
 /**
  * The ESP only has a few bytes of rtc storage, so instead
  * of storing floats directly, we'll store the number of
  * TEMPERATURE_STEPs from MIN_TEMPERATURE.
  **/
 void MitsubishiHeatPump::save(float value, ESPPreferenceObject& storage) {
+    value = espmhp::clamp_setpoint(value);
     uint8_t steps = (value - ESPMHP_MIN_TEMPERATURE) / ESPMHP_TEMPERATURE_STEP;
     storage.save(&steps);
 }
@@ -774,6 +1594,40 @@ void MitsubishiHeatPump::dump_config() {
     ESP_LOGI(TAG, "  Saved heat: %.1f", heat_setpoint.value_or(-1));
     ESP_LOGI(TAG, "  Saved cool: %.1f", cool_setpoint.value_or(-1));
     ESP_LOGI(TAG, "  Saved auto: %.1f", auto_setpoint.value_or(-1));
+    ESP_LOGI(TAG, "  Fail-safe configured: %s", YESNO(this->failsafe_.configured()));
+    ESP_LOGI(TAG, "  Unit id: %08X", this->unit_id_);
+#ifdef USE_ESPMHP_PREHEAT
+    const espmhp::RateModel& heating = this->thermal_model_.heating();
+    const espmhp::RateModel& cooling = this->thermal_model_.cooling();
+    ESP_LOGI(TAG, "  Heating rate: %.2f + %.2f * gap C/h (%u samples)",
+             heating.theta(0), heating.theta(1), heating.samples());
+    ESP_LOGI(TAG, "  Cooling rate: %.2f + %.2f * gap C/h (%u samples)",
+             cooling.theta(0), cooling.theta(1), cooling.samples());
+#endif
+#ifdef USE_ESPMHP_COMMAND_ENDPOINT
+    if (this->command_port_ != 0) {
+        ESP_LOGI(TAG, "  Command port: %u", this->command_port_);
+    }
+#endif
+#ifdef USE_ESPMHP_COORDINATION
+    if (this->coordinated_) {
+        ESP_LOGI(TAG, "  Compressor start spacing: %u ms",
+                 (unsigned) coordinator_.start_spacing());
+        ESP_LOGI(TAG, "  Max operating units: %u",
+                 coordinator_.max_operating_units());
+        ESP_LOGI(TAG, "  Peer port: %u", peer_port_);
+    }
+#endif
+    ESP_LOGI(TAG, "  Max command queue depth: %u",
+             this->counters_.queue_depth_max);
+    ESP_LOGI(TAG, "  Command wait: %u ms last, %u ms max",
+             (unsigned) this->counters_.command_wait_last,
+             (unsigned) this->counters_.command_wait_max);
+    ESP_LOGI(TAG, "  Max info request lateness: %u ms",
+             (unsigned) this->counters_.poll_lateness_max);
+    ESP_LOGI(TAG, "  Component size: %u bytes", (unsigned) sizeof(MitsubishiHeatPump));
+    ESP_LOGI(TAG, "  Heap used by setup(): %d bytes", this->setup_heap_used_);
+    ESP_LOGI(TAG, "  Max heap used by update(): %d bytes", this->update_heap_used_max_);
 }
 
 void MitsubishiHeatPump::dump_state() {
@@ -782,14 +1636,35 @@ void MitsubishiHeatPump::dump_state() {
 }
 
 void MitsubishiHeatPump::log_packet(byte* packet, unsigned int length, char* packetDirection) {
-    String packetHex;
-    char textBuf[15];
+#if ESPHOME_LOG_LEVEL >= ESPHOME_LOG_LEVEL_VERBOSE && \
+        !defined(USE_ESPMHP_COMPACT_LOGGING)
+    // Format into a fixed buffer rather than a String, so logging packets
+    // doesn't churn the heap. Longer packets are truncated.
+    static const unsigned int MAX_LOGGED_BYTES = 32;
+    char packetHex[MAX_LOGGED_BYTES * 3 + 1] = {0};
+
+    for (unsigned int i = 0; i < length && i < MAX_LOGGED_BYTES; i++) {
+        snprintf(packetHex + i * 3, 4, "%02X ", packet[i]);
+    }
 
-    for (int i = 0; i < length; i++) {
-        memset(textBuf, 0, 15);
-        sprintf(textBuf, "%02X ", packet[i]);
-        packetHex += textBuf;
+    ESP_LOGV(TAG, "PKT: [%s] %s", packetDirection, packetHex);
+#else
+    (void) packet;
+    (void) length;
+    (void) packetDirection;
+#endif
+}
+
+void MitsubishiHeatPump::on_packet(const byte* packet, unsigned int length) {
+    bool request;
+    espmhp::InfoPage page;
+    if (!espmhp::parse_info_packet(packet, length, &request, &page)) {
+        return;
     }
-    
-    ESP_LOGV(TAG, "PKT: [%s] %s", packetDirection, packetHex.c_str());
-}
\ No newline at end of file
+    if (request) {
+        this->poll_scheduler_.requested(page, millis());
+        this->counters_.poll_lateness_max = this->poll_scheduler_.max_lateness();
+    } else {
+        this->poll_scheduler_.answered(page);
+    }
+}
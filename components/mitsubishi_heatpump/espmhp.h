@@ -18,29 +18,66 @@
 #define USE_CALLBACKS
 
 #include "esphome.h"
+#ifdef USE_ESPMHP_VANE_SELECT
 #include "esphome/components/select/select.h"
+#endif
 #include "esphome/core/preferences.h"
-#include <chrono>
 
 #include "HeatPump.h"
+#include "espmhp_core.h"
+#include "espmhp_coordination.h"
+#include "espmhp_polling.h"
+
+#ifdef USE_ESPMHP_HISTORY
+#include "espmhp_history.h"
+#endif
+
+#ifdef USE_ESPMHP_PREHEAT
+#include "espmhp_thermal.h"
+#endif
+
+#ifdef USE_ESPMHP_COMMAND_ENDPOINT
+#include "espmhp_command.h"
+#endif
+
+#if defined(USE_ESPMHP_SNAPSHOT) || defined(USE_ESPMHP_COORDINATION) || \
+        defined(USE_ESPMHP_COMMAND_ENDPOINT)
+#include <WiFiUdp.h>
+#endif
 
 #ifndef ESPMHP_H
 #define ESPMHP_H
 
 static const char* TAG = "MitsubishiHeatPump"; // Logging tag
 
+// Debug and verbose logs of this component, left out of the build with
+// compact_logging whatever the logger level, to save flash. The calls are
+// kept as dead code so that arguments are still checked and used.
+#ifdef USE_ESPMHP_COMPACT_LOGGING
+#define ESPMHP_LOGD(tag, ...) do { if (false) ESP_LOGD(tag, __VA_ARGS__); } while (0)
+#define ESPMHP_LOGV(tag, ...) do { if (false) ESP_LOGV(tag, __VA_ARGS__); } while (0)
+#else
+#define ESPMHP_LOGD(tag, ...) ESP_LOGD(tag, __VA_ARGS__)
+#define ESPMHP_LOGV(tag, ...) ESP_LOGV(tag, __VA_ARGS__)
+#endif
+
 static const char* ESPMHP_VERSION = "2.5.0";
 
 /* If polling interval is greater than 9 seconds, the HeatPump
 library reconnects, but doesn't then follow up with our data request.*/
 static const uint32_t ESPMHP_POLL_INTERVAL_DEFAULT = 500; // in milliseconds,
                                                            // 0 < X <= 9000
-static const uint8_t ESPMHP_MIN_TEMPERATURE = 16; // degrees C,
-                                                  // defined by hardware
-static const uint8_t ESPMHP_MAX_TEMPERATURE = 31; // degrees C,
-                                                  //defined by hardware
-static const float   ESPMHP_TEMPERATURE_STEP = 0.5; // temperature setting step,
-                                                    // in degrees C
+
+#ifdef USE_ESPMHP_PREHEAT
+// Furthest deadline for schedule_target(), about 24 days: the time left is
+// compared as a signed number of milliseconds.
+static const uint32_t ESPMHP_MAX_SCHEDULE_SECONDS = INT32_MAX / 1000;
+#endif
+
+#ifdef USE_ESPMHP_COORDINATION
+// How often each unit broadcasts its status to peer nodes, in milliseconds.
+static const uint32_t ESPMHP_PEER_STATUS_INTERVAL = 5000;
+#endif
 
 class MitsubishiHeatPump : public esphome::PollingComponent, public esphome::climate::Climate {
 
@@ -91,6 +128,19 @@ class MitsubishiHeatPump : public esphome::PollingComponent, public esphome::cli
         // Get a mutable reference to the traits that we support.
         esphome::climate::ClimateTraits& config_traits();
 
+        // Supported modes, fan modes and swing modes, as bit masks indexed by
+        // the climate enums. Generated by climate.py from the supports block.
+        void set_supported_modes(uint16_t modes);
+        void set_supported_fan_modes(uint16_t fan_modes);
+        void set_supported_swing_modes(uint8_t swing_modes);
+
+        // Whether mode is in the supports block, or OFF, without copying the
+        // traits.
+        bool supports_mode(esphome::climate::ClimateMode mode) const;
+        bool supports_fan_mode(esphome::climate::ClimateFanMode fan_mode) const;
+        bool supports_swing_mode(
+            esphome::climate::ClimateSwingMode swing_mode) const;
+
         // Debugging function to print the object's state.
         void dump_state();
 
@@ -101,8 +151,10 @@ class MitsubishiHeatPump : public esphome::PollingComponent, public esphome::cli
         // set_remote_temp(0) to switch back to the internal sensor.
         void set_remote_temperature(float);
 
+#ifdef USE_ESPMHP_VANE_SELECT
         void set_vertical_vane_select(esphome::select::Select *vertical_vane_select);
         void set_horizontal_vane_select(esphome::select::Select *horizontal_vane_select);
+#endif
 
         // Used to validate that a connection is present between the controller
         // and this heatpump.
@@ -120,18 +172,144 @@ class MitsubishiHeatPump : public esphome::PollingComponent, public esphome::cli
         // temperature sensor if a ping isn't received from the controller.
         void set_remote_ping_timeout_minutes(int);
 
+        // Climate mode to switch to when the ping timeout fires. The previous
+        // settings are restored once pings resume.
+        void set_failsafe_mode(esphome::climate::ClimateMode);
+
+        // Setpoint to use while in fail-safe mode.
+        void set_failsafe_target_temperature(float);
+
+        // Room temperature below which the unit is forced to heat while in
+        // fail-safe mode.
+        void set_failsafe_min_room_temperature(float);
+
+        // Room temperature above which the unit is forced to cool while in
+        // fail-safe mode.
+        void set_failsafe_max_room_temperature(float);
+
+        // True while the published state was restored at boot and hasn't
+        // been confirmed by the unit yet.
+        bool is_provisional() const;
+
+        // Identifies this unit across nodes, hashed from the node and entity
+        // names. Valid after setup().
+        uint32_t get_unit_id() const;
+
+        // What became of the last command sent on behalf of the user.
+        espmhp::UpdateResult last_update_result() const;
+
+        // Send queued commands now, rather than after the current loop
+        // iteration, e.g. to get a final last_update_result().
+        void flush_commands();
+
+        // While held, queued commands wait for the next update() rather than
+        // going out after the current loop iteration. Sending blocks until
+        // the unit acknowledges, so a group holds its members' commands to
+        // have them sent from each member's own update().
+        void hold_commands(bool hold);
+
+        // Called with the final result, sent or failed, whenever queued
+        // commands are sent.
+        void add_on_update_result_callback(
+            std::function<void(espmhp::UpdateResult)> &&callback);
+
+        // Write a binary snapshot of the component state, as described in
+        // espmhp_snapshot.h, into buffer. Returns the number of bytes
+        // written, or 0 if the buffer is too small.
+        size_t build_snapshot(uint8_t* buffer, size_t length);
+
+#ifdef USE_ESPMHP_SNAPSHOT
+        // Periodically send snapshots as UDP datagrams to address:port.
+        void set_snapshot_target(const char* address, uint16_t port,
+                                 uint32_t interval_ms);
+#endif
+
+#ifdef USE_ESPMHP_COMMAND_ENDPOINT
+        // Accept commands authenticated with key on UDP port, as described in
+        // espmhp_command.h.
+        void set_command_endpoint(uint16_t port, const std::string& key);
+
+        // Commands are read on every loop iteration, not every update.
+        void loop() override;
+#endif
+
+#ifdef USE_ESPMHP_HISTORY
+        // Buckets for the fine and coarse history of this unit, which keep
+        // nothing without them.
+        void set_history_storage(espmhp::HistoryBucket* fine,
+                                 size_t fine_count,
+                                 espmhp::HistoryBucket* coarse,
+                                 size_t coarse_count);
+        // Length of the fine and coarse history buckets.
+        void set_history_periods(uint32_t fine_ms, uint32_t coarse_ms);
+
+        // Export the fine (0) or coarse (1) history, from bucket first on,
+        // as described in espmhp_history.h. Returns the number of bytes
+        // written.
+        size_t export_history(uint8_t tier, size_t first, uint8_t* buffer,
+                              size_t length);
+#endif
+
+#ifdef USE_ESPMHP_PREHEAT
+        // Heating and cooling rate assumed until the model learned the room,
+        // in degrees C per hour.
+        void set_preheat_default_rate(float rate);
+
+        // Never start a scheduled target earlier than this.
+        void set_preheat_max_lead_time(uint32_t ms);
+
+        // Reach temperature in mode in the given number of seconds, starting
+        // the unit as late as the learned model allows. Replaces any target
+        // scheduled earlier. Deadlines further than
+        // ESPMHP_MAX_SCHEDULE_SECONDS away are rejected.
+        void schedule_target(esphome::climate::ClimateMode mode,
+                             float temperature, uint32_t seconds);
+
+        void cancel_scheduled_target();
+
+        // Predicted time for the room to reach temperature in mode, in
+        // seconds.
+        uint32_t predict_lead_time(esphome::climate::ClimateMode mode,
+                                   float temperature);
+#endif
+
+#ifdef USE_ESPMHP_COORDINATION
+        // The following settings are shared by every coordinated unit on
+        // this node.
+
+        // Minimum time between two compressor starts.
+        void set_start_spacing(uint32_t ms);
+
+        // Maximum number of units operating at the same time, 0 for no
+        // limit.
+        void set_max_operating_units(uint8_t units);
+
+        // Exchange status with other nodes over UDP broadcasts to this port,
+        // authenticated with key.
+        void set_peers(uint16_t port, const std::string& key);
+
+        // Degrees by which this unit's setpoint is relaxed while too many
+        // units are operating.
+        void set_setpoint_relaxation(float degrees);
+#endif
+
     protected:
-        // HeatPump object using the underlying Arduino library.
-        HeatPump* hp;
+        // HeatPump object using the underlying Arduino library. Owned by
+        // value so that no heap allocation is needed in setup().
+        HeatPump hp;
 
         // The ClimateTraits supported by this HeatPump.
         esphome::climate::ClimateTraits traits_;
+        uint16_t supported_modes_ = espmhp::DEFAULT_SUPPORTED_MODES;
+        uint16_t supported_fan_modes_ = espmhp::DEFAULT_SUPPORTED_FAN_MODES;
+        uint8_t supported_swing_modes_ = espmhp::DEFAULT_SUPPORTED_SWING_MODES;
 
         // Vane position
-        void update_swing_horizontal(const std::string &swing);
-        void update_swing_vertical(const std::string &swing);
-        std::string vertical_swing_state_;
-        std::string horizontal_swing_state_;
+        void update_swing_horizontal(const char* swing);
+        void update_swing_vertical(const char* swing);
+        // Point to string literals, see update_swing_*().
+        const char* vertical_swing_state_ = "auto";
+        const char* horizontal_swing_state_ = "auto";
 
         // Allow the HeatPump class to use get_hw_serial_
         friend class HeatPump;
@@ -158,10 +336,12 @@ class MitsubishiHeatPump : public esphome::PollingComponent, public esphome::cli
         static void save(float value, esphome::ESPPreferenceObject& storage);
         static esphome::optional<float> load(esphome::ESPPreferenceObject& storage);
 
+#ifdef USE_ESPMHP_VANE_SELECT
         esphome::select::Select *vertical_vane_select_ =
             nullptr;  // Select to store manual position of vertical swing
         esphome::select::Select *horizontal_vane_select_ =
             nullptr;  // Select to store manual position of horizontal swing
+#endif
 
         // When received command to change the vane positions
         void on_horizontal_swing_change(const std::string &swing);
@@ -172,6 +352,117 @@ class MitsubishiHeatPump : public esphome::PollingComponent, public esphome::cli
     private:
         void enforce_remote_temperature_sensor_timeout();
 
+        // Fail-safe handling while the controller is unreachable.
+        void enter_failsafe();
+        void enforce_failsafe_guards();
+        void exit_failsafe();
+
+        // Restore and publish the last state confirmed by the unit.
+        void restore_state();
+
+        // Persist the current settings, if they changed since they were last
+        // saved.
+        void persist_state();
+
+        uint32_t unit_id_ = 0;
+        espmhp::UpdateResult last_update_result_ = espmhp::UPDATE_SENT;
+        bool commands_held_ = false;
+        esphome::CallbackManager<void(espmhp::UpdateResult)>
+            update_result_callback_;
+
+        esphome::ESPPreferenceObject state_storage_;
+        espmhp::PersistedState persisted_state_{};
+        bool provisional_ = false;
+
+        // Send the pending settings to the unit, keeping link statistics.
+        bool send_update();
+
+        // Send the pending settings on behalf of the user. Settings which may
+        // start the compressor wait for a start slot when coordinated, and
+        // so does anything sent while a start is pending, unless the mode
+        // no longer uses the compressor, which cancels the start.
+        void request_update(bool starts_compressor);
+
+        // Queue the pending settings, to be sent ahead of any info request.
+        // Commands queued in the same loop iteration go out as one packet.
+        void queue_command();
+
+        // Attribute info requests and replies to the poll scheduler.
+        void on_packet(const byte* packet, unsigned int length);
+
+        espmhp::PollScheduler poll_scheduler_;
+        bool command_pending_ = false;
+        uint32_t command_queued_at_ = 0;
+
+        // Whether the setpoint sent to the unit is relaxed below what the
+        // user asked for, to keep within the operating units budget.
+        bool setpoint_relaxed() const;
+
+#ifdef USE_ESPMHP_COORDINATION
+        void enforce_demand_limit();
+        void receive_peer_status();
+        void send_peer_status();
+
+        static espmhp::StartCoordinator coordinator_;
+        static WiFiUDP peer_udp_;
+        static uint16_t peer_port_;
+        static std::string peer_key_;
+        static bool peer_listening_;
+        // Picked at boot, with the number of the last status sent.
+        static uint32_t peer_session_;
+        static uint32_t peer_sequence_;
+        // Last sequence number accepted in each peer node's session.
+        static espmhp::ReplayGuard peer_replay_guard_;
+
+        // Whether this unit takes part in the coordination.
+        bool coordinated_ = false;
+        bool start_pending_ = false;
+        // When the pending start was reserved for.
+        uint32_t pending_start_ = 0;
+        float setpoint_relaxation_ = 2.0;
+        bool relaxed_ = false;
+#endif
+
+#ifdef USE_ESPMHP_COMMAND_ENDPOINT
+        void receive_commands();
+
+        enum CommandCheck : uint8_t {
+            COMMAND_CARRY_OUT,
+            COMMAND_ANSWER, // with the ack, without carrying it out
+            COMMAND_DROP,
+        };
+
+        // Check the unit, session and sequence number of a command or
+        // history request, and set up the ids of its ack. Sets the result
+        // too unless it is to be carried out.
+        CommandCheck check_command(uint32_t unit_id, uint32_t session,
+                                   uint32_t client_id, uint32_t sequence,
+                                   espmhp::CommandAck* ack);
+
+        // Carry out a command as control() and the vane selects would.
+        // Returns the result to acknowledge.
+        uint8_t handle_command(const espmhp::Command& command);
+
+        WiFiUDP command_udp_;
+        uint16_t command_port_ = 0;
+        std::string command_key_;
+        uint32_t command_session_ = 0;
+        espmhp::ReplayGuard command_replay_guard_;
+        // The outstanding challenge, 0 if none, and the client it was sent
+        // to.
+        uint32_t command_challenge_ = 0;
+        uint32_t command_challenge_client_ = 0;
+#endif
+
+#ifdef USE_ESPMHP_SNAPSHOT
+        void send_snapshot();
+
+        WiFiUDP snapshot_udp_;
+        IPAddress snapshot_address_;
+        uint16_t snapshot_port_ = 0;
+        uint32_t snapshot_interval_ = 0;
+#endif
+
         // Retrieve the HardwareSerial pointer from friend and subclasses.
         HardwareSerial *hw_serial_;
         int baud_ = 0;
@@ -179,11 +470,42 @@ class MitsubishiHeatPump : public esphome::PollingComponent, public esphome::cli
         int tx_pin_ = -1;
         bool operating_ = false;
 
-        std::optional<std::chrono::duration<long long, std::ratio<60>>> remote_operating_timeout_;
-        std::optional<std::chrono::duration<long long, std::ratio<60>>> remote_idle_timeout_;
-        std::optional<std::chrono::duration<long long, std::ratio<60>>> remote_ping_timeout_;
-        std::optional<std::chrono::time_point<std::chrono::steady_clock>> last_remote_temperature_sensor_update_;
-        std::optional<std::chrono::time_point<std::chrono::steady_clock>> last_ping_request_;
+        espmhp::RemoteTemperatureMonitor remote_temperature_monitor_;
+
+        espmhp::FailsafePolicy failsafe_;
+        bool failsafe_active_ = false;
+        // Settings in effect before the fail-safe policy was applied.
+        heatpumpSettings failsafe_saved_settings_{};
+
+        EspmhpCounters counters_;
+
+#ifdef USE_ESPMHP_PREHEAT
+        // The room temperature the unit regulates on, remote or internal.
+        float regulated_temperature() const;
+        void check_scheduled_target();
+
+        espmhp::ThermalModel thermal_model_;
+        esphome::ESPPreferenceObject thermal_storage_;
+        espmhp::ThermalSaveSchedule thermal_save_schedule_;
+        uint32_t preheat_max_lead_time_ = 4 * 60 * 60 * 1000;
+
+        bool target_scheduled_ = false;
+        esphome::climate::ClimateMode scheduled_mode_;
+        float scheduled_temperature_ = NAN;
+        uint32_t scheduled_deadline_ = 0;
+#endif
+
+#ifdef USE_ESPMHP_HISTORY
+        void record_history();
+
+        espmhp::History history_{nullptr, 0, nullptr, 0};
+#endif
+
+        // Free heap deltas, reported by dump_config(). On ESP32 they also
+        // count what other tasks allocated meanwhile, so they are an upper
+        // bound; tests/test_allocations.cpp checks the core paths exactly.
+        int32_t setup_heap_used_ = 0;
+        int32_t update_heap_used_max_ = 0;
 };
 
 #endif
@@ -0,0 +1,219 @@
+/**
+ * espmhp_auth.cpp
+ *
+ * Message authentication shared by the command endpoint and group peers
+ *
+ * License: BSD
+ */
+
+#include <cstring>
+
+#include "espmhp_auth.h"
+
+namespace espmhp {
+
+static const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const size_t SHA256_BLOCK_SIZE = 64;
+static const size_t SHA256_DIGEST_SIZE = 32;
+
+/**
+ * Minimal streaming SHA-256, enough for HMAC over short messages.
+ */
+class Sha256 {
+    public:
+        Sha256() {
+            static const uint32_t INITIAL[8] = {
+                0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+            };
+            memcpy(this->state_, INITIAL, sizeof(this->state_));
+        }
+
+        void update(const uint8_t* data, size_t length) {
+            for (size_t i = 0; i < length; i++) {
+                this->block_[this->used_++] = data[i];
+                if (this->used_ == SHA256_BLOCK_SIZE) {
+                    this->compress();
+                    this->used_ = 0;
+                }
+            }
+            this->length_ += length;
+        }
+
+        void finish(uint8_t digest[SHA256_DIGEST_SIZE]) {
+            uint64_t bits = this->length_ * 8;
+            uint8_t padding = 0x80;
+            this->update(&padding, 1);
+            padding = 0;
+            while (this->used_ != SHA256_BLOCK_SIZE - 8) {
+                this->update(&padding, 1);
+            }
+            uint8_t length[8];
+            for (size_t i = 0; i < 8; i++) {
+                length[i] = bits >> (56 - 8 * i);
+            }
+            this->update(length, sizeof(length));
+
+            for (size_t i = 0; i < 8; i++) {
+                for (size_t j = 0; j < 4; j++) {
+                    digest[i * 4 + j] = this->state_[i] >> (24 - 8 * j);
+                }
+            }
+        }
+
+    private:
+        static uint32_t rotate(uint32_t value, unsigned bits) {
+            return (value >> bits) | (value << (32 - bits));
+        }
+
+        void compress() {
+            uint32_t w[64];
+            for (size_t i = 0; i < 16; i++) {
+                w[i] = (uint32_t) this->block_[i * 4] << 24 |
+                    (uint32_t) this->block_[i * 4 + 1] << 16 |
+                    (uint32_t) this->block_[i * 4 + 2] << 8 |
+                    (uint32_t) this->block_[i * 4 + 3];
+            }
+            for (size_t i = 16; i < 64; i++) {
+                uint32_t s0 = rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^
+                    (w[i - 15] >> 3);
+                uint32_t s1 = rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^
+                    (w[i - 2] >> 10);
+                w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+            }
+
+            uint32_t v[8];
+            memcpy(v, this->state_, sizeof(v));
+            for (size_t i = 0; i < 64; i++) {
+                uint32_t s1 = rotate(v[4], 6) ^ rotate(v[4], 11) ^ rotate(v[4], 25);
+                uint32_t choice = (v[4] & v[5]) ^ (~v[4] & v[6]);
+                uint32_t t1 = v[7] + s1 + choice + SHA256_K[i] + w[i];
+                uint32_t s0 = rotate(v[0], 2) ^ rotate(v[0], 13) ^ rotate(v[0], 22);
+                uint32_t majority = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+                uint32_t t2 = s0 + majority;
+                memmove(v + 1, v, 7 * sizeof(uint32_t));
+                v[4] += t1;
+                v[0] = t1 + t2;
+            }
+            for (size_t i = 0; i < 8; i++) {
+                this->state_[i] += v[i];
+            }
+        }
+
+        uint32_t state_[8];
+        uint8_t block_[SHA256_BLOCK_SIZE];
+        size_t used_ = 0;
+        uint64_t length_ = 0;
+};
+
+void hmac_sha256(const uint8_t* key, size_t key_length, const uint8_t* data,
+                 size_t length, uint8_t digest[32]) {
+    uint8_t block_key[SHA256_BLOCK_SIZE] = {0};
+    if (key_length > SHA256_BLOCK_SIZE) {
+        Sha256 hash;
+        hash.update(key, key_length);
+        hash.finish(block_key);
+    } else {
+        memcpy(block_key, key, key_length);
+    }
+
+    uint8_t pad[SHA256_BLOCK_SIZE];
+    for (size_t i = 0; i < SHA256_BLOCK_SIZE; i++) {
+        pad[i] = block_key[i] ^ 0x36;
+    }
+    Sha256 inner;
+    inner.update(pad, sizeof(pad));
+    inner.update(data, length);
+    uint8_t inner_digest[SHA256_DIGEST_SIZE];
+    inner.finish(inner_digest);
+
+    for (size_t i = 0; i < SHA256_BLOCK_SIZE; i++) {
+        pad[i] = block_key[i] ^ 0x5c;
+    }
+    Sha256 outer;
+    outer.update(pad, sizeof(pad));
+    outer.update(inner_digest, sizeof(inner_digest));
+    outer.finish(digest);
+}
+
+void auth_sign(uint8_t* buffer, size_t signed_length, const uint8_t* key,
+               size_t key_length) {
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    hmac_sha256(key, key_length, buffer, signed_length, digest);
+    memcpy(buffer + signed_length, digest, AUTH_TAG_SIZE);
+}
+
+bool auth_verify(const uint8_t* buffer, size_t signed_length,
+                 const uint8_t* key, size_t key_length) {
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    hmac_sha256(key, key_length, buffer, signed_length, digest);
+    // Compare every byte, so the time taken doesn't tell how much matched.
+    uint8_t difference = 0;
+    for (size_t i = 0; i < AUTH_TAG_SIZE; i++) {
+        difference |= digest[i] ^ buffer[signed_length + i];
+    }
+    return difference == 0;
+}
+
+void ReplayGuard::reset() {
+    for (Client& client : this->clients_) {
+        client.used = false;
+    }
+}
+
+bool ReplayGuard::knows(uint32_t client_id) const {
+    for (const Client& client : this->clients_) {
+        if (client.used && client.id == client_id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ReplayGuard::accept(uint32_t client_id, uint32_t sequence) {
+    this->uses_++;
+    Client* slot = nullptr;
+    for (Client& client : this->clients_) {
+        if (client.used && client.id == client_id) {
+            // Signed difference, so that sequence numbers may wrap around.
+            if ((int32_t) (sequence - client.sequence) <= 0) {
+                return false;
+            }
+            slot = &client;
+            break;
+        }
+    }
+    if (slot == nullptr) {
+        // A new client takes a free slot, or the least recently used one.
+        for (Client& client : this->clients_) {
+            if (!client.used) {
+                slot = &client;
+                break;
+            }
+            if (slot == nullptr ||
+                    this->uses_ - client.last_used > this->uses_ - slot->last_used) {
+                slot = &client;
+            }
+        }
+        slot->id = client_id;
+        slot->used = true;
+    }
+    slot->sequence = sequence;
+    slot->last_used = this->uses_;
+    return true;
+}
+
+} // namespace espmhp
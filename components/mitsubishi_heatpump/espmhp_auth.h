@@ -0,0 +1,71 @@
+/**
+ * espmhp_auth.h
+ *
+ * Message authentication shared by the command endpoint and group peers
+ *
+ * License: BSD
+ *
+ * Messages end with a tag: HMAC-SHA256 over every byte before it, with a key
+ * shared by both ends, truncated to AUTH_TAG_SIZE bytes. Replays are caught
+ * by the receiver with a ReplayGuard, see espmhp_command.h and
+ * espmhp_coordination.h for how sessions keep it sound across reboots.
+ */
+
+#ifndef ESPMHP_AUTH_H
+#define ESPMHP_AUTH_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace espmhp {
+
+static const size_t AUTH_TAG_SIZE = 8;
+
+// Clients whose sequence numbers a ReplayGuard remembers. Beyond that, the
+// least recently seen client is forgotten.
+static const size_t REPLAY_GUARD_CLIENTS = 8;
+
+// HMAC-SHA256 (RFC 2104) of data.
+void hmac_sha256(const uint8_t* key, size_t key_length, const uint8_t* data,
+                 size_t length, uint8_t digest[32]);
+
+// Write the tag over the first signed_length bytes of buffer right after
+// them.
+void auth_sign(uint8_t* buffer, size_t signed_length, const uint8_t* key,
+               size_t key_length);
+
+// Whether the tag after the first signed_length bytes of buffer matches.
+bool auth_verify(const uint8_t* buffer, size_t signed_length,
+                 const uint8_t* key, size_t key_length);
+
+/**
+ * Last sequence number accepted from each client, within a session.
+ */
+class ReplayGuard {
+    public:
+        // Forget every client.
+        void reset();
+
+        // Whether a sequence number was accepted from client, and not
+        // forgotten since.
+        bool knows(uint32_t client_id) const;
+
+        // Whether sequence is newer than the last one accepted from client,
+        // in which case it is remembered.
+        bool accept(uint32_t client_id, uint32_t sequence);
+
+    private:
+        struct Client {
+            uint32_t id;
+            uint32_t sequence;
+            uint32_t last_used;
+            bool used;
+        };
+
+        Client clients_[REPLAY_GUARD_CLIENTS] = {};
+        uint32_t uses_ = 0;
+};
+
+} // namespace espmhp
+
+#endif
@@ -0,0 +1,225 @@
+/**
+ * espmhp_command.cpp
+ *
+ * Authenticated local UDP commands, for wall panels and local controllers
+ *
+ * License: BSD
+ */
+
+#include "espmhp_command.h"
+
+namespace espmhp {
+
+static void put_u32(uint8_t* buffer, size_t offset, uint32_t value) {
+    for (size_t i = 0; i < 4; i++) {
+        buffer[offset + i] = (value >> (8 * i)) & 0xFF;
+    }
+}
+
+static uint32_t get_u32(const uint8_t* buffer, size_t offset) {
+    uint32_t value = 0;
+    for (size_t i = 0; i < 4; i++) {
+        value |= (uint32_t) buffer[offset + i] << (8 * i);
+    }
+    return value;
+}
+
+static bool is_message(const uint8_t* buffer, size_t length, uint8_t type,
+                       size_t size) {
+    return length >= size && buffer[0] == COMMAND_MAGIC &&
+        buffer[1] == COMMAND_VERSION && buffer[2] == type;
+}
+
+size_t encode_command(const Command& command, const uint8_t* key,
+                      size_t key_length, uint8_t* buffer, size_t length) {
+    if (length < COMMAND_SIZE) {
+        return 0;
+    }
+    int16_t target = encode_tenths(command.target_temperature);
+    buffer[0] = COMMAND_MAGIC;
+    buffer[1] = COMMAND_VERSION;
+    buffer[2] = COMMAND_MESSAGE_COMMAND;
+    buffer[3] = command.fields;
+    put_u32(buffer, 4, command.unit_id);
+    put_u32(buffer, 8, command.session);
+    put_u32(buffer, 12, command.client_id);
+    put_u32(buffer, 16, command.sequence);
+    buffer[20] = command.mode;
+    buffer[21] = command.fan;
+    buffer[22] = command.swing;
+    buffer[23] = command.vertical_vane;
+    buffer[24] = command.horizontal_vane;
+    buffer[25] = 0;
+    buffer[26] = (uint16_t) target & 0xFF;
+    buffer[27] = (uint16_t) target >> 8;
+    auth_sign(buffer, COMMAND_SIZE - COMMAND_TAG_SIZE, key, key_length);
+    return COMMAND_SIZE;
+}
+
+bool decode_command(const uint8_t* buffer, size_t length, const uint8_t* key,
+                    size_t key_length, Command* command) {
+    if (!is_message(buffer, length, COMMAND_MESSAGE_COMMAND, COMMAND_SIZE) ||
+            !auth_verify(buffer, COMMAND_SIZE - COMMAND_TAG_SIZE, key,
+                         key_length)) {
+        return false;
+    }
+    // Drop values we don't know about rather than passing them on to the
+    // climate enums.
+    uint8_t fields = buffer[3];
+    if (buffer[20] > MODE_DRY) {
+        fields &= ~COMMAND_FIELD_MODE;
+    }
+    if (buffer[21] > FAN_DIFFUSE) {
+        fields &= ~COMMAND_FIELD_FAN_MODE;
+    }
+    if (buffer[22] > SWING_HORIZONTAL) {
+        fields &= ~COMMAND_FIELD_SWING_MODE;
+    }
+    if (buffer[23] >= VANE_OPTION_COUNT) {
+        fields &= ~COMMAND_FIELD_VERTICAL_VANE;
+    }
+    if (buffer[24] >= VANE_OPTION_COUNT) {
+        fields &= ~COMMAND_FIELD_HORIZONTAL_VANE;
+    }
+    command->fields = fields;
+    command->unit_id = get_u32(buffer, 4);
+    command->session = get_u32(buffer, 8);
+    command->client_id = get_u32(buffer, 12);
+    command->sequence = get_u32(buffer, 16);
+    command->mode = static_cast<Mode>(buffer[20]);
+    command->fan = static_cast<FanMode>(buffer[21]);
+    command->swing = static_cast<SwingMode>(buffer[22]);
+    command->vertical_vane = buffer[23];
+    command->horizontal_vane = buffer[24];
+    command->target_temperature =
+        decode_tenths((int16_t) (buffer[26] | (buffer[27] << 8)));
+    return true;
+}
+
+size_t encode_command_ack(const CommandAck& ack, const uint8_t* key,
+                          size_t key_length, uint8_t* buffer, size_t length) {
+    if (length < COMMAND_ACK_SIZE) {
+        return 0;
+    }
+    buffer[0] = COMMAND_MAGIC;
+    buffer[1] = COMMAND_VERSION;
+    buffer[2] = COMMAND_MESSAGE_ACK;
+    buffer[3] = ack.result;
+    put_u32(buffer, 4, ack.unit_id);
+    put_u32(buffer, 8, ack.session);
+    put_u32(buffer, 12, ack.client_id);
+    put_u32(buffer, 16, ack.sequence);
+    put_u32(buffer, 20, ack.elapsed);
+    auth_sign(buffer, COMMAND_ACK_SIZE - COMMAND_TAG_SIZE, key, key_length);
+    return COMMAND_ACK_SIZE;
+}
+
+bool decode_command_ack(const uint8_t* buffer, size_t length,
+                        const uint8_t* key, size_t key_length,
+                        CommandAck* ack) {
+    if (!is_message(buffer, length, COMMAND_MESSAGE_ACK, COMMAND_ACK_SIZE) ||
+            !auth_verify(buffer, COMMAND_ACK_SIZE - COMMAND_TAG_SIZE, key,
+                    key_length)) {
+        return false;
+    }
+    ack->result = buffer[3];
+    ack->unit_id = get_u32(buffer, 4);
+    ack->session = get_u32(buffer, 8);
+    ack->client_id = get_u32(buffer, 12);
+    ack->sequence = get_u32(buffer, 16);
+    ack->elapsed = get_u32(buffer, 20);
+    return true;
+}
+
+size_t encode_history_request(const HistoryRequest& request,
+                              const uint8_t* key, size_t key_length,
+                              uint8_t* buffer, size_t length) {
+    if (length < COMMAND_HISTORY_REQUEST_SIZE) {
+        return 0;
+    }
+    buffer[0] = COMMAND_MAGIC;
+    buffer[1] = COMMAND_VERSION;
+    buffer[2] = COMMAND_MESSAGE_HISTORY_REQUEST;
+    buffer[3] = request.tier;
+    put_u32(buffer, 4, request.unit_id);
+    put_u32(buffer, 8, request.session);
+    put_u32(buffer, 12, request.client_id);
+    put_u32(buffer, 16, request.sequence);
+    buffer[20] = request.first & 0xFF;
+    buffer[21] = request.first >> 8;
+    buffer[22] = 0;
+    buffer[23] = 0;
+    auth_sign(buffer, COMMAND_HISTORY_REQUEST_SIZE - COMMAND_TAG_SIZE, key,
+              key_length);
+    return COMMAND_HISTORY_REQUEST_SIZE;
+}
+
+bool decode_history_request(const uint8_t* buffer, size_t length,
+                            const uint8_t* key, size_t key_length,
+                            HistoryRequest* request) {
+    if (!is_message(buffer, length, COMMAND_MESSAGE_HISTORY_REQUEST,
+                    COMMAND_HISTORY_REQUEST_SIZE) ||
+            !auth_verify(buffer, COMMAND_HISTORY_REQUEST_SIZE - COMMAND_TAG_SIZE,
+                         key, key_length) ||
+            buffer[3] > HISTORY_COARSE) {
+        return false;
+    }
+    request->tier = static_cast<HistoryTierId>(buffer[3]);
+    request->unit_id = get_u32(buffer, 4);
+    request->session = get_u32(buffer, 8);
+    request->client_id = get_u32(buffer, 12);
+    request->sequence = get_u32(buffer, 16);
+    request->first = buffer[20] | (buffer[21] << 8);
+    return true;
+}
+
+size_t encode_history_reply(const HistoryReply& reply, const History& history,
+                            HistoryTierId tier, size_t first, uint32_t now,
+                            const uint8_t* key, size_t key_length,
+                            uint8_t* buffer, size_t length) {
+    if (length > COMMAND_HISTORY_MAX_SIZE) {
+        length = COMMAND_HISTORY_MAX_SIZE;
+    }
+    if (length < COMMAND_HISTORY_HEADER_SIZE + COMMAND_TAG_SIZE) {
+        return 0;
+    }
+    size_t chunk_length = history.export_tier(
+        tier, now, first, buffer + COMMAND_HISTORY_HEADER_SIZE,
+        length - COMMAND_HISTORY_HEADER_SIZE - COMMAND_TAG_SIZE);
+    if (chunk_length == 0) {
+        return 0;
+    }
+    buffer[0] = COMMAND_MAGIC;
+    buffer[1] = COMMAND_VERSION;
+    buffer[2] = COMMAND_MESSAGE_HISTORY;
+    buffer[3] = 0;
+    put_u32(buffer, 4, reply.unit_id);
+    put_u32(buffer, 8, reply.session);
+    put_u32(buffer, 12, reply.client_id);
+    put_u32(buffer, 16, reply.sequence);
+    size_t signed_length = COMMAND_HISTORY_HEADER_SIZE + chunk_length;
+    auth_sign(buffer, signed_length, key, key_length);
+    return signed_length + COMMAND_TAG_SIZE;
+}
+
+bool decode_history_reply(const uint8_t* buffer, size_t length,
+                          const uint8_t* key, size_t key_length,
+                          HistoryReply* reply) {
+    if (!is_message(buffer, length, COMMAND_MESSAGE_HISTORY,
+                    COMMAND_HISTORY_HEADER_SIZE + HISTORY_HEADER_SIZE +
+                        COMMAND_TAG_SIZE) ||
+            !auth_verify(buffer, length - COMMAND_TAG_SIZE, key,
+                         key_length)) {
+        return false;
+    }
+    reply->unit_id = get_u32(buffer, 4);
+    reply->session = get_u32(buffer, 8);
+    reply->client_id = get_u32(buffer, 12);
+    reply->sequence = get_u32(buffer, 16);
+    reply->chunk = buffer + COMMAND_HISTORY_HEADER_SIZE;
+    reply->chunk_length =
+        length - COMMAND_HISTORY_HEADER_SIZE - COMMAND_TAG_SIZE;
+    return true;
+}
+
+} // namespace espmhp
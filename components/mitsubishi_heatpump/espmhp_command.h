@@ -0,0 +1,222 @@
+/**
+ * espmhp_command.h
+ *
+ * Authenticated local UDP commands, for wall panels and local controllers
+ *
+ * License: BSD
+ *
+ * Commands carry the same settings as a climate call plus the vane positions,
+ * and are authenticated with a key shared with the clients, see
+ * espmhp_auth.h. Every message is little-endian.
+ *
+ * Command, from a client to a unit:
+ *
+ *   offset size field
+ *        0    1 magic, COMMAND_MAGIC
+ *        1    1 version, COMMAND_VERSION
+ *        2    1 message type, COMMAND_MESSAGE_COMMAND
+ *        3    1 fields set, see COMMAND_FIELD_*
+ *        4    4 unit id, see MitsubishiHeatPump::get_unit_id()
+ *        8    4 session id of the unit
+ *       12    4 client id
+ *       16    4 sequence number, increasing for every command of a client
+ *       20    1 climate mode
+ *       21    1 fan mode
+ *       22    1 swing mode
+ *       23    1 vertical vane option index
+ *       24    1 horizontal vane option index
+ *       25    1 reserved, 0
+ *       26    2 target temperature, signed tenths of a degree C
+ *       28    8 tag over bytes 0 to 27
+ *
+ * Ack, from the unit back to the client:
+ *
+ *   offset size field
+ *        0    1 magic, COMMAND_MAGIC
+ *        1    1 version, COMMAND_VERSION
+ *        2    1 message type, COMMAND_MESSAGE_ACK
+ *        3    1 result, an UpdateResult, COMMAND_STALE_SESSION or
+ *                 COMMAND_CHALLENGE
+ *        4    4 unit id
+ *        8    4 current session id of the unit, or the challenge
+ *       12    4 client id of the command
+ *       16    4 sequence number of the command
+ *       20    4 time from receiving the command to sending the ack, in ms
+ *       24    8 tag over bytes 0 to 23
+ *
+ * A unit picks a new session id at every boot. Commands for another session
+ * are answered with COMMAND_STALE_SESSION and the current session id, and
+ * should be sent again with it, so commands captured before a reboot can't
+ * be replayed. Within a session, a command is only carried out if its
+ * sequence number is newer than the last one of the same client; replays
+ * and commands which fail authentication are dropped without an ack.
+ *
+ * Only the last REPLAY_GUARD_CLIENTS clients are remembered. A command from
+ * a client which isn't, e.g. a new one or one forgotten since, could be a
+ * replay, so it is answered with COMMAND_CHALLENGE and a random challenge
+ * in place of the session id. Sent again with the challenge as its session
+ * id, the command is carried out and acknowledged with the session id. Only
+ * the latest challenge can be answered; clients starting at the same time
+ * may be challenged more than once.
+ *
+ * A command without fields is acknowledged without contacting the unit,
+ * e.g. to learn the session id or measure the network round trip.
+ *
+ * History request, from a client to a unit, checked like a command:
+ *
+ *   offset size field
+ *        0    1 magic, COMMAND_MAGIC
+ *        1    1 version, COMMAND_VERSION
+ *        2    1 message type, COMMAND_MESSAGE_HISTORY_REQUEST
+ *        3    1 tier, HISTORY_FINE or HISTORY_COARSE
+ *        4    4 unit id
+ *        8    4 session id of the unit
+ *       12    4 client id
+ *       16    4 sequence number, shared with the client's commands
+ *       20    2 index of the first bucket wanted, 0 is the oldest
+ *       22    2 reserved, 0
+ *       24    8 tag over bytes 0 to 23
+ *
+ * History, from the unit back to the client, unless the request is answered
+ * with an ack, e.g. COMMAND_STALE_SESSION or UPDATE_UNSUPPORTED without a
+ * history block:
+ *
+ *   offset size field
+ *        0    1 magic, COMMAND_MAGIC
+ *        1    1 version, COMMAND_VERSION
+ *        2    1 message type, COMMAND_MESSAGE_HISTORY
+ *        3    1 reserved, 0
+ *        4    4 unit id
+ *        8    4 current session id of the unit
+ *       12    4 client id of the request
+ *       16    4 sequence number of the request
+ *       20    n a chunk of at most COMMAND_HISTORY_BUCKETS buckets, as
+ *               exported by History::export_tier(), see espmhp_history.h
+ *     20+n    8 tag over bytes 0 to 19+n
+ *
+ * The chunk's header tells how many buckets the tier holds; request the
+ * next chunk from the first bucket not received yet.
+ */
+
+#ifndef ESPMHP_COMMAND_H
+#define ESPMHP_COMMAND_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "espmhp_auth.h"
+#include "espmhp_core.h"
+#include "espmhp_history.h"
+
+namespace espmhp {
+
+static const uint8_t COMMAND_MAGIC = 0x43; // 'C'
+static const uint8_t COMMAND_VERSION = 1;
+static const uint8_t COMMAND_MESSAGE_COMMAND = 1;
+static const uint8_t COMMAND_MESSAGE_ACK = 2;
+static const uint8_t COMMAND_MESSAGE_HISTORY_REQUEST = 3;
+static const uint8_t COMMAND_MESSAGE_HISTORY = 4;
+static const size_t COMMAND_SIZE = 36;
+static const size_t COMMAND_ACK_SIZE = 32;
+static const size_t COMMAND_HISTORY_REQUEST_SIZE = 32;
+static const size_t COMMAND_HISTORY_HEADER_SIZE = 20;
+static const size_t COMMAND_TAG_SIZE = AUTH_TAG_SIZE;
+
+// Buckets in a history answer, which keeps it in one small datagram.
+static const size_t COMMAND_HISTORY_BUCKETS = 48;
+static const size_t COMMAND_HISTORY_MAX_SIZE = COMMAND_HISTORY_HEADER_SIZE +
+    HISTORY_HEADER_SIZE + COMMAND_HISTORY_BUCKETS * HISTORY_BUCKET_SIZE +
+    COMMAND_TAG_SIZE;
+
+static const uint8_t COMMAND_FIELD_MODE = 1 << 0;
+static const uint8_t COMMAND_FIELD_TARGET_TEMPERATURE = 1 << 1;
+static const uint8_t COMMAND_FIELD_FAN_MODE = 1 << 2;
+static const uint8_t COMMAND_FIELD_SWING_MODE = 1 << 3;
+static const uint8_t COMMAND_FIELD_VERTICAL_VANE = 1 << 4;
+static const uint8_t COMMAND_FIELD_HORIZONTAL_VANE = 1 << 5;
+
+// Ack result for a command sent with another session id.
+static const uint8_t COMMAND_STALE_SESSION = 0x80;
+// Ack result for a command from a client the unit doesn't remember; the
+// ack carries the challenge instead of the session id.
+static const uint8_t COMMAND_CHALLENGE = 0x81;
+
+struct Command {
+    uint32_t unit_id;
+    uint32_t session;
+    uint32_t client_id;
+    uint32_t sequence;
+    uint8_t fields;
+    Mode mode;
+    FanMode fan;
+    SwingMode swing;
+    uint8_t vertical_vane;   // index into VERTICAL_VANE_OPTIONS
+    uint8_t horizontal_vane; // index into HORIZONTAL_VANE_OPTIONS
+    float target_temperature;
+};
+
+struct CommandAck {
+    uint32_t unit_id;
+    uint32_t session;
+    uint32_t client_id;
+    uint32_t sequence;
+    uint8_t result;
+    uint32_t elapsed;
+};
+
+struct HistoryRequest {
+    uint32_t unit_id;
+    uint32_t session;
+    uint32_t client_id;
+    uint32_t sequence;
+    HistoryTierId tier;
+    uint16_t first;
+};
+
+struct HistoryReply {
+    uint32_t unit_id;
+    uint32_t session;
+    uint32_t client_id;
+    uint32_t sequence;
+    // The exported chunk, pointing into the decoded buffer.
+    const uint8_t* chunk;
+    size_t chunk_length;
+};
+
+// Returns the number of bytes written, or 0 if the buffer is too small.
+size_t encode_command(const Command& command, const uint8_t* key,
+                      size_t key_length, uint8_t* buffer, size_t length);
+
+// Returns false if the buffer doesn't hold a command authenticated with key.
+// Fields with values we don't know about are dropped.
+bool decode_command(const uint8_t* buffer, size_t length, const uint8_t* key,
+                    size_t key_length, Command* command);
+
+size_t encode_command_ack(const CommandAck& ack, const uint8_t* key,
+                          size_t key_length, uint8_t* buffer, size_t length);
+bool decode_command_ack(const uint8_t* buffer, size_t length,
+                        const uint8_t* key, size_t key_length,
+                        CommandAck* ack);
+
+size_t encode_history_request(const HistoryRequest& request,
+                              const uint8_t* key, size_t key_length,
+                              uint8_t* buffer, size_t length);
+// Returns false for an unknown tier too.
+bool decode_history_request(const uint8_t* buffer, size_t length,
+                            const uint8_t* key, size_t key_length,
+                            HistoryRequest* request);
+
+// Export the requested chunk of history into an answer carrying the ids of
+// reply, whose chunk is ignored. Returns the number of bytes written, or 0
+// if the buffer is too small for the header.
+size_t encode_history_reply(const HistoryReply& reply, const History& history,
+                            HistoryTierId tier, size_t first, uint32_t now,
+                            const uint8_t* key, size_t key_length,
+                            uint8_t* buffer, size_t length);
+bool decode_history_reply(const uint8_t* buffer, size_t length,
+                          const uint8_t* key, size_t key_length,
+                          HistoryReply* reply);
+
+} // namespace espmhp
+
+#endif
@@ -0,0 +1,366 @@
+/**
+ * espmhp_coordination.cpp
+ *
+ * Coordination across heatpumps: compressor start staggering, demand
+ * limiting and group commands
+ *
+ * License: BSD
+ */
+
+#include "espmhp_coordination.h"
+
+namespace espmhp {
+
+void StartCoordinator::set_start_spacing(uint32_t ms) {
+    start_spacing_ = ms;
+}
+
+uint32_t StartCoordinator::start_spacing() const {
+    return start_spacing_;
+}
+
+void StartCoordinator::set_max_operating_units(uint8_t units) {
+    max_operating_units_ = units;
+}
+
+uint8_t StartCoordinator::max_operating_units() const {
+    return max_operating_units_;
+}
+
+uint32_t StartCoordinator::reserve_start(uint32_t now) {
+    uint32_t start = now;
+    if (has_last_start_ && start_spacing_ > 0) {
+        // Signed difference, so that millis() rollover is handled.
+        int32_t since_last = (int32_t) (now - last_start_);
+        if (since_last < (int32_t) start_spacing_) {
+            start = last_start_ + start_spacing_;
+        }
+    }
+    has_previous_start_ = has_last_start_;
+    previous_start_ = last_start_;
+    has_last_start_ = true;
+    last_start_ = start;
+    return start - now;
+}
+
+void StartCoordinator::cancel_start(uint32_t start) {
+    if (has_last_start_ && last_start_ == start) {
+        has_last_start_ = has_previous_start_;
+        last_start_ = previous_start_;
+        has_previous_start_ = false;
+    }
+}
+
+void StartCoordinator::note_peer_start(uint32_t now, uint32_t age) {
+    if ((int32_t) age < 0) {
+        // Reserved ahead of time, or garbage: count it from now.
+        age = 0;
+    } else if (age >= start_spacing_) {
+        return;
+    }
+    uint32_t start = now - age;
+    if (!has_last_start_ || (int32_t) (start - last_start_) > 0) {
+        has_last_start_ = true;
+        last_start_ = start;
+    }
+}
+
+bool StartCoordinator::last_start(uint32_t* start) const {
+    *start = last_start_;
+    return has_last_start_;
+}
+
+bool StartCoordinator::expired(const Unit& unit, uint32_t now) const {
+    return !unit.used ||
+        (!unit.local && now - unit.last_seen > PEER_EXPIRY_MS);
+}
+
+void StartCoordinator::set_operating(uint32_t unit_id, bool operating,
+                                     bool local, uint32_t now) {
+    Unit* slot = nullptr;
+    for (Unit& unit : units_) {
+        if (unit.used && unit.id == unit_id) {
+            if (unit.local && !local) {
+                return;
+            }
+            slot = &unit;
+            break;
+        }
+        if (slot == nullptr && expired(unit, now)) {
+            slot = &unit;
+        }
+    }
+    if (slot == nullptr) {
+        // Table full of live units; the extra one just isn't counted.
+        return;
+    }
+    *slot = Unit{unit_id, now, operating, local, true};
+}
+
+uint8_t StartCoordinator::operating_units(uint32_t now) const {
+    uint8_t count = 0;
+    for (const Unit& unit : units_) {
+        if (!expired(unit, now) && unit.operating) {
+            count++;
+        }
+    }
+    return count;
+}
+
+bool StartCoordinator::should_relax(uint32_t unit_id, uint32_t now) const {
+    if (max_operating_units_ == 0) {
+        return false;
+    }
+    // Rank this unit among the operating ones by id.
+    uint8_t lower_ids = 0;
+    bool operating = false;
+    for (const Unit& unit : units_) {
+        if (expired(unit, now) || !unit.operating) {
+            continue;
+        }
+        if (unit.id == unit_id) {
+            operating = true;
+        } else if (unit.id < unit_id) {
+            lower_ids++;
+        }
+    }
+    return operating && lower_ids >= max_operating_units_;
+}
+
+bool StartCoordinator::may_restore(uint32_t unit_id, uint32_t now) const {
+    if (max_operating_units_ == 0) {
+        return true;
+    }
+    uint8_t others = 0;
+    for (const Unit& unit : units_) {
+        if (!expired(unit, now) && unit.operating && unit.id != unit_id) {
+            others++;
+        }
+    }
+    return others < max_operating_units_;
+}
+
+bool uses_compressor(Mode mode) {
+    switch (mode) {
+        case MODE_HEAT_COOL:
+        case MODE_COOL:
+        case MODE_HEAT:
+        case MODE_DRY:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool starts_compressor(Mode from, Mode to) {
+    return uses_compressor(to) && from != to;
+}
+
+static void put_u32(uint8_t* buffer, size_t offset, uint32_t value) {
+    for (size_t i = 0; i < 4; i++) {
+        buffer[offset + i] = (value >> (8 * i)) & 0xFF;
+    }
+}
+
+static uint32_t get_u32(const uint8_t* buffer, size_t offset) {
+    uint32_t value = 0;
+    for (size_t i = 0; i < 4; i++) {
+        value |= (uint32_t) buffer[offset + i] << (8 * i);
+    }
+    return value;
+}
+
+static bool is_message(const uint8_t* buffer, size_t length, uint8_t type,
+                       size_t size) {
+    return length >= size && buffer[0] == PEER_MAGIC &&
+        buffer[1] == PEER_VERSION && buffer[2] == type;
+}
+
+size_t encode_peer_status(const PeerStatus& status, const uint8_t* key,
+                          size_t key_length, uint8_t* buffer, size_t length) {
+    if (length < PEER_STATUS_SIZE) {
+        return 0;
+    }
+    buffer[0] = PEER_MAGIC;
+    buffer[1] = PEER_VERSION;
+    buffer[2] = PEER_MESSAGE_STATUS;
+    buffer[3] = status.operating ? 1 : 0;
+    put_u32(buffer, 4, status.unit_id);
+    put_u32(buffer, 8, status.last_start_age);
+    put_u32(buffer, 12, status.session);
+    put_u32(buffer, 16, status.sequence);
+    auth_sign(buffer, PEER_STATUS_SIZE - AUTH_TAG_SIZE, key, key_length);
+    return PEER_STATUS_SIZE;
+}
+
+bool decode_peer_status(const uint8_t* buffer, size_t length,
+                        const uint8_t* key, size_t key_length,
+                        PeerStatus* status) {
+    if (!is_message(buffer, length, PEER_MESSAGE_STATUS, PEER_STATUS_SIZE) ||
+            !auth_verify(buffer, PEER_STATUS_SIZE - AUTH_TAG_SIZE, key,
+                         key_length)) {
+        return false;
+    }
+    status->operating = buffer[3] & 1;
+    status->unit_id = get_u32(buffer, 4);
+    status->last_start_age = get_u32(buffer, 8);
+    status->session = get_u32(buffer, 12);
+    status->sequence = get_u32(buffer, 16);
+    return true;
+}
+
+const char* update_result_to_string(UpdateResult result) {
+    switch (result) {
+        case UPDATE_SENT:
+            return "sent";
+        case UPDATE_DEFERRED:
+            return "deferred";
+        case UPDATE_FAILED:
+            return "failed";
+        case UPDATE_UNSUPPORTED:
+            return "unsupported";
+        case UPDATE_QUEUED:
+            return "queued";
+        case UPDATE_REJECTED:
+            return "rejected";
+        default:
+            return "unknown";
+    }
+}
+
+size_t encode_group_command(const GroupCommand& command, const uint8_t* key,
+                            size_t key_length, uint8_t* buffer,
+                            size_t length) {
+    if (length < PEER_GROUP_COMMAND_SIZE) {
+        return 0;
+    }
+    int16_t target = encode_tenths(command.target_temperature);
+    buffer[0] = PEER_MAGIC;
+    buffer[1] = PEER_VERSION;
+    buffer[2] = PEER_MESSAGE_GROUP_COMMAND;
+    buffer[3] = command.fields;
+    put_u32(buffer, 4, command.group_id);
+    put_u32(buffer, 8, command.origin);
+    put_u32(buffer, 12, command.origin_session);
+    put_u32(buffer, 16, command.sequence);
+    put_u32(buffer, 20, command.receiver_session);
+    buffer[24] = command.mode;
+    buffer[25] = command.fan;
+    buffer[26] = command.swing;
+    buffer[27] = 0;
+    buffer[28] = (uint16_t) target & 0xFF;
+    buffer[29] = (uint16_t) target >> 8;
+    auth_sign(buffer, PEER_GROUP_COMMAND_SIZE - AUTH_TAG_SIZE, key,
+              key_length);
+    return PEER_GROUP_COMMAND_SIZE;
+}
+
+bool decode_group_command(const uint8_t* buffer, size_t length,
+                          const uint8_t* key, size_t key_length,
+                          GroupCommand* command) {
+    if (!is_message(buffer, length, PEER_MESSAGE_GROUP_COMMAND,
+                    PEER_GROUP_COMMAND_SIZE) ||
+            !auth_verify(buffer, PEER_GROUP_COMMAND_SIZE - AUTH_TAG_SIZE, key,
+                         key_length)) {
+        return false;
+    }
+    // Drop values we don't know about rather than passing them on to the
+    // climate enums.
+    uint8_t fields = buffer[3];
+    if (buffer[24] > MODE_DRY) {
+        fields &= ~GROUP_FIELD_MODE;
+    }
+    if (buffer[25] > FAN_DIFFUSE) {
+        fields &= ~GROUP_FIELD_FAN_MODE;
+    }
+    if (buffer[26] > SWING_HORIZONTAL) {
+        fields &= ~GROUP_FIELD_SWING_MODE;
+    }
+    command->fields = fields;
+    command->group_id = get_u32(buffer, 4);
+    command->origin = get_u32(buffer, 8);
+    command->origin_session = get_u32(buffer, 12);
+    command->sequence = get_u32(buffer, 16);
+    command->receiver_session = get_u32(buffer, 20);
+    command->mode = static_cast<Mode>(buffer[24]);
+    command->fan = static_cast<FanMode>(buffer[25]);
+    command->swing = static_cast<SwingMode>(buffer[26]);
+    command->target_temperature =
+        decode_tenths((int16_t) (buffer[28] | (buffer[29] << 8)));
+    return true;
+}
+
+size_t encode_group_challenge(const GroupChallenge& challenge,
+                              const uint8_t* key, size_t key_length,
+                              uint8_t* buffer, size_t length) {
+    if (length < PEER_GROUP_CHALLENGE_SIZE) {
+        return 0;
+    }
+    buffer[0] = PEER_MAGIC;
+    buffer[1] = PEER_VERSION;
+    buffer[2] = PEER_MESSAGE_GROUP_CHALLENGE;
+    buffer[3] = 0;
+    put_u32(buffer, 4, challenge.group_id);
+    put_u32(buffer, 8, challenge.origin);
+    put_u32(buffer, 12, challenge.origin_session);
+    put_u32(buffer, 16, challenge.sequence);
+    put_u32(buffer, 20, challenge.receiver_session);
+    auth_sign(buffer, PEER_GROUP_CHALLENGE_SIZE - AUTH_TAG_SIZE, key,
+              key_length);
+    return PEER_GROUP_CHALLENGE_SIZE;
+}
+
+bool decode_group_challenge(const uint8_t* buffer, size_t length,
+                            const uint8_t* key, size_t key_length,
+                            GroupChallenge* challenge) {
+    if (!is_message(buffer, length, PEER_MESSAGE_GROUP_CHALLENGE,
+                    PEER_GROUP_CHALLENGE_SIZE) ||
+            !auth_verify(buffer, PEER_GROUP_CHALLENGE_SIZE - AUTH_TAG_SIZE,
+                         key, key_length)) {
+        return false;
+    }
+    challenge->group_id = get_u32(buffer, 4);
+    challenge->origin = get_u32(buffer, 8);
+    challenge->origin_session = get_u32(buffer, 12);
+    challenge->sequence = get_u32(buffer, 16);
+    challenge->receiver_session = get_u32(buffer, 20);
+    return true;
+}
+
+size_t encode_group_result(const GroupResult& result, const uint8_t* key,
+                           size_t key_length, uint8_t* buffer,
+                           size_t length) {
+    if (length < PEER_GROUP_RESULT_SIZE) {
+        return 0;
+    }
+    buffer[0] = PEER_MAGIC;
+    buffer[1] = PEER_VERSION;
+    buffer[2] = PEER_MESSAGE_GROUP_RESULT;
+    buffer[3] = result.result;
+    put_u32(buffer, 4, result.group_id);
+    put_u32(buffer, 8, result.origin_session);
+    put_u32(buffer, 12, result.sequence);
+    put_u32(buffer, 16, result.unit_id);
+    auth_sign(buffer, PEER_GROUP_RESULT_SIZE - AUTH_TAG_SIZE, key,
+              key_length);
+    return PEER_GROUP_RESULT_SIZE;
+}
+
+bool decode_group_result(const uint8_t* buffer, size_t length,
+                         const uint8_t* key, size_t key_length,
+                         GroupResult* result) {
+    if (!is_message(buffer, length, PEER_MESSAGE_GROUP_RESULT,
+                    PEER_GROUP_RESULT_SIZE) ||
+            !auth_verify(buffer, PEER_GROUP_RESULT_SIZE - AUTH_TAG_SIZE, key,
+                         key_length)) {
+        return false;
+    }
+    result->result = static_cast<UpdateResult>(buffer[3]);
+    result->group_id = get_u32(buffer, 4);
+    result->origin_session = get_u32(buffer, 8);
+    result->sequence = get_u32(buffer, 12);
+    result->unit_id = get_u32(buffer, 16);
+    return true;
+}
+
+} // namespace espmhp
@@ -0,0 +1,307 @@
+/**
+ * espmhp_coordination.h
+ *
+ * Coordination across heatpumps: compressor start staggering, demand
+ * limiting and group commands
+ *
+ * License: BSD
+ *
+ * One StartCoordinator is shared by every MitsubishiHeatPump on a node, and
+ * optionally fed with the state of units on peer nodes, received as
+ * authenticated PeerStatus messages over UDP. Groups (espmhp_group.h)
+ * forward commands to peer nodes as authenticated GroupCommand messages,
+ * answered with GroupResult messages.
+ */
+
+#ifndef ESPMHP_COORDINATION_H
+#define ESPMHP_COORDINATION_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "espmhp_auth.h"
+#include "espmhp_core.h"
+
+namespace espmhp {
+
+// Units tracked by a coordinator, local and peers combined.
+static const size_t MAX_COORDINATED_UNITS = 16;
+
+// Peers which haven't been heard from for this long are forgotten.
+static const uint32_t PEER_EXPIRY_MS = 30 * 1000;
+
+class StartCoordinator {
+    public:
+        // Minimum time between two compressor starts, 0 to disable.
+        void set_start_spacing(uint32_t ms);
+        uint32_t start_spacing() const;
+
+        // Maximum number of units which may be operating at the same time,
+        // 0 for no limit.
+        void set_max_operating_units(uint8_t units);
+        uint8_t max_operating_units() const;
+
+        /**
+         * Reserve a slot to start a compressor.
+         *
+         * Returns:
+         *   How long the caller must wait before starting, in ms.
+         */
+        uint32_t reserve_start(uint32_t now);
+
+        // Give back the start reserved for start, e.g. because the unit was
+        // turned off meanwhile. Only the latest reservation can be given
+        // back; later ones were already spaced after it.
+        void cancel_start(uint32_t start);
+
+        // Record a start reserved on a peer node age ms ago. Starts a peer
+        // reserved ahead of time count from now, and starts older than the
+        // start spacing are ignored, so that a peer can hold back local
+        // starts by one spacing at most.
+        void note_peer_start(uint32_t now, uint32_t age);
+
+        // Time of the last reserved start, and whether there was one.
+        bool last_start(uint32_t* start) const;
+
+        // Record whether a unit is operating. Peer entries expire after
+        // PEER_EXPIRY_MS, local ones are kept. Peer reports never override
+        // a local unit, so our own broadcasts are ignored.
+        void set_operating(uint32_t unit_id, bool operating, bool local,
+                           uint32_t now);
+
+        // Number of units known to be operating.
+        uint8_t operating_units(uint32_t now) const;
+
+        /**
+         * Whether an operating unit should relax its setpoint to bring the
+         * number of operating units back within the budget. Units with the
+         * lowest ids keep running, so every node reaches the same decision
+         * without negotiating.
+         */
+        bool should_relax(uint32_t unit_id, uint32_t now) const;
+
+        // Whether a relaxed unit may go back to its setpoint without
+        // exceeding the budget.
+        bool may_restore(uint32_t unit_id, uint32_t now) const;
+
+    private:
+        struct Unit {
+            uint32_t id;
+            uint32_t last_seen;
+            bool operating;
+            bool local;
+            bool used;
+        };
+
+        bool expired(const Unit& unit, uint32_t now) const;
+
+        uint32_t start_spacing_ = 0;
+        uint8_t max_operating_units_ = 0;
+        bool has_last_start_ = false;
+        uint32_t last_start_ = 0;
+        bool has_previous_start_ = false;
+        uint32_t previous_start_ = 0;
+        Unit units_[MAX_COORDINATED_UNITS] = {};
+};
+
+// Whether the compressor may run in mode.
+bool uses_compressor(Mode mode);
+
+// Whether switching from one mode to another may start the compressor.
+bool starts_compressor(Mode from, Mode to);
+
+/*
+ * Peer messages are little-endian and authenticated with a key shared by
+ * every node, see espmhp_auth.h. Each node picks a new session id at every
+ * boot, and numbers the messages it sends in a session.
+ */
+static const uint8_t PEER_MAGIC = 0x50; // 'P'
+static const uint8_t PEER_VERSION = 2;
+static const uint8_t PEER_MESSAGE_STATUS = 1;
+static const uint8_t PEER_MESSAGE_GROUP_COMMAND = 2;
+static const uint8_t PEER_MESSAGE_GROUP_RESULT = 3;
+static const uint8_t PEER_MESSAGE_GROUP_CHALLENGE = 4;
+
+/*
+ * Status of a unit, broadcast by every coordinated unit:
+ *
+ *   offset size field
+ *        0    1 magic, PEER_MAGIC
+ *        1    1 version, PEER_VERSION
+ *        2    1 message type, PEER_MESSAGE_STATUS
+ *        3    1 flags, bit 0 set if the unit is operating
+ *        4    4 unit id
+ *        8    4 ms since the sender last reserved a start, PEER_NO_START if never.
+ *               Modulo 2^32, so a start reserved in the future wraps around.
+ *       12    4 session id of the sending node
+ *       16    4 sequence number, increasing for every status in a session
+ *       20    8 tag over bytes 0 to 19
+ *
+ * Receivers drop statuses whose sequence number isn't newer than the last
+ * one accepted in the sender's session. Statuses recorded before the sender
+ * last booted aren't caught, but only count for PEER_EXPIRY_MS and can't
+ * hold back starts by more than one start spacing.
+ */
+static const size_t PEER_STATUS_SIZE = 28;
+static const uint32_t PEER_NO_START = UINT32_MAX;
+
+struct PeerStatus {
+    uint32_t unit_id;
+    bool operating;
+    uint32_t last_start_age;
+    uint32_t session;
+    uint32_t sequence;
+};
+
+// Returns the number of bytes written, or 0 if the buffer is too small.
+size_t encode_peer_status(const PeerStatus& status, const uint8_t* key,
+                          size_t key_length, uint8_t* buffer, size_t length);
+
+// Returns false if the buffer doesn't hold a status authenticated with key.
+bool decode_peer_status(const uint8_t* buffer, size_t length,
+                        const uint8_t* key, size_t key_length,
+                        PeerStatus* status);
+
+// What became of a command sent to a unit.
+enum UpdateResult : uint8_t {
+    UPDATE_SENT = 0,        // acknowledged by the unit
+    UPDATE_DEFERRED = 1,    // waiting for a compressor start slot
+    UPDATE_FAILED = 2,      // not acknowledged by the unit
+    UPDATE_UNSUPPORTED = 3, // the unit doesn't support the requested mode
+    UPDATE_QUEUED = 4,      // waiting to be sent, ahead of info requests
+    UPDATE_REJECTED = 5,    // the unit doesn't support the fan or swing mode
+};
+
+const char* update_result_to_string(UpdateResult result);
+
+/*
+ * Group messages are authenticated with a key shared by the groups on every
+ * node, which picks its own session id.
+ *
+ * A command is broadcast with no receiver session. A node which hasn't
+ * accepted a command in the sender's session yet answers with a challenge
+ * carrying its own session id, and the sender sends the command again to
+ * that node with it, which can't be a replay from before either node
+ * booted. From then on, the node accepts broadcasts in the sender's session
+ * whose sequence number is newer than the last one it accepted.
+ */
+
+/*
+ * Command fanned out by a group to the groups with the same id on peer
+ * nodes:
+ *
+ *   offset size field
+ *        0    1 magic, PEER_MAGIC
+ *        1    1 version, PEER_VERSION
+ *        2    1 message type, PEER_MESSAGE_GROUP_COMMAND
+ *        3    1 fields set, see GROUP_FIELD_*
+ *        4    4 group id
+ *        8    4 id of the sending node
+ *       12    4 session id of the sending node
+ *       16    4 sequence number, increasing for every command in a session
+ *       20    4 session id of the receiving node, 0 for a broadcast
+ *       24    1 climate mode
+ *       25    1 fan mode
+ *       26    1 swing mode
+ *       27    1 reserved, 0
+ *       28    2 target temperature, signed tenths of a degree C
+ *       30    8 tag over bytes 0 to 29
+ */
+static const size_t PEER_GROUP_COMMAND_SIZE = 38;
+
+static const uint8_t GROUP_FIELD_MODE = 1 << 0;
+static const uint8_t GROUP_FIELD_TARGET_TEMPERATURE = 1 << 1;
+static const uint8_t GROUP_FIELD_FAN_MODE = 1 << 2;
+static const uint8_t GROUP_FIELD_SWING_MODE = 1 << 3;
+
+struct GroupCommand {
+    uint32_t group_id;
+    uint32_t origin;
+    uint32_t origin_session;
+    uint32_t sequence;
+    uint32_t receiver_session;
+    uint8_t fields;
+    Mode mode;
+    FanMode fan;
+    SwingMode swing;
+    float target_temperature;
+};
+
+// Returns the number of bytes written, or 0 if the buffer is too small.
+size_t encode_group_command(const GroupCommand& command, const uint8_t* key,
+                            size_t key_length, uint8_t* buffer,
+                            size_t length);
+
+// Returns false if the buffer doesn't hold a command authenticated with key.
+// Fields with values we don't know about are dropped.
+bool decode_group_command(const uint8_t* buffer, size_t length,
+                          const uint8_t* key, size_t key_length,
+                          GroupCommand* command);
+
+/*
+ * Challenge for a broadcast command, sent back to the node which sent it:
+ *
+ *   offset size field
+ *        0    1 magic, PEER_MAGIC
+ *        1    1 version, PEER_VERSION
+ *        2    1 message type, PEER_MESSAGE_GROUP_CHALLENGE
+ *        3    1 reserved, 0
+ *        4    4 group id
+ *        8    4 id of the node which sent the command
+ *       12    4 session id of the node which sent the command
+ *       16    4 sequence number of the command
+ *       20    4 session id of the challenging node
+ *       24    8 tag over bytes 0 to 23
+ */
+static const size_t PEER_GROUP_CHALLENGE_SIZE = 32;
+
+struct GroupChallenge {
+    uint32_t group_id;
+    uint32_t origin;
+    uint32_t origin_session;
+    uint32_t sequence;
+    uint32_t receiver_session;
+};
+
+size_t encode_group_challenge(const GroupChallenge& challenge,
+                              const uint8_t* key, size_t key_length,
+                              uint8_t* buffer, size_t length);
+bool decode_group_challenge(const uint8_t* buffer, size_t length,
+                            const uint8_t* key, size_t key_length,
+                            GroupChallenge* challenge);
+
+/*
+ * Result of a group command for one member unit, sent back to the node
+ * which forwarded the command:
+ *
+ *   offset size field
+ *        0    1 magic, PEER_MAGIC
+ *        1    1 version, PEER_VERSION
+ *        2    1 message type, PEER_MESSAGE_GROUP_RESULT
+ *        3    1 result, see UpdateResult
+ *        4    4 group id
+ *        8    4 session id of the node which sent the command
+ *       12    4 sequence number of the command
+ *       16    4 unit id of the member
+ *       20    8 tag over bytes 0 to 19
+ */
+static const size_t PEER_GROUP_RESULT_SIZE = 28;
+
+struct GroupResult {
+    uint32_t group_id;
+    uint32_t origin_session;
+    uint32_t sequence;
+    uint32_t unit_id;
+    UpdateResult result;
+};
+
+size_t encode_group_result(const GroupResult& result, const uint8_t* key,
+                           size_t key_length, uint8_t* buffer,
+                           size_t length);
+bool decode_group_result(const uint8_t* buffer, size_t length,
+                         const uint8_t* key, size_t key_length,
+                         GroupResult* result);
+
+} // namespace espmhp
+
+#endif
@@ -0,0 +1,469 @@
+/**
+ * espmhp_core.cpp
+ *
+ * Platform independent decision logic for esphome-mitsubishiheatpump
+ *
+ * License: BSD
+ */
+
+#include "espmhp_core.h"
+
+#include <cmath>
+#include <cstring>
+
+namespace espmhp {
+
+const char* const VERTICAL_VANE_OPTIONS[VANE_OPTION_COUNT] = {
+    "swing", "auto", "up", "up_center", "center", "down_center", "down"
+};
+// const char* VANE_MAP[7]        = {"AUTO", "1", "2", "3", "4", "5", "SWING"};
+const char* const VERTICAL_VANE_SETTINGS[VANE_OPTION_COUNT] = {
+    "SWING", "AUTO", "1", "2", "3", "4", "5"
+};
+
+const char* const HORIZONTAL_VANE_OPTIONS[VANE_OPTION_COUNT] = {
+    "auto", "swing", "left", "left_center", "center", "right_center", "right"
+};
+// const char* WIDEVANE_MAP[7]    = {"<<", "<",  "|",  ">",  ">>", "<>", "SWING"};
+const char* const HORIZONTAL_VANE_SETTINGS[VANE_OPTION_COUNT] = {
+    "<>", "SWING", "<<", "<", "|", ">", ">>"
+};
+
+// strcmp() which treats a null pointer as matching nothing. Settings fields
+// are null until the library has decoded them from a frame.
+static bool equals(const char* value, const char* expected) {
+    return value != nullptr && strcmp(value, expected) == 0;
+}
+
+static uint32_t minutes_to_ms(uint32_t minutes) {
+    return minutes * 60 * 1000;
+}
+
+uint8_t find_option(const char* value, const char* const* options,
+                    size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (equals(value, options[i])) {
+            return i;
+        }
+    }
+    return VANE_UNKNOWN;
+}
+
+/**
+ * Translate settings read from the unit into climate entity terms.
+ *
+ * https://github.com/geoffdavis/HeatPump/blob/stream/src/HeatPump.h#L125
+ * const char* POWER_MAP[2]       = {"OFF", "ON"};
+ * const char* MODE_MAP[5]        = {"HEAT", "DRY", "COOL", "FAN", "AUTO"};
+ * const char* FAN_MAP[6]         = {"AUTO", "QUIET", "1", "2", "3", "4"};
+ *
+ * Any field may be null or hold an unexpected value if the unit sent a frame
+ * the library couldn't fully decode; those fall back to safe defaults.
+ */
+DecodedSettings decode_settings(const UnitSettings& settings) {
+    DecodedSettings decoded{};
+    decoded.mode_known = true;
+
+    if (equals(settings.power, "ON")) {
+        if (equals(settings.mode, "HEAT")) {
+            decoded.mode = MODE_HEAT;
+        } else if (equals(settings.mode, "DRY")) {
+            decoded.mode = MODE_DRY;
+        } else if (equals(settings.mode, "COOL")) {
+            decoded.mode = MODE_COOL;
+        } else if (equals(settings.mode, "FAN")) {
+            decoded.mode = MODE_FAN_ONLY;
+        } else if (equals(settings.mode, "AUTO")) {
+            decoded.mode = MODE_HEAT_COOL;
+        } else {
+            decoded.mode_known = false;
+        }
+    } else {
+        decoded.mode = MODE_OFF;
+    }
+    decoded.action = idle_action(decoded.mode);
+
+    if (equals(settings.fan, "QUIET")) {
+        decoded.fan = FAN_DIFFUSE;
+    } else if (equals(settings.fan, "1")) {
+        decoded.fan = FAN_LOW;
+    } else if (equals(settings.fan, "2")) {
+        decoded.fan = FAN_MEDIUM;
+    } else if (equals(settings.fan, "3")) {
+        decoded.fan = FAN_MIDDLE;
+    } else if (equals(settings.fan, "4")) {
+        decoded.fan = FAN_HIGH;
+    } else { //case "AUTO" or default:
+        decoded.fan = FAN_AUTO;
+    }
+
+    bool vane_swing = equals(settings.vane, "SWING");
+    bool wide_vane_swing = equals(settings.wide_vane, "SWING");
+    if (vane_swing && wide_vane_swing) {
+        decoded.swing = SWING_BOTH;
+    } else if (vane_swing) {
+        decoded.swing = SWING_VERTICAL;
+    } else if (wide_vane_swing) {
+        decoded.swing = SWING_HORIZONTAL;
+    } else {
+        decoded.swing = SWING_OFF;
+    }
+
+    decoded.vertical_vane = find_option(
+        settings.vane, VERTICAL_VANE_SETTINGS, VANE_OPTION_COUNT);
+    decoded.horizontal_vane = find_option(
+        settings.wide_vane, HORIZONTAL_VANE_SETTINGS, VANE_OPTION_COUNT);
+
+    decoded.temperature = settings.temperature;
+    decoded.temperature_valid = setpoint_valid(settings.temperature);
+    return decoded;
+}
+
+bool settings_complete(const UnitSettings& settings) {
+    return settings.power != nullptr && settings.mode != nullptr &&
+        settings.fan != nullptr && settings.vane != nullptr &&
+        settings.wide_vane != nullptr &&
+        setpoint_valid(settings.temperature);
+}
+
+Action idle_action(Mode mode) {
+    switch (mode) {
+        case MODE_COOL:
+        case MODE_HEAT:
+        case MODE_HEAT_COOL:
+            return ACTION_IDLE;
+        case MODE_DRY:
+            return ACTION_DRYING;
+        case MODE_FAN_ONLY:
+            return ACTION_FAN;
+        case MODE_OFF:
+        default:
+            return ACTION_OFF;
+    }
+}
+
+SetpointSlot setpoint_slot(const DecodedSettings& decoded, bool relaxed,
+                           bool failsafe) {
+    if (!decoded.mode_known || !decoded.temperature_valid || relaxed ||
+        failsafe) {
+        return SETPOINT_NONE;
+    }
+    switch (decoded.mode) {
+        case MODE_HEAT:
+            return SETPOINT_HEAT;
+        case MODE_COOL:
+            return SETPOINT_COOL;
+        case MODE_HEAT_COOL:
+            return SETPOINT_AUTO;
+        default:
+            return SETPOINT_NONE;
+    }
+}
+
+const char* mode_to_setting(Mode mode) {
+    switch (mode) {
+        case MODE_COOL:
+            return "COOL";
+        case MODE_HEAT:
+            return "HEAT";
+        case MODE_DRY:
+            return "DRY";
+        case MODE_HEAT_COOL:
+            return "AUTO";
+        case MODE_FAN_ONLY:
+            return "FAN";
+        case MODE_OFF:
+        default:
+            return nullptr;
+    }
+}
+
+const char* fan_to_setting(FanMode fan) {
+    switch (fan) {
+        case FAN_OFF:
+            return nullptr;
+        case FAN_DIFFUSE:
+            return "QUIET";
+        case FAN_LOW:
+            return "1";
+        case FAN_MEDIUM:
+            return "2";
+        case FAN_MIDDLE:
+            return "3";
+        case FAN_HIGH:
+            return "4";
+        case FAN_ON:
+        case FAN_AUTO:
+        default:
+            return "AUTO";
+    }
+}
+
+bool swing_to_settings(SwingMode swing, const char** vane,
+                       const char** wide_vane) {
+    switch (swing) {
+        case SWING_OFF:
+            *vane = "AUTO";
+            *wide_vane = "|";
+            return true;
+        case SWING_VERTICAL:
+            *vane = "SWING";
+            *wide_vane = "|";
+            return true;
+        case SWING_HORIZONTAL:
+            *vane = "3";
+            *wide_vane = "SWING";
+            return true;
+        case SWING_BOTH:
+            *vane = "SWING";
+            *wide_vane = "SWING";
+            return true;
+        default:
+            return false;
+    }
+}
+
+Action status_action(Mode mode, bool operating, float current_temperature,
+                     float target_temperature) {
+    switch (mode) {
+        case MODE_HEAT:
+            return operating ? ACTION_HEATING : ACTION_IDLE;
+        case MODE_COOL:
+            return operating ? ACTION_COOLING : ACTION_IDLE;
+        case MODE_HEAT_COOL:
+            if (operating) {
+                if (current_temperature > target_temperature) {
+                    return ACTION_COOLING;
+                } else if (current_temperature < target_temperature) {
+                    return ACTION_HEATING;
+                }
+            }
+            return ACTION_IDLE;
+        case MODE_DRY:
+            return operating ? ACTION_DRYING : ACTION_IDLE;
+        case MODE_FAN_ONLY:
+            return ACTION_FAN;
+        default:
+            return ACTION_OFF;
+    }
+}
+
+bool setpoint_valid(float temperature) {
+    return temperature >= ESPMHP_MIN_TEMPERATURE &&
+        temperature <= ESPMHP_MAX_TEMPERATURE;
+}
+
+float clamp_setpoint(float temperature) {
+    if (!(temperature >= ESPMHP_MIN_TEMPERATURE)) { // also catches NaN
+        return ESPMHP_MIN_TEMPERATURE;
+    }
+    if (temperature > ESPMHP_MAX_TEMPERATURE) {
+        return ESPMHP_MAX_TEMPERATURE;
+    }
+    return temperature;
+}
+
+void RemoteTemperatureMonitor::set_operating_timeout_minutes(uint32_t minutes) {
+    operating_timeout_ = minutes;
+}
+
+void RemoteTemperatureMonitor::set_idle_timeout_minutes(uint32_t minutes) {
+    idle_timeout_ = minutes;
+}
+
+void RemoteTemperatureMonitor::set_ping_timeout_minutes(uint32_t minutes) {
+    ping_timeout_ = minutes;
+}
+
+uint32_t RemoteTemperatureMonitor::operating_timeout_minutes() const {
+    return operating_timeout_.value_or(0);
+}
+
+uint32_t RemoteTemperatureMonitor::idle_timeout_minutes() const {
+    return idle_timeout_.value_or(0);
+}
+
+uint32_t RemoteTemperatureMonitor::ping_timeout_minutes() const {
+    return ping_timeout_.value_or(0);
+}
+
+void RemoteTemperatureMonitor::ping(uint32_t now) {
+    last_ping_ = now;
+}
+
+void RemoteTemperatureMonitor::set_remote_temperature(uint32_t now,
+                                                      float temperature) {
+    if (temperature > 0) {
+        last_remote_temperature_update_ = now;
+    } else {
+        last_remote_temperature_update_.reset();
+    }
+    remote_temperature_ = temperature;
+}
+
+void RemoteTemperatureMonitor::refresh_remote_temperature(uint32_t now) {
+    if (last_remote_temperature_update_.has_value()) {
+        last_remote_temperature_update_ = now;
+    }
+}
+
+RemoteTemperatureMonitor::Event RemoteTemperatureMonitor::check(
+        uint32_t now, bool operating) {
+    // Handle ping timeouts.
+    if (ping_timeout_.has_value() && last_ping_.has_value()) {
+        if (now - last_ping_.value() > minutes_to_ms(ping_timeout_.value())) {
+            last_ping_.reset();
+            return EVENT_PING_TIMEOUT;
+        }
+    }
+
+    // Handle set_remote_temperature timeouts.
+    auto timeout = operating ? operating_timeout_ : idle_timeout_;
+    if (timeout.has_value() && last_remote_temperature_update_.has_value()) {
+        if (now - last_remote_temperature_update_.value() >
+                minutes_to_ms(timeout.value())) {
+            return EVENT_REMOTE_TEMPERATURE_TIMEOUT;
+        }
+    }
+    return EVENT_NONE;
+}
+
+bool RemoteTemperatureMonitor::remote_temperature_active() const {
+    return last_remote_temperature_update_.has_value();
+}
+
+float RemoteTemperatureMonitor::remote_temperature() const {
+    return remote_temperature_;
+}
+
+uint32_t RemoteTemperatureMonitor::remote_temperature_age(uint32_t now) const {
+    if (!last_remote_temperature_update_.has_value()) {
+        return ESPMHP_SNAPSHOT_NO_AGE;
+    }
+    return (now - last_remote_temperature_update_.value()) / 1000;
+}
+
+uint32_t RemoteTemperatureMonitor::ping_age(uint32_t now) const {
+    if (!last_ping_.has_value()) {
+        return ESPMHP_SNAPSHOT_NO_AGE;
+    }
+    return (now - last_ping_.value()) / 1000;
+}
+
+bool FailsafePolicy::configured() const {
+    return mode.has_value() || target_temperature.has_value() ||
+        min_room_temperature.has_value() || max_room_temperature.has_value();
+}
+
+GuardDecision failsafe_guard(const FailsafePolicy& policy,
+                             float room_temperature,
+                             const UnitSettings& settings) {
+    GuardDecision decision{GUARD_NONE, 0};
+    if (std::isnan(room_temperature) ||
+            settings.power == nullptr || settings.mode == nullptr) {
+        return decision;
+    }
+    bool powered = equals(settings.power, "ON");
+    bool auto_mode = equals(settings.mode, "AUTO");
+
+    if (policy.min_room_temperature.has_value() &&
+            room_temperature < *policy.min_room_temperature) {
+        float setpoint = clamp_setpoint(*policy.min_room_temperature);
+        bool heating = powered &&
+            (equals(settings.mode, "HEAT") || auto_mode) &&
+            settings.temperature >= setpoint;
+        if (!heating) {
+            decision = {GUARD_HEAT, setpoint};
+        }
+    } else if (policy.max_room_temperature.has_value() &&
+            room_temperature > *policy.max_room_temperature) {
+        float setpoint = clamp_setpoint(*policy.max_room_temperature);
+        bool cooling = powered &&
+            (equals(settings.mode, "COOL") || auto_mode) &&
+            settings.temperature <= setpoint;
+        if (!cooling) {
+            decision = {GUARD_COOL, setpoint};
+        }
+    }
+    return decision;
+}
+
+bool PersistedState::operator==(const PersistedState& other) const {
+    return mode == other.mode && fan == other.fan && swing == other.swing &&
+        vertical_vane == other.vertical_vane &&
+        horizontal_vane == other.horizontal_vane &&
+        target_temperature == other.target_temperature;
+}
+
+bool PersistedState::operator!=(const PersistedState& other) const {
+    return !(*this == other);
+}
+
+int16_t encode_tenths(float temperature) {
+    // Also rejects NaN and anything which doesn't fit in 16 bits.
+    if (!(temperature > -3000 && temperature < 3000)) {
+        return ESPMHP_SNAPSHOT_NO_TEMPERATURE;
+    }
+    return (int16_t) lroundf(temperature * 10);
+}
+
+float decode_tenths(int16_t tenths) {
+    if (tenths == ESPMHP_SNAPSHOT_NO_TEMPERATURE) {
+        return NAN;
+    }
+    return tenths / 10.0f;
+}
+
+// Little-endian writers used to build snapshots.
+static void put_u16(uint8_t* buffer, size_t offset, uint16_t value) {
+    buffer[offset] = value & 0xFF;
+    buffer[offset + 1] = value >> 8;
+}
+
+static void put_u32(uint8_t* buffer, size_t offset, uint32_t value) {
+    put_u16(buffer, offset, value & 0xFFFF);
+    put_u16(buffer, offset + 2, value >> 16);
+}
+
+size_t encode_snapshot(const SnapshotState& state, uint8_t* buffer,
+                       size_t length) {
+    if (length < ESPMHP_SNAPSHOT_SIZE) {
+        return 0;
+    }
+    memset(buffer, 0, ESPMHP_SNAPSHOT_SIZE);
+
+    buffer[0] = ESPMHP_SNAPSHOT_MAGIC;
+    buffer[1] = ESPMHP_SNAPSHOT_VERSION;
+    put_u16(buffer, 2, ESPMHP_SNAPSHOT_SIZE);
+    put_u32(buffer, 4, state.unit_id);
+    put_u32(buffer, 8, state.uptime);
+    buffer[12] = state.mode;
+    buffer[13] = state.action;
+    buffer[14] = state.fan_mode;
+    buffer[15] = state.swing_mode;
+    buffer[16] = state.vertical_vane;
+    buffer[17] = state.horizontal_vane;
+    buffer[18] = state.flags;
+    put_u16(buffer, 20, (uint16_t) encode_tenths(state.target_temperature));
+    put_u16(buffer, 22, (uint16_t) encode_tenths(state.current_temperature));
+    put_u16(buffer, 24, (uint16_t) encode_tenths(state.remote_temperature));
+    put_u16(buffer, 26, state.operating_timeout);
+    put_u16(buffer, 28, state.idle_timeout);
+    put_u16(buffer, 30, state.ping_timeout);
+    put_u32(buffer, 32, state.remote_temperature_age);
+    put_u32(buffer, 36, state.ping_age);
+    put_u32(buffer, 40, state.counters.settings_changes);
+    put_u32(buffer, 44, state.counters.status_changes);
+    put_u32(buffer, 48, state.counters.updates_sent);
+    put_u32(buffer, 52, state.counters.updates_failed);
+    put_u32(buffer, 56, state.counters.ping_timeouts);
+    put_u32(buffer, 60, state.counters.remote_temperature_timeouts);
+    put_u16(buffer, 64, state.counters.queue_depth);
+    put_u16(buffer, 66, state.counters.queue_depth_max);
+    put_u32(buffer, 68, state.counters.command_wait_last);
+    put_u32(buffer, 72, state.counters.command_wait_max);
+    put_u32(buffer, 76, state.counters.poll_lateness_max);
+    return ESPMHP_SNAPSHOT_SIZE;
+}
+
+} // namespace espmhp
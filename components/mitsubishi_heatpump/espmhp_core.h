@@ -0,0 +1,316 @@
+/**
+ * espmhp_core.h
+ *
+ * Platform independent decision logic for esphome-mitsubishiheatpump
+ *
+ * License: BSD
+ *
+ * Nothing in this file may depend on Arduino, ESPHome or the HeatPump
+ * library, so that the logic can be compiled, tested and profiled on a host
+ * machine. The same holds for every espmhp_* file the host library in
+ * CMakeLists.txt is built from; only espmhp.h, espmhp_group.h and
+ * mitsubishi_ac_select.h may use the platform.
+ *
+ * MitsubishiHeatPump (espmhp.h) is the adapter between this core and the
+ * climate entity, vane selects, preferences and the serial port. Time is
+ * always passed in as milliseconds, as returned by millis() on the device.
+ */
+
+#ifndef ESPMHP_CORE_H
+#define ESPMHP_CORE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+#include "espmhp_snapshot.h"
+
+static const uint8_t ESPMHP_MIN_TEMPERATURE = 16; // degrees C,
+                                                  // defined by hardware
+static const uint8_t ESPMHP_MAX_TEMPERATURE = 31; // degrees C,
+                                                  //defined by hardware
+static const float   ESPMHP_TEMPERATURE_STEP = 0.5; // temperature setting step,
+                                                    // in degrees C
+
+namespace espmhp {
+
+// The values of these enums match the esphome::climate enums, which is
+// checked with static_asserts in espmhp.cpp.
+enum Mode : uint8_t {
+    MODE_OFF = 0,
+    MODE_HEAT_COOL = 1,
+    MODE_COOL = 2,
+    MODE_HEAT = 3,
+    MODE_FAN_ONLY = 4,
+    MODE_DRY = 5,
+};
+
+enum Action : uint8_t {
+    ACTION_OFF = 0,
+    ACTION_COOLING = 2,
+    ACTION_HEATING = 3,
+    ACTION_IDLE = 4,
+    ACTION_DRYING = 5,
+    ACTION_FAN = 6,
+};
+
+enum FanMode : uint8_t {
+    FAN_ON = 0,
+    FAN_OFF = 1,
+    FAN_AUTO = 2,
+    FAN_LOW = 3,
+    FAN_MEDIUM = 4,
+    FAN_HIGH = 5,
+    FAN_MIDDLE = 6,
+    FAN_FOCUS = 7,
+    FAN_DIFFUSE = 8,
+};
+
+enum SwingMode : uint8_t {
+    SWING_OFF = 0,
+    SWING_BOTH = 1,
+    SWING_VERTICAL = 2,
+    SWING_HORIZONTAL = 3,
+};
+
+/*
+ * Supported modes, fan modes and swing modes, as bit masks indexed by the
+ * enums above. climate.py only generates masks when the supports block
+ * differs from these defaults. MODE_OFF is always supported.
+ */
+static const uint16_t DEFAULT_SUPPORTED_MODES =
+    (1 << MODE_OFF) | (1 << MODE_HEAT_COOL) | (1 << MODE_COOL) | (1 << MODE_HEAT) |
+    (1 << MODE_DRY) | (1 << MODE_FAN_ONLY);
+static const uint16_t DEFAULT_SUPPORTED_FAN_MODES =
+    (1 << FAN_AUTO) | (1 << FAN_DIFFUSE) | (1 << FAN_LOW) |
+    (1 << FAN_MEDIUM) | (1 << FAN_MIDDLE) | (1 << FAN_HIGH);
+static const uint8_t DEFAULT_SUPPORTED_SWING_MODES =
+    (1 << SWING_OFF) | (1 << SWING_VERTICAL);
+
+/*
+ * Vane select options and the matching HeatPump library settings, in the
+ * order the options are declared in climate.py.
+ */
+static const size_t VANE_OPTION_COUNT = 7;
+static const uint8_t VANE_UNKNOWN = 0xFF;
+extern const char* const VERTICAL_VANE_OPTIONS[VANE_OPTION_COUNT];
+extern const char* const VERTICAL_VANE_SETTINGS[VANE_OPTION_COUNT];
+extern const char* const HORIZONTAL_VANE_OPTIONS[VANE_OPTION_COUNT];
+extern const char* const HORIZONTAL_VANE_SETTINGS[VANE_OPTION_COUNT];
+
+// Index of value in options, or VANE_UNKNOWN if it isn't there or is null.
+uint8_t find_option(const char* value, const char* const* options,
+                    size_t count);
+
+/*
+ * Settings as reported by the HeatPump library (heatpumpSettings). The
+ * strings point into the library's static lookup tables.
+ */
+struct UnitSettings {
+    const char* power;
+    const char* mode;
+    float temperature;
+    const char* fan;
+    const char* vane;
+    const char* wide_vane;
+};
+
+// UnitSettings translated to climate entity terms.
+struct DecodedSettings {
+    // False if the mode reported by the unit isn't one we know about, in
+    // which case mode and action should be left alone.
+    bool mode_known;
+    Mode mode;
+    Action action;
+    FanMode fan;
+    SwingMode swing;
+    uint8_t vertical_vane;   // index into VERTICAL_VANE_OPTIONS
+    uint8_t horizontal_vane; // index into HORIZONTAL_VANE_OPTIONS
+    float temperature;
+    // False if temperature is outside of what the hardware accepts.
+    bool temperature_valid;
+};
+
+DecodedSettings decode_settings(const UnitSettings& settings);
+
+// Whether every field has been decoded and is usable, e.g. to send the
+// settings back to the unit.
+bool settings_complete(const UnitSettings& settings);
+
+// The action to report right after switching to a mode, before the unit
+// tells us whether it is operating.
+Action idle_action(Mode mode);
+
+// Modes whose last setpoint is remembered, akin to the IR remote.
+enum SetpointSlot : uint8_t {
+    SETPOINT_NONE = 0,
+    SETPOINT_HEAT = 1,
+    SETPOINT_COOL = 2,
+    SETPOINT_AUTO = 3,
+};
+
+// Where to remember the setpoint of the settings read from the unit. Only
+// setpoints the user chose are remembered: not one relaxed to keep within
+// the operating units budget, nor one set by the fail-safe policy.
+SetpointSlot setpoint_slot(const DecodedSettings& decoded, bool relaxed,
+                           bool failsafe);
+
+// Library MODE_MAP value for a mode, or nullptr if the mode means power off.
+const char* mode_to_setting(Mode mode);
+
+// Library FAN_MAP value for a fan mode, or nullptr if the fan mode means
+// power off.
+const char* fan_to_setting(FanMode fan);
+
+// Library vane and wide vane values for a swing mode. Returns false for
+// unsupported swing modes.
+bool swing_to_settings(SwingMode swing, const char** vane,
+                       const char** wide_vane);
+
+// The action to report for a status update from the unit.
+Action status_action(Mode mode, bool operating, float current_temperature,
+                     float target_temperature);
+
+// Whether a setpoint is within the range accepted by the hardware. False for
+// NaN.
+bool setpoint_valid(float temperature);
+
+// Clamp a setpoint to the range accepted by the hardware. NaN is clamped to
+// the minimum.
+float clamp_setpoint(float temperature);
+
+/**
+ * Tracks the remote temperature sensor and controller pings, and decides
+ * when to revert to the internal temperature sensor.
+ */
+class RemoteTemperatureMonitor {
+    public:
+        enum Event {
+            EVENT_NONE,
+            EVENT_PING_TIMEOUT,
+            EVENT_REMOTE_TEMPERATURE_TIMEOUT,
+        };
+
+        void set_operating_timeout_minutes(uint32_t minutes);
+        void set_idle_timeout_minutes(uint32_t minutes);
+        void set_ping_timeout_minutes(uint32_t minutes);
+
+        // Timeouts in minutes, 0 if unset.
+        uint32_t operating_timeout_minutes() const;
+        uint32_t idle_timeout_minutes() const;
+        uint32_t ping_timeout_minutes() const;
+
+        void ping(uint32_t now);
+
+        // Record a new remote temperature, or a switch back to the internal
+        // sensor if temperature <= 0.
+        void set_remote_temperature(uint32_t now, float temperature);
+
+        // Give the remote sensor a fresh timeout window, e.g. after the
+        // setpoint was changed.
+        void refresh_remote_temperature(uint32_t now);
+
+        // Check the timeouts. A ping timeout disarms the ping check until the
+        // next ping; the caller must switch back to the internal sensor on
+        // either timeout.
+        Event check(uint32_t now, bool operating);
+
+        bool remote_temperature_active() const;
+        float remote_temperature() const;
+
+        // Ages in seconds, ESPMHP_SNAPSHOT_NO_AGE if unknown.
+        uint32_t remote_temperature_age(uint32_t now) const;
+        uint32_t ping_age(uint32_t now) const;
+
+    private:
+        std::optional<uint32_t> operating_timeout_;
+        std::optional<uint32_t> idle_timeout_;
+        std::optional<uint32_t> ping_timeout_;
+        std::optional<uint32_t> last_remote_temperature_update_;
+        std::optional<uint32_t> last_ping_;
+        float remote_temperature_ = 0;
+};
+
+// What to do when the controller can't be reached.
+struct FailsafePolicy {
+    std::optional<Mode> mode;
+    std::optional<float> target_temperature;
+    std::optional<float> min_room_temperature;
+    std::optional<float> max_room_temperature;
+
+    bool configured() const;
+};
+
+enum GuardAction : uint8_t {
+    GUARD_NONE,
+    GUARD_HEAT,
+    GUARD_COOL,
+};
+
+struct GuardDecision {
+    GuardAction action;
+    float setpoint;
+};
+
+// Decide whether the unit must be forced to heat or cool to keep the room
+// within the fail-safe bounds.
+GuardDecision failsafe_guard(const FailsafePolicy& policy,
+                             float room_temperature,
+                             const UnitSettings& settings);
+
+/**
+ * The last settings confirmed by the unit, persisted so that they can be
+ * published right after boot, before the first settings frame is read.
+ * Kept small enough for the ESP8266's RTC memory.
+ *
+ * Only settings are kept: they change when someone changes them, whereas
+ * the room temperature and the compressor state change all the time and
+ * would wear the flash where preferences are stored there.
+ */
+struct PersistedState {
+    uint8_t mode;
+    uint8_t fan;
+    uint8_t swing;
+    uint8_t vertical_vane;
+    uint8_t horizontal_vane;
+    uint8_t reserved;
+    int16_t target_temperature; // tenths of a degree C
+
+    bool operator==(const PersistedState& other) const;
+    bool operator!=(const PersistedState& other) const;
+};
+
+// Temperatures as stored in PersistedState. NaN is stored as
+// ESPMHP_SNAPSHOT_NO_TEMPERATURE.
+int16_t encode_tenths(float temperature);
+float decode_tenths(int16_t tenths);
+
+// Everything that goes into a snapshot, see espmhp_snapshot.h.
+struct SnapshotState {
+    uint32_t unit_id;
+    uint32_t uptime;
+    uint8_t mode;
+    uint8_t action;
+    uint8_t fan_mode;
+    uint8_t swing_mode;
+    uint8_t vertical_vane;
+    uint8_t horizontal_vane;
+    uint8_t flags;
+    float target_temperature;
+    float current_temperature;
+    float remote_temperature;
+    uint16_t operating_timeout;
+    uint16_t idle_timeout;
+    uint16_t ping_timeout;
+    uint32_t remote_temperature_age;
+    uint32_t ping_age;
+    EspmhpCounters counters;
+};
+
+// Returns the number of bytes written, or 0 if the buffer is too small.
+size_t encode_snapshot(const SnapshotState& state, uint8_t* buffer,
+                       size_t length);
+
+} // namespace espmhp
+
+#endif
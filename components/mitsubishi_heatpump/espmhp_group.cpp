@@ -0,0 +1,357 @@
+/**
+ * espmhp_group.cpp
+ *
+ * Climate entity controlling a group of MitsubishiHeatPumps with one call
+ *
+ * License: BSD
+ */
+
+#include "espmhp_group.h"
+using namespace esphome;
+
+void MitsubishiHeatPumpGroup::add_member(MitsubishiHeatPump* member) {
+    if (this->member_count_ >= ESPMHP_MAX_GROUP_MEMBERS) {
+        ESP_LOGW(TAG, "Too many group members, ignoring %s",
+                 member->get_name().c_str());
+        return;
+    }
+    size_t index = this->member_count_++;
+    this->members_[index] = member;
+    member->add_on_update_result_callback(
+        [this, index](espmhp::UpdateResult result) {
+            this->member_updated(index, result);
+        });
+}
+
+#ifdef USE_ESPMHP_GROUP_PEERS
+void MitsubishiHeatPumpGroup::set_peers(uint16_t port,
+                                        const std::string& key) {
+    this->peer_port_ = port;
+    this->peer_key_ = key;
+}
+#endif
+
+void MitsubishiHeatPumpGroup::setup() {
+    this->group_id_ = fnv1_hash(this->get_object_id());
+    this->origin_ = fnv1_hash(App.get_name());
+
+    this->mode = climate::CLIMATE_MODE_OFF;
+    this->target_temperature = NAN;
+
+#ifdef USE_ESPMHP_GROUP_PEERS
+    // 0 stands for no session in broadcasts.
+    do {
+        this->session_ = random_uint32();
+    } while (this->session_ == 0);
+    if (this->peer_port_ != 0 && !this->peer_udp_.begin(this->peer_port_)) {
+        ESP_LOGW(TAG, "Group %s: unable to listen on port %u",
+                 this->get_name().c_str(), this->peer_port_);
+    }
+#endif
+}
+
+void MitsubishiHeatPumpGroup::loop() {
+#ifdef USE_ESPMHP_GROUP_PEERS
+    if (this->peer_port_ == 0) {
+        return;
+    }
+
+    const uint8_t* key = (const uint8_t*) this->peer_key_.data();
+    size_t key_length = this->peer_key_.size();
+    // Large enough for the largest message.
+    uint8_t buffer[espmhp::PEER_GROUP_COMMAND_SIZE];
+    while (this->peer_udp_.parsePacket() > 0) {
+        IPAddress address = this->peer_udp_.remoteIP();
+        uint16_t port = this->peer_udp_.remotePort();
+        int length = this->peer_udp_.read(buffer, sizeof(buffer));
+        if (length <= 0) {
+            continue;
+        }
+
+        espmhp::GroupCommand command;
+        espmhp::GroupChallenge challenge;
+        espmhp::GroupResult result;
+        if (espmhp::decode_group_command(buffer, length, key, key_length,
+                                         &command)) {
+            this->receive_command(command, address, port);
+        } else if (espmhp::decode_group_challenge(buffer, length, key,
+                                                  key_length, &challenge)) {
+            this->receive_challenge(challenge, address, port);
+        } else if (espmhp::decode_group_result(buffer, length, key,
+                                               key_length, &result)) {
+            if (result.group_id != this->group_id_ ||
+                    result.origin_session != this->session_ ||
+                    result.sequence != this->sequence_) {
+                // Not ours, or for a call that was superseded.
+                continue;
+            }
+            ESPMHP_LOGD(TAG, "Group %s: peer unit %08X %s",
+                     this->get_name().c_str(), (unsigned) result.unit_id,
+                     espmhp::update_result_to_string(result.result));
+            this->member_result_callback_.call(result.unit_id, result.result);
+        } else {
+            ESPMHP_LOGD(TAG, "Group %s: dropping unauthenticated message",
+                     this->get_name().c_str());
+        }
+    }
+#endif
+}
+
+climate::ClimateTraits MitsubishiHeatPumpGroup::traits() {
+    if (this->member_count_ == 0) {
+        return climate::ClimateTraits();
+    }
+    return this->members_[0]->get_traits();
+}
+
+void MitsubishiHeatPumpGroup::control(const climate::ClimateCall &call) {
+    espmhp::GroupCommand command{};
+    command.group_id = this->group_id_;
+    command.origin = this->origin_;
+    command.sequence = ++this->sequence_;
+    command.target_temperature = NAN;
+
+    if (call.get_mode().has_value()) {
+        command.fields |= espmhp::GROUP_FIELD_MODE;
+        command.mode = static_cast<espmhp::Mode>(*call.get_mode());
+    }
+    if (call.get_target_temperature().has_value()) {
+        command.fields |= espmhp::GROUP_FIELD_TARGET_TEMPERATURE;
+        command.target_temperature = *call.get_target_temperature();
+    }
+    if (call.get_fan_mode().has_value()) {
+        command.fields |= espmhp::GROUP_FIELD_FAN_MODE;
+        command.fan = static_cast<espmhp::FanMode>(*call.get_fan_mode());
+    }
+    if (call.get_swing_mode().has_value()) {
+        command.fields |= espmhp::GROUP_FIELD_SWING_MODE;
+        command.swing = static_cast<espmhp::SwingMode>(*call.get_swing_mode());
+    }
+
+    this->update_state(command);
+
+#ifdef USE_ESPMHP_GROUP_PEERS
+    // Forward first, so the peers work in parallel with the local members.
+    if (this->peer_port_ != 0) {
+        this->forward(command);
+    }
+#endif
+
+#ifdef USE_ESPMHP_GROUP_PEERS
+    this->reply_port_ = 0;
+#endif
+    this->apply(command);
+}
+
+void MitsubishiHeatPumpGroup::add_on_member_result_callback(
+        std::function<void(uint32_t, espmhp::UpdateResult)> &&callback) {
+    this->member_result_callback_.add(std::move(callback));
+}
+
+void MitsubishiHeatPumpGroup::update_state(const espmhp::GroupCommand& command) {
+    if (command.fields & espmhp::GROUP_FIELD_MODE) {
+        this->mode = static_cast<climate::ClimateMode>(command.mode);
+    }
+    if (command.fields & espmhp::GROUP_FIELD_TARGET_TEMPERATURE) {
+        this->target_temperature = command.target_temperature;
+    }
+    if (command.fields & espmhp::GROUP_FIELD_FAN_MODE) {
+        this->fan_mode = static_cast<climate::ClimateFanMode>(command.fan);
+    }
+    if (command.fields & espmhp::GROUP_FIELD_SWING_MODE) {
+        this->swing_mode = static_cast<climate::ClimateSwingMode>(command.swing);
+    }
+    this->publish_state();
+}
+
+void MitsubishiHeatPumpGroup::apply(const espmhp::GroupCommand& command) {
+    climate::ClimateMode mode = static_cast<climate::ClimateMode>(command.mode);
+    climate::ClimateFanMode fan =
+        static_cast<climate::ClimateFanMode>(command.fan);
+    climate::ClimateSwingMode swing =
+        static_cast<climate::ClimateSwingMode>(command.swing);
+
+    for (size_t i = 0; i < this->member_count_; i++) {
+        MitsubishiHeatPump* member = this->members_[i];
+
+        if ((command.fields & espmhp::GROUP_FIELD_MODE) &&
+                !member->supports_mode(mode)) {
+            this->results_[i] = espmhp::UPDATE_UNSUPPORTED;
+            this->waiting_[i] = false;
+        } else if (((command.fields & espmhp::GROUP_FIELD_FAN_MODE) &&
+                        !member->supports_fan_mode(fan)) ||
+                   ((command.fields & espmhp::GROUP_FIELD_SWING_MODE) &&
+                        !member->supports_swing_mode(swing))) {
+            this->results_[i] = espmhp::UPDATE_REJECTED;
+            this->waiting_[i] = false;
+        } else {
+            // Goes through the member's own validation and control().
+            auto call = member->make_call();
+            if (command.fields & espmhp::GROUP_FIELD_MODE) {
+                call.set_mode(mode);
+            }
+            if (command.fields & espmhp::GROUP_FIELD_TARGET_TEMPERATURE) {
+                call.set_target_temperature(command.target_temperature);
+            }
+            if (command.fields & espmhp::GROUP_FIELD_FAN_MODE) {
+                call.set_fan_mode(fan);
+            }
+            if (command.fields & espmhp::GROUP_FIELD_SWING_MODE) {
+                call.set_swing_mode(swing);
+            }
+            // Queued only: each member sends from its own update(), so the
+            // group doesn't wait for every unit's acknowledgement in turn.
+            member->hold_commands(true);
+            call.perform();
+            member->hold_commands(false);
+            this->results_[i] = member->last_update_result();
+            this->waiting_[i] = this->results_[i] == espmhp::UPDATE_QUEUED ||
+                this->results_[i] == espmhp::UPDATE_DEFERRED;
+        }
+        this->report(i);
+    }
+}
+
+void MitsubishiHeatPumpGroup::member_updated(size_t index,
+                                             espmhp::UpdateResult result) {
+    if (!this->waiting_[index]) {
+        // Not for a group call.
+        return;
+    }
+    this->waiting_[index] = false;
+    this->results_[index] = result;
+    this->report(index);
+}
+
+void MitsubishiHeatPumpGroup::report(size_t index) {
+    MitsubishiHeatPump* member = this->members_[index];
+    ESPMHP_LOGD(TAG, "Group %s: %s %s", this->get_name().c_str(),
+             member->get_name().c_str(),
+             espmhp::update_result_to_string(this->results_[index]));
+#ifdef USE_ESPMHP_GROUP_PEERS
+    if (this->reply_port_ != 0) {
+        // For a peer's call: the peer reports it.
+        this->send_result(index);
+        return;
+    }
+#endif
+    this->member_result_callback_.call(member->get_unit_id(),
+                                       this->results_[index]);
+}
+
+#ifdef USE_ESPMHP_GROUP_PEERS
+void MitsubishiHeatPumpGroup::forward(const espmhp::GroupCommand& command) {
+    this->last_command_ = command;
+    this->last_command_.origin_session = this->session_;
+    this->last_command_.receiver_session = 0;
+    this->send_command(this->last_command_, IPAddress(255, 255, 255, 255),
+                       this->peer_port_);
+}
+
+void MitsubishiHeatPumpGroup::receive_command(
+        const espmhp::GroupCommand& command, IPAddress address,
+        uint16_t port) {
+    if (command.group_id != this->group_id_ ||
+            command.origin == this->origin_) {
+        return;
+    }
+    if (command.receiver_session != this->session_ &&
+            !this->replay_guard_.knows(command.origin_session)) {
+        // Nothing accepted in the sender's session since we booted, so this
+        // could be a replay from an earlier one. Have it sent again bound
+        // to our session.
+        espmhp::GroupChallenge challenge{};
+        challenge.group_id = command.group_id;
+        challenge.origin = command.origin;
+        challenge.origin_session = command.origin_session;
+        challenge.sequence = command.sequence;
+        challenge.receiver_session = this->session_;
+
+        uint8_t buffer[espmhp::PEER_GROUP_CHALLENGE_SIZE];
+        size_t length = espmhp::encode_group_challenge(
+            challenge, (const uint8_t*) this->peer_key_.data(),
+            this->peer_key_.size(), buffer, sizeof(buffer));
+        this->send(buffer, length, address, port);
+        return;
+    }
+    if (!this->replay_guard_.accept(command.origin_session,
+                                    command.sequence)) {
+        ESPMHP_LOGD(TAG, "Group %s: dropping replayed command %u",
+                 this->get_name().c_str(), (unsigned) command.sequence);
+        return;
+    }
+
+    ESPMHP_LOGD(TAG, "Group %s: command %u from a peer node",
+             this->get_name().c_str(), (unsigned) command.sequence);
+    this->update_state(command);
+    this->reply_command_ = command;
+    this->reply_address_ = address;
+    this->reply_port_ = port;
+    this->apply(command);
+}
+
+void MitsubishiHeatPumpGroup::receive_challenge(
+        const espmhp::GroupChallenge& challenge, IPAddress address,
+        uint16_t port) {
+    if (challenge.group_id != this->group_id_ ||
+            challenge.origin != this->origin_ ||
+            challenge.origin_session != this->session_ ||
+            challenge.sequence != this->sequence_) {
+        // Not ours, or for a call that was superseded.
+        return;
+    }
+    espmhp::GroupCommand command = this->last_command_;
+    command.receiver_session = challenge.receiver_session;
+    this->send_command(command, address, port);
+}
+
+void MitsubishiHeatPumpGroup::send_command(const espmhp::GroupCommand& command,
+                                           IPAddress address, uint16_t port) {
+    uint8_t buffer[espmhp::PEER_GROUP_COMMAND_SIZE];
+    size_t length = espmhp::encode_group_command(
+        command, (const uint8_t*) this->peer_key_.data(),
+        this->peer_key_.size(), buffer, sizeof(buffer));
+    if (!this->send(buffer, length, address, port)) {
+        ESP_LOGW(TAG, "Group %s: unable to forward command, network not ready.",
+                 this->get_name().c_str());
+    }
+}
+
+void MitsubishiHeatPumpGroup::send_result(size_t index) {
+    espmhp::GroupResult result{};
+    result.group_id = this->reply_command_.group_id;
+    result.origin_session = this->reply_command_.origin_session;
+    result.sequence = this->reply_command_.sequence;
+    result.unit_id = this->members_[index]->get_unit_id();
+    result.result = this->results_[index];
+
+    uint8_t buffer[espmhp::PEER_GROUP_RESULT_SIZE];
+    size_t length = espmhp::encode_group_result(
+        result, (const uint8_t*) this->peer_key_.data(),
+        this->peer_key_.size(), buffer, sizeof(buffer));
+    if (!this->send(buffer, length, this->reply_address_, this->reply_port_)) {
+        ESPMHP_LOGV(TAG, "Group %s: unable to send a result, network not ready.",
+                 this->get_name().c_str());
+    }
+}
+
+bool MitsubishiHeatPumpGroup::send(const uint8_t* buffer, size_t length,
+                                   IPAddress address, uint16_t port) {
+    if (!this->peer_udp_.beginPacket(address, port)) {
+        return false;
+    }
+    this->peer_udp_.write(buffer, length);
+    this->peer_udp_.endPacket();
+    return true;
+}
+#endif
+
+void MitsubishiHeatPumpGroup::dump_config() {
+    LOG_CLIMATE("", "MitsubishiHeatPump Group", this);
+    for (size_t i = 0; i < this->member_count_; i++) {
+        ESP_LOGCONFIG(TAG, "  Member: %s", this->members_[i]->get_name().c_str());
+    }
+#ifdef USE_ESPMHP_GROUP_PEERS
+    ESP_LOGCONFIG(TAG, "  Peer port: %u", this->peer_port_);
+#endif
+}
@@ -0,0 +1,129 @@
+/**
+ * espmhp_group.h
+ *
+ * Climate entity controlling a group of MitsubishiHeatPumps with one call
+ *
+ * License: BSD
+ *
+ * A group takes a climate call and performs it on every member, reporting
+ * what became of it for each one. Optionally, the call is also forwarded to
+ * the groups with the same name and key on other ESPHome nodes, see
+ * espmhp_coordination.h for the messages.
+ */
+
+#include "espmhp.h"
+
+#ifdef USE_ESPMHP_GROUP_PEERS
+#include <WiFiUdp.h>
+#endif
+
+#ifndef ESPMHP_GROUP_H
+#define ESPMHP_GROUP_H
+
+static const size_t ESPMHP_MAX_GROUP_MEMBERS = 16;
+
+class MitsubishiHeatPumpGroup : public esphome::Component, public esphome::climate::Climate {
+
+    public:
+
+        // Add a unit on this node to the group. Must be called before
+        // setup().
+        void add_member(MitsubishiHeatPump* member);
+
+#ifdef USE_ESPMHP_GROUP_PEERS
+        // Forward calls to the groups with the same name on other nodes,
+        // over UDP broadcasts to this port, authenticated with key.
+        void set_peers(uint16_t port, const std::string& key);
+#endif
+
+        void setup() override;
+        void loop() override;
+        void dump_config() override;
+
+        // The traits of the first member.
+        esphome::climate::ClimateTraits traits() override;
+
+        // Perform the call on every member.
+        void control(const esphome::climate::ClimateCall &call) override;
+
+        // Called with the unit id (MitsubishiHeatPump::get_unit_id()) of
+        // each member, on this node or a peer node, and what became of the
+        // last call for it: once when the call is queued, deferred or
+        // rejected, and again once a queued or deferred call is sent.
+        void add_on_member_result_callback(
+            std::function<void(uint32_t, espmhp::UpdateResult)> &&callback);
+
+    protected:
+        // Publish the state requested by a command.
+        void update_state(const espmhp::GroupCommand& command);
+
+        // Queue a command on the members on this node, recording the
+        // results in results_ and reporting them.
+        void apply(const espmhp::GroupCommand& command);
+
+        // A member sent the commands it had queued.
+        void member_updated(size_t index, espmhp::UpdateResult result);
+
+        // Report results_[index] to the callbacks, or to the peer whose
+        // command it is for.
+        void report(size_t index);
+
+#ifdef USE_ESPMHP_GROUP_PEERS
+        // Broadcast a command to the peers.
+        void forward(const espmhp::GroupCommand& command);
+        void receive_command(const espmhp::GroupCommand& command,
+                             IPAddress address, uint16_t port);
+        void receive_challenge(const espmhp::GroupChallenge& challenge,
+                               IPAddress address, uint16_t port);
+        void send_command(const espmhp::GroupCommand& command,
+                          IPAddress address, uint16_t port);
+        void send_result(size_t index);
+        bool send(const uint8_t* buffer, size_t length, IPAddress address,
+                  uint16_t port);
+
+        WiFiUDP peer_udp_;
+        uint16_t peer_port_ = 0;
+        std::string peer_key_;
+        // Picked at every boot, never 0.
+        uint32_t session_ = 0;
+        // Last sequence number accepted in each peer's session.
+        espmhp::ReplayGuard replay_guard_;
+        // The last command sent, to send again when challenged.
+        espmhp::GroupCommand last_command_{};
+        // The command being performed for a peer and where to report
+        // results, or a port of 0 for our own call.
+        espmhp::GroupCommand reply_command_{};
+        IPAddress reply_address_;
+        uint16_t reply_port_ = 0;
+#endif
+
+        MitsubishiHeatPump* members_[ESPMHP_MAX_GROUP_MEMBERS] = {};
+        espmhp::UpdateResult results_[ESPMHP_MAX_GROUP_MEMBERS] = {};
+        // Whether a member has yet to send the last call.
+        bool waiting_[ESPMHP_MAX_GROUP_MEMBERS] = {};
+        size_t member_count_ = 0;
+
+        // Shared by the groups with the same name on every node.
+        uint32_t group_id_ = 0;
+        // Identifies this node, to ignore our own broadcasts.
+        uint32_t origin_ = 0;
+        uint32_t sequence_ = 0;
+
+        esphome::CallbackManager<void(uint32_t, espmhp::UpdateResult)>
+            member_result_callback_;
+};
+
+// Fires with the unit id of a member and what became of the last call for
+// it, as "sent", "failed", "deferred", ...
+class MemberResultTrigger : public esphome::Trigger<uint32_t, std::string> {
+    public:
+        explicit MemberResultTrigger(MitsubishiHeatPumpGroup* group) {
+            group->add_on_member_result_callback(
+                [this](uint32_t unit_id, espmhp::UpdateResult result) {
+                    this->trigger(unit_id,
+                                  espmhp::update_result_to_string(result));
+                });
+        }
+};
+
+#endif
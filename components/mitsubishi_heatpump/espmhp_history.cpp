@@ -0,0 +1,242 @@
+/**
+ * espmhp_history.cpp
+ *
+ * Downsampled history of room temperature, setpoint and duty cycle
+ *
+ * License: BSD
+ */
+
+#include <cmath>
+
+#include "espmhp_history.h"
+
+namespace espmhp {
+
+static const uint32_t DEFAULT_FINE_PERIOD = 60 * 1000;
+static const uint32_t DEFAULT_COARSE_PERIOD = 15 * 60 * 1000;
+
+HistoryTier::HistoryTier(HistoryBucket* buckets, size_t capacity,
+                         uint32_t period) :
+    buckets_{buckets},
+    capacity_{capacity},
+    period_{period},
+    target_temperature_{ESPMHP_SNAPSHOT_NO_TEMPERATURE}
+{
+}
+
+void HistoryTier::set_storage(HistoryBucket* buckets, size_t capacity) {
+    this->buckets_ = buckets;
+    this->capacity_ = capacity;
+    this->head_ = 0;
+    this->size_ = 0;
+}
+
+void HistoryTier::set_period(uint32_t period) {
+    this->period_ = period > 0 ? period : 1;
+}
+
+uint32_t HistoryTier::period() const {
+    return this->period_;
+}
+
+size_t HistoryTier::size() const {
+    return this->size_;
+}
+
+const HistoryBucket& HistoryTier::at(size_t index) const {
+    size_t oldest = (this->head_ + this->capacity_ - this->size_) % this->capacity_;
+    return this->buckets_[(oldest + index) % this->capacity_];
+}
+
+uint32_t HistoryTier::newest_age(uint32_t now) const {
+    if (this->size_ == 0) {
+        return ESPMHP_SNAPSHOT_NO_AGE;
+    }
+    // The newest bucket was closed when the open one started.
+    return now - this->bucket_start_;
+}
+
+void HistoryTier::integrate(uint32_t now, const HistorySample& sample) {
+    if (this->capacity_ == 0) {
+        return;
+    }
+    if (!this->started_) {
+        this->started_ = true;
+        this->bucket_start_ = now;
+        this->last_ = now;
+        return;
+    }
+
+    size_t closed = 0;
+    while (now - this->bucket_start_ >= this->period_) {
+        uint32_t end = this->bucket_start_ + this->period_;
+        this->accumulate(end - this->last_, sample);
+        this->close();
+        this->bucket_start_ = end;
+        this->last_ = end;
+
+        if (++closed >= this->capacity_) {
+            // The whole ring was filled with this sample; don't spin over
+            // the rest of the gap.
+            this->bucket_start_ = now;
+            this->last_ = now;
+            break;
+        }
+    }
+    this->accumulate(now - this->last_, sample);
+    this->last_ = now;
+}
+
+void HistoryTier::accumulate(uint32_t duration, const HistorySample& sample) {
+    this->target_temperature_ = encode_tenths(sample.target_temperature);
+    if (duration == 0) {
+        return;
+    }
+
+    this->elapsed_ += duration;
+    if (sample.operating) {
+        this->operating_time_ += duration;
+    }
+    if (sample.remote_temperature) {
+        this->remote_time_ += duration;
+    }
+
+    if (std::isnan(sample.room_temperature)) {
+        return;
+    }
+    int16_t temperature = encode_tenths(sample.room_temperature);
+    if (this->temperature_time_ == 0) {
+        this->min_temperature_ = temperature;
+        this->max_temperature_ = temperature;
+    } else if (temperature < this->min_temperature_) {
+        this->min_temperature_ = temperature;
+    } else if (temperature > this->max_temperature_) {
+        this->max_temperature_ = temperature;
+    }
+    this->temperature_time_ += duration;
+    this->temperature_sum_ += (int64_t) temperature * duration;
+}
+
+void HistoryTier::close() {
+    HistoryBucket& bucket = this->buckets_[this->head_];
+
+    if (this->temperature_time_ > 0) {
+        bucket.min_temperature = this->min_temperature_;
+        bucket.max_temperature = this->max_temperature_;
+        bucket.mean_temperature = (int16_t) (this->temperature_sum_ /
+                                             (int64_t) this->temperature_time_);
+    } else {
+        bucket.min_temperature = ESPMHP_SNAPSHOT_NO_TEMPERATURE;
+        bucket.max_temperature = ESPMHP_SNAPSHOT_NO_TEMPERATURE;
+        bucket.mean_temperature = ESPMHP_SNAPSHOT_NO_TEMPERATURE;
+    }
+    bucket.target_temperature = this->target_temperature_;
+    if (this->elapsed_ > 0) {
+        bucket.duty_cycle = (uint64_t) this->operating_time_ * 100 / this->elapsed_;
+        bucket.remote_share = (uint64_t) this->remote_time_ * 100 / this->elapsed_;
+    } else {
+        bucket.duty_cycle = 0;
+        bucket.remote_share = 0;
+    }
+
+    this->head_ = (this->head_ + 1) % this->capacity_;
+    if (this->size_ < this->capacity_) {
+        this->size_++;
+    }
+
+    this->elapsed_ = 0;
+    this->temperature_time_ = 0;
+    this->temperature_sum_ = 0;
+    this->operating_time_ = 0;
+    this->remote_time_ = 0;
+}
+
+History::History(HistoryBucket* fine, size_t fine_capacity,
+                 HistoryBucket* coarse, size_t coarse_capacity) :
+    fine_{fine, fine_capacity, DEFAULT_FINE_PERIOD},
+    coarse_{coarse, coarse_capacity, DEFAULT_COARSE_PERIOD}
+{
+}
+
+void History::set_storage(HistoryBucket* fine, size_t fine_capacity,
+                          HistoryBucket* coarse, size_t coarse_capacity) {
+    this->fine_.set_storage(fine, fine_capacity);
+    this->coarse_.set_storage(coarse, coarse_capacity);
+}
+
+void History::set_periods(uint32_t fine, uint32_t coarse) {
+    this->fine_.set_period(fine);
+    this->coarse_.set_period(coarse);
+}
+
+void History::record(uint32_t now, const HistorySample& sample) {
+    // The previous sample was in effect up to now.
+    this->fine_.integrate(now, this->sample_);
+    this->coarse_.integrate(now, this->sample_);
+    this->sample_ = sample;
+    this->has_sample_ = true;
+}
+
+void History::advance(uint32_t now) {
+    if (!this->has_sample_) {
+        return;
+    }
+    this->fine_.integrate(now, this->sample_);
+    this->coarse_.integrate(now, this->sample_);
+}
+
+const HistoryTier& History::tier(HistoryTierId id) const {
+    return id == HISTORY_COARSE ? this->coarse_ : this->fine_;
+}
+
+static void put_u16(uint8_t* buffer, size_t offset, uint16_t value) {
+    buffer[offset] = value & 0xFF;
+    buffer[offset + 1] = value >> 8;
+}
+
+static void put_u32(uint8_t* buffer, size_t offset, uint32_t value) {
+    for (size_t i = 0; i < 4; i++) {
+        buffer[offset + i] = (value >> (8 * i)) & 0xFF;
+    }
+}
+
+size_t History::export_tier(HistoryTierId id, uint32_t now, size_t first,
+                            uint8_t* buffer, size_t length) const {
+    if (length < HISTORY_HEADER_SIZE) {
+        return 0;
+    }
+    const HistoryTier& tier = this->tier(id);
+
+    size_t total = tier.size();
+    if (first > total) {
+        first = total;
+    }
+    size_t count = (length - HISTORY_HEADER_SIZE) / HISTORY_BUCKET_SIZE;
+    if (count > total - first) {
+        count = total - first;
+    }
+
+    buffer[0] = HISTORY_MAGIC;
+    buffer[1] = HISTORY_VERSION;
+    buffer[2] = id;
+    buffer[3] = HISTORY_BUCKET_SIZE;
+    put_u32(buffer, 4, tier.period());
+    put_u16(buffer, 8, total);
+    put_u16(buffer, 10, first);
+    put_u16(buffer, 12, count);
+    put_u32(buffer, 14, tier.newest_age(now));
+
+    uint8_t* out = buffer + HISTORY_HEADER_SIZE;
+    for (size_t i = 0; i < count; i++, out += HISTORY_BUCKET_SIZE) {
+        const HistoryBucket& bucket = tier.at(first + i);
+        put_u16(out, 0, (uint16_t) bucket.min_temperature);
+        put_u16(out, 2, (uint16_t) bucket.max_temperature);
+        put_u16(out, 4, (uint16_t) bucket.mean_temperature);
+        put_u16(out, 6, (uint16_t) bucket.target_temperature);
+        out[8] = bucket.duty_cycle;
+        out[9] = bucket.remote_share;
+    }
+    return HISTORY_HEADER_SIZE + count * HISTORY_BUCKET_SIZE;
+}
+
+} // namespace espmhp
@@ -0,0 +1,173 @@
+/**
+ * espmhp_history.h
+ *
+ * Downsampled history of room temperature, setpoint and duty cycle
+ *
+ * License: BSD
+ *
+ * The history is kept in two rings of fixed size, a fine one (e.g. 10 minute
+ * buckets for 24 hours) and a coarse one (e.g. 1 hour buckets for 7 days),
+ * in storage provided by the owner, so that each unit can size its own.
+ * Without storage, nothing is recorded. Both are fed the same samples and
+ * integrate them over time, so buckets are time weighted however often
+ * samples come in.
+ *
+ * A tier is exported as a blob, optionally in chunks, little-endian:
+ *
+ *   offset size field
+ *        0    1 magic, HISTORY_MAGIC
+ *        1    1 version, HISTORY_VERSION
+ *        2    1 tier, HISTORY_FINE or HISTORY_COARSE
+ *        3    1 size of a bucket in bytes, HISTORY_BUCKET_SIZE
+ *        4    4 bucket period, in milliseconds
+ *        8    2 number of buckets held by the tier
+ *       10    2 index of the first bucket in this chunk, 0 is the oldest
+ *       12    2 number of buckets in this chunk
+ *       14    4 time since the newest bucket was closed, in milliseconds
+ *       18      buckets, oldest first
+ *
+ * Each bucket:
+ *
+ *   offset size field
+ *        0    2 minimum room temperature, signed tenths of a degree C
+ *        2    2 maximum room temperature, signed tenths of a degree C
+ *        4    2 mean room temperature, signed tenths of a degree C
+ *        6    2 setpoint at the end of the bucket, signed tenths of a degree C
+ *        8    1 compressor duty cycle, percent of the bucket
+ *        9    1 remote sensor share, percent of the bucket
+ *
+ * Temperatures which are unknown are sent as ESPMHP_SNAPSHOT_NO_TEMPERATURE.
+ */
+
+#ifndef ESPMHP_HISTORY_H
+#define ESPMHP_HISTORY_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "espmhp_core.h"
+
+namespace espmhp {
+
+static const uint8_t HISTORY_MAGIC = 0x48; // 'H'
+static const uint8_t HISTORY_VERSION = 1;
+static const size_t HISTORY_HEADER_SIZE = 18;
+static const size_t HISTORY_BUCKET_SIZE = 10;
+
+enum HistoryTierId : uint8_t {
+    HISTORY_FINE = 0,
+    HISTORY_COARSE = 1,
+};
+
+// The state of the unit, held until the next sample.
+struct HistorySample {
+    float room_temperature; // NaN if unknown
+    float target_temperature;
+    bool operating;
+    bool remote_temperature;
+};
+
+struct HistoryBucket {
+    int16_t min_temperature;
+    int16_t max_temperature;
+    int16_t mean_temperature;
+    int16_t target_temperature;
+    uint8_t duty_cycle;
+    uint8_t remote_share;
+};
+
+/**
+ * One ring of buckets, and the bucket being accumulated.
+ */
+class HistoryTier {
+    public:
+        HistoryTier(HistoryBucket* buckets, size_t capacity, uint32_t period);
+
+        // Move to new storage, dropping the buckets held so far.
+        void set_storage(HistoryBucket* buckets, size_t capacity);
+        void set_period(uint32_t period);
+        uint32_t period() const;
+
+        // Number of closed buckets held.
+        size_t size() const;
+
+        // Closed bucket by age, 0 is the oldest.
+        const HistoryBucket& at(size_t index) const;
+
+        // Account for sample being in effect from the last call up to now,
+        // closing buckets as their period ends.
+        void integrate(uint32_t now, const HistorySample& sample);
+
+        // Time since the newest bucket was closed.
+        uint32_t newest_age(uint32_t now) const;
+
+    private:
+        void accumulate(uint32_t duration, const HistorySample& sample);
+        void close();
+
+        HistoryBucket* buckets_;
+        size_t capacity_;
+        uint32_t period_;
+        size_t head_ = 0; // where the next closed bucket goes
+        size_t size_ = 0;
+
+        bool started_ = false;
+        uint32_t bucket_start_ = 0;
+        uint32_t last_ = 0;
+
+        // Accumulators for the open bucket, in ms and tenths * ms.
+        uint32_t elapsed_ = 0;
+        uint32_t temperature_time_ = 0;
+        int64_t temperature_sum_ = 0;
+        int16_t min_temperature_ = 0;
+        int16_t max_temperature_ = 0;
+        int16_t target_temperature_ = 0;
+        uint32_t operating_time_ = 0;
+        uint32_t remote_time_ = 0;
+};
+
+/**
+ * Fine and coarse history for one unit.
+ */
+class History {
+    public:
+        History(HistoryBucket* fine, size_t fine_capacity,
+                HistoryBucket* coarse, size_t coarse_capacity);
+
+        void set_storage(HistoryBucket* fine, size_t fine_capacity,
+                         HistoryBucket* coarse, size_t coarse_capacity);
+        void set_periods(uint32_t fine, uint32_t coarse);
+
+        // Record a change of state.
+        void record(uint32_t now, const HistorySample& sample);
+
+        // Account for the current state up to now, e.g. from a periodic
+        // update, so that buckets close on time without new samples.
+        void advance(uint32_t now);
+
+        const HistoryTier& tier(HistoryTierId id) const;
+
+        /**
+         * Export a tier, see the layout above.
+         *
+         * Args:
+         *   first: index of the first bucket to export, 0 is the oldest
+         *
+         * Returns:
+         *   The number of bytes written, or 0 if the buffer can't even hold
+         *   the header. As many buckets as fit are written; the header tells
+         *   how many.
+         */
+        size_t export_tier(HistoryTierId id, uint32_t now, size_t first,
+                           uint8_t* buffer, size_t length) const;
+
+    private:
+        HistoryTier fine_;
+        HistoryTier coarse_;
+        bool has_sample_ = false;
+        HistorySample sample_{};
+};
+
+} // namespace espmhp
+
+#endif
@@ -0,0 +1,174 @@
+/**
+ * espmhp_polling.cpp
+ *
+ * Scheduling of info requests to the unit
+ *
+ * License: BSD
+ */
+
+#include "espmhp_polling.h"
+
+namespace espmhp {
+
+// The HeatPump library reconnects when nothing was received for 10 seconds,
+// so something is requested at least this often, even if nothing is due.
+static const uint32_t KEEPALIVE_INTERVAL = 5000;
+
+static const uint8_t PACKET_START = 0xFC;
+static const uint8_t PACKET_INFO_REQUEST = 0x42;
+static const uint8_t PACKET_INFO_REPLY = 0x62;
+
+bool page_from_info_code(uint8_t code, InfoPage* page) {
+    switch (code) {
+        case 0x02:
+            *page = PAGE_SETTINGS;
+            return true;
+        case 0x03:
+            *page = PAGE_ROOM_TEMP;
+            return true;
+        case 0x05:
+            *page = PAGE_TIMERS;
+            return true;
+        case 0x06:
+            *page = PAGE_STATUS;
+            return true;
+        case 0x09:
+            *page = PAGE_STANDBY;
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool parse_info_packet(const uint8_t* packet, size_t length, bool* request,
+                       InfoPage* page) {
+    if (length < 6 || packet[0] != PACKET_START) {
+        return false;
+    }
+    if (packet[1] == PACKET_INFO_REQUEST) {
+        *request = true;
+    } else if (packet[1] == PACKET_INFO_REPLY) {
+        *request = false;
+    } else {
+        return false;
+    }
+    return page_from_info_code(packet[5], page);
+}
+
+PollScheduler::PollScheduler() :
+    pages_{
+        // page, min and max interval in ms
+        {PAGE_SETTINGS, 2000, 30000, 2000, 0, false, false},
+        {PAGE_STATUS, 2000, 20000, 2000, 0, false, false},
+        {PAGE_ROOM_TEMP, 4000, 30000, 4000, 0, false, false},
+        {PAGE_STANDBY, 30000, 300000, 30000, 0, false, false},
+        {PAGE_TIMERS, 30000, 300000, 30000, 0, false, false},
+    }
+{
+}
+
+PollScheduler::Page* PollScheduler::find(InfoPage page) {
+    for (Page& candidate : this->pages_) {
+        if (candidate.page == page) {
+            return &candidate;
+        }
+    }
+    return nullptr;
+}
+
+float PollScheduler::overdue(const Page& page, uint32_t now) {
+    if (page.expedited || !page.requested) {
+        // Ahead of everything else; ties go to the order of pages_.
+        return 1e9;
+    }
+    return (float) (now - page.last_requested) / page.interval;
+}
+
+InfoPage PollScheduler::next(uint32_t now) const {
+    const Page* best = &this->pages_[0];
+    float best_overdue = overdue(*best, now);
+    for (const Page& page : this->pages_) {
+        float page_overdue = overdue(page, now);
+        if (page_overdue > best_overdue) {
+            best = &page;
+            best_overdue = page_overdue;
+        }
+    }
+    return best->page;
+}
+
+bool PollScheduler::should_poll(uint32_t now) const {
+    if (this->awaiting_reply_ && now - this->awaiting_since_ < POLL_REPLY_TIMEOUT) {
+        return true;
+    }
+    if (this->has_requested_ &&
+            now - this->last_request_ >= KEEPALIVE_INTERVAL) {
+        return true;
+    }
+    for (const Page& page : this->pages_) {
+        if (overdue(page, now) >= 1.0f) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void PollScheduler::requested(InfoPage page, uint32_t now) {
+    Page* entry = this->find(page);
+    if (entry == nullptr) {
+        return;
+    }
+    if (entry->requested && !entry->expedited) {
+        uint32_t elapsed = now - entry->last_requested;
+        if (elapsed > entry->interval &&
+                elapsed - entry->interval > this->max_lateness_) {
+            this->max_lateness_ = elapsed - entry->interval;
+        }
+    }
+    entry->requested = true;
+    entry->expedited = false;
+    entry->last_requested = now;
+    this->awaiting_reply_ = true;
+    this->awaiting_since_ = now;
+    this->has_requested_ = true;
+    this->last_request_ = now;
+}
+
+void PollScheduler::answered(InfoPage page) {
+    this->awaiting_reply_ = false;
+    this->has_last_answer_ = true;
+    this->last_answer_ = page;
+
+    // Assume nothing changed; last_answer_changed() follows if something
+    // did.
+    Page* entry = this->find(page);
+    if (entry != nullptr) {
+        uint32_t interval = entry->interval + entry->interval / 2;
+        entry->interval = interval < entry->max_interval ?
+            interval : entry->max_interval;
+    }
+}
+
+void PollScheduler::last_answer_changed() {
+    if (!this->has_last_answer_) {
+        return;
+    }
+    Page* entry = this->find(this->last_answer_);
+    if (entry != nullptr) {
+        entry->interval = entry->min_interval;
+    }
+}
+
+void PollScheduler::expedite(InfoPage page) {
+    Page* entry = this->find(page);
+    if (entry != nullptr) {
+        entry->expedited = true;
+        entry->interval = entry->min_interval;
+    }
+}
+
+uint32_t PollScheduler::max_lateness() const {
+    return this->max_lateness_;
+}
+
+} // namespace espmhp
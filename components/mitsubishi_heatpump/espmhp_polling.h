@@ -0,0 +1,110 @@
+/**
+ * espmhp_polling.h
+ *
+ * Scheduling of info requests to the unit
+ *
+ * License: BSD
+ *
+ * Left to itself, HeatPump::sync() requests every info page in turn, one
+ * every two seconds at best, so a page that changed may wait for five others.
+ * The PollScheduler picks the page to request instead. Each page's interval
+ * adapts: it snaps back to its minimum when a reply carried a change, and
+ * grows towards its maximum while replies carry none. The page furthest past
+ * its interval is requested first, so pages which change often, or which a
+ * command just changed, go ahead of the rest, and pages which rarely change
+ * are rarely polled.
+ */
+
+#ifndef ESPMHP_POLLING_H
+#define ESPMHP_POLLING_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace espmhp {
+
+// Info pages, with the values of the HeatPump library's RQST_PKT_*
+// constants, which is checked with static_asserts in espmhp.cpp.
+enum InfoPage : uint8_t {
+    PAGE_SETTINGS = 0,
+    PAGE_ROOM_TEMP = 1,
+    PAGE_TIMERS = 3,
+    PAGE_STATUS = 4,
+    PAGE_STANDBY = 5,
+};
+
+// The page an info code on the wire refers to. Returns false for codes
+// which aren't scheduled.
+bool page_from_info_code(uint8_t code, InfoPage* page);
+
+/*
+ * Classify a CN105 packet as seen by the HeatPump library's packet
+ * callback. Returns false if it isn't an info request or reply.
+ */
+bool parse_info_packet(const uint8_t* packet, size_t length, bool* request,
+                       InfoPage* page);
+
+// The HeatPump library only reads from the unit this long after it last
+// sent something (PACKET_SENT_INTERVAL_MS, checked in espmhp.cpp), however
+// soon the reply arrives.
+static const uint32_t POLL_READ_DELAY = 1000;
+
+// How long should_poll() keeps asking for sync() calls after a request, so
+// that the reply is read.
+static const uint32_t POLL_REPLY_TIMEOUT = POLL_READ_DELAY + 1000;
+
+class PollScheduler {
+    public:
+        PollScheduler();
+
+        // The page to request next, the one furthest past its interval.
+        InfoPage next(uint32_t now) const;
+
+        // Whether sync() should be called: a page is due, a reply is
+        // expected and must be read, or the link needs keeping alive.
+        bool should_poll(uint32_t now) const;
+
+        // A request for page went out.
+        void requested(InfoPage page, uint32_t now);
+
+        // A reply for page came in.
+        void answered(InfoPage page);
+
+        // The last reply changed the settings or the status.
+        void last_answer_changed();
+
+        // Request page as soon as possible, e.g. to confirm a command.
+        void expedite(InfoPage page);
+
+        // Longest time a page was requested after it was due, in ms.
+        uint32_t max_lateness() const;
+
+    private:
+        struct Page {
+            InfoPage page;
+            uint32_t min_interval;
+            uint32_t max_interval;
+            uint32_t interval;
+            uint32_t last_requested;
+            bool requested;  // false until the first request
+            bool expedited;
+        };
+
+        Page* find(InfoPage page);
+
+        // How far past its interval a page is, 1.0 when it is due.
+        static float overdue(const Page& page, uint32_t now);
+
+        Page pages_[5];
+        bool awaiting_reply_ = false;
+        uint32_t awaiting_since_ = 0;
+        bool has_requested_ = false;
+        uint32_t last_request_ = 0;
+        bool has_last_answer_ = false;
+        InfoPage last_answer_ = PAGE_SETTINGS;
+        uint32_t max_lateness_ = 0;
+};
+
+} // namespace espmhp
+
+#endif
@@ -0,0 +1,91 @@
+/**
+ * espmhp_snapshot.h
+ *
+ * Binary state snapshot format for esphome-mitsubishiheatpump
+ *
+ * License: BSD
+ *
+ * A snapshot is a single packed little-endian message describing the full
+ * state of one MitsubishiHeatPump, meant for fleet collectors that would
+ * otherwise have to scrape every climate and select entity. Readers must
+ * check the version and use the length field to skip fields appended by
+ * later versions.
+ *
+ * Layout (version 1):
+ *
+ *   offset size field
+ *        0    1 magic, always ESPMHP_SNAPSHOT_MAGIC
+ *        1    1 version, ESPMHP_SNAPSHOT_VERSION
+ *        2    2 length of the whole snapshot in bytes
+ *        4    4 unit id, see MitsubishiHeatPump::get_unit_id(), the id
+ *               commands and group results address the unit by
+ *        8    4 uptime, in milliseconds
+ *       12    1 climate mode (esphome::climate::ClimateMode)
+ *       13    1 climate action (esphome::climate::ClimateAction)
+ *       14    1 fan mode (esphome::climate::ClimateFanMode), 0xFF if unset
+ *       15    1 swing mode (esphome::climate::ClimateSwingMode)
+ *       16    1 vertical vane option index, 0xFF if unknown
+ *       17    1 horizontal vane option index, 0xFF if unknown
+ *       18    1 flags, see ESPMHP_SNAPSHOT_FLAG_*
+ *       19    1 reserved, 0
+ *       20    2 target temperature, signed tenths of a degree C
+ *       22    2 current temperature, signed tenths of a degree C
+ *       24    2 remote temperature, signed tenths of a degree C
+ *       26    2 remote temperature operating timeout, minutes, 0 if unset
+ *       28    2 remote temperature idle timeout, minutes, 0 if unset
+ *       30    2 remote temperature ping timeout, minutes, 0 if unset
+ *       32    4 age of the remote temperature, seconds
+ *       36    4 time since the last ping, seconds
+ *       40    4 settings changes received from the unit
+ *       44    4 status changes received from the unit
+ *       48    4 updates sent to the unit
+ *       52    4 updates sent to the unit which were not acknowledged
+ *       56    4 ping timeouts
+ *       60    4 remote temperature timeouts
+ *       64    2 commands waiting to be sent to the unit
+ *       66    2 most commands waiting at once
+ *       68    4 time the last command waited to be sent, in milliseconds
+ *       72    4 longest time a command waited to be sent, in milliseconds
+ *       76    4 longest time an info request went out late, in milliseconds
+ *
+ * Temperatures which are unknown are sent as ESPMHP_SNAPSHOT_NO_TEMPERATURE,
+ * and ages which are unknown as ESPMHP_SNAPSHOT_NO_AGE.
+ */
+
+#ifndef ESPMHP_SNAPSHOT_H
+#define ESPMHP_SNAPSHOT_H
+
+#include <cstdint>
+
+static const uint8_t ESPMHP_SNAPSHOT_MAGIC = 0x4D; // 'M'
+static const uint8_t ESPMHP_SNAPSHOT_VERSION = 1;
+static const uint16_t ESPMHP_SNAPSHOT_SIZE = 80;
+
+static const int16_t ESPMHP_SNAPSHOT_NO_TEMPERATURE = INT16_MIN;
+static const uint32_t ESPMHP_SNAPSHOT_NO_AGE = UINT32_MAX;
+
+static const uint8_t ESPMHP_SNAPSHOT_FLAG_OPERATING = 1 << 0;
+static const uint8_t ESPMHP_SNAPSHOT_FLAG_CONNECTED = 1 << 1;
+static const uint8_t ESPMHP_SNAPSHOT_FLAG_REMOTE_TEMPERATURE = 1 << 2;
+static const uint8_t ESPMHP_SNAPSHOT_FLAG_FAILSAFE = 1 << 3;
+// State was restored at boot and hasn't been confirmed by the unit yet.
+static const uint8_t ESPMHP_SNAPSHOT_FLAG_PROVISIONAL = 1 << 4;
+
+// Counters kept by MitsubishiHeatPump and reported in snapshots.
+struct EspmhpCounters {
+    uint32_t settings_changes = 0;
+    uint32_t status_changes = 0;
+    uint32_t updates_sent = 0;
+    uint32_t updates_failed = 0;
+    uint32_t ping_timeouts = 0;
+    uint32_t remote_temperature_timeouts = 0;
+
+    // Transmit queue, see MitsubishiHeatPump::request_update().
+    uint16_t queue_depth = 0;
+    uint16_t queue_depth_max = 0;
+    uint32_t command_wait_last = 0;
+    uint32_t command_wait_max = 0;
+    uint32_t poll_lateness_max = 0;
+};
+
+#endif
@@ -0,0 +1,274 @@
+/**
+ * espmhp_thermal.cpp
+ *
+ * Learned heating and cooling rates, for predictive preheat and precool
+ *
+ * License: BSD
+ */
+
+#include <cmath>
+
+#include "espmhp_thermal.h"
+
+namespace espmhp {
+
+static const float DEFAULT_RATE = 2.0;          // degrees C per hour
+static const float FORGETTING_FACTOR = 0.98;
+static const float INITIAL_COVARIANCE = 100.0;
+static const float RESTORED_COVARIANCE = 1.0;
+static const float MAX_COVARIANCE = 1000.0;
+// Rates faster than this are sensor glitches, not the room warming up.
+static const float MAX_RATE = 20.0;
+
+static const uint32_t MIN_WINDOW = 5 * 60 * 1000;
+static const uint32_t MAX_WINDOW = 30 * 60 * 1000;
+// Most units report the room temperature in 0.5 or 1 degree steps; wait for
+// at least one step, unless the window runs out.
+static const float MIN_WINDOW_DELTA = 0.5;
+
+static const float LEAD_TIME_STEP = 0.25; // degrees C
+static const float MS_PER_HOUR = 3600.0 * 1000.0;
+
+void RateModel::reset(float rate) {
+    this->theta_[0] = rate;
+    this->theta_[1] = 0;
+    this->p_[0][0] = INITIAL_COVARIANCE;
+    this->p_[0][1] = 0;
+    this->p_[1][0] = 0;
+    this->p_[1][1] = INITIAL_COVARIANCE;
+    this->samples_ = 0;
+}
+
+void RateModel::restore(float theta0, float theta1, uint16_t samples) {
+    this->reset(theta0);
+    this->theta_[1] = theta1;
+    this->samples_ = samples;
+    if (samples > 0) {
+        this->p_[0][0] = RESTORED_COVARIANCE;
+        this->p_[1][1] = RESTORED_COVARIANCE;
+    }
+}
+
+void RateModel::update(float gap, float rate) {
+    const float x[2] = {1, gap};
+
+    float px[2] = {
+        this->p_[0][0] * x[0] + this->p_[0][1] * x[1],
+        this->p_[1][0] * x[0] + this->p_[1][1] * x[1],
+    };
+    float denominator = FORGETTING_FACTOR + x[0] * px[0] + x[1] * px[1];
+    float gain[2] = {px[0] / denominator, px[1] / denominator};
+    float error = rate - (this->theta_[0] * x[0] + this->theta_[1] * x[1]);
+
+    this->theta_[0] += gain[0] * error;
+    this->theta_[1] += gain[1] * error;
+
+    // P = (P - K * x' * P) / lambda; P is symmetric, so x' * P = px'.
+    for (size_t i = 0; i < 2; i++) {
+        for (size_t j = 0; j < 2; j++) {
+            float value = (this->p_[i][j] - gain[i] * px[j]) / FORGETTING_FACTOR;
+            // Keep the covariance from winding up while the gap stays the
+            // same for a long time.
+            if (value > MAX_COVARIANCE) {
+                value = MAX_COVARIANCE;
+            } else if (value < -MAX_COVARIANCE) {
+                value = -MAX_COVARIANCE;
+            }
+            this->p_[i][j] = value;
+        }
+    }
+
+    if (this->samples_ < UINT16_MAX) {
+        this->samples_++;
+    }
+}
+
+float RateModel::rate(float gap) const {
+    float rate = this->theta_[0] + this->theta_[1] * gap;
+    return rate > THERMAL_MIN_RATE ? rate : THERMAL_MIN_RATE;
+}
+
+float RateModel::theta(size_t index) const {
+    return this->theta_[index];
+}
+
+uint16_t RateModel::samples() const {
+    return this->samples_;
+}
+
+ThermalModel::ThermalModel() {
+    this->set_default_rate(DEFAULT_RATE);
+}
+
+void ThermalModel::set_default_rate(float rate) {
+    this->default_rate_ = rate;
+    if (this->heating_.samples() == 0) {
+        this->heating_.reset(rate);
+    }
+    if (this->cooling_.samples() == 0) {
+        this->cooling_.reset(rate);
+    }
+}
+
+ThermalModel::Direction ThermalModel::direction(Mode mode,
+                                                float room_temperature,
+                                                float target_temperature) {
+    switch (mode) {
+        case MODE_HEAT:
+            return DIRECTION_HEATING;
+        case MODE_COOL:
+            return DIRECTION_COOLING;
+        case MODE_HEAT_COOL:
+            return room_temperature < target_temperature ?
+                DIRECTION_HEATING : DIRECTION_COOLING;
+        default:
+            // Dry and fan only modes don't aim for the setpoint.
+            return DIRECTION_NONE;
+    }
+}
+
+bool ThermalModel::observe(uint32_t now, Mode mode, bool operating,
+                           float room_temperature, float target_temperature) {
+    Direction direction = operating ?
+        ThermalModel::direction(mode, room_temperature, target_temperature) :
+        DIRECTION_NONE;
+    if (direction == DIRECTION_NONE || std::isnan(room_temperature) ||
+            std::isnan(target_temperature)) {
+        this->window_direction_ = DIRECTION_NONE;
+        return false;
+    }
+
+    // Distance to the setpoint and progress, both positive towards it.
+    float sign = direction == DIRECTION_HEATING ? 1 : -1;
+    float gap = sign * (target_temperature - room_temperature);
+
+    if (this->window_direction_ != direction) {
+        this->window_direction_ = direction;
+        this->window_start_ = now;
+        this->window_temperature_ = room_temperature;
+        this->window_gap_ = gap;
+        return false;
+    }
+
+    uint32_t elapsed = now - this->window_start_;
+    float delta = sign * (room_temperature - this->window_temperature_);
+    if (elapsed < MIN_WINDOW ||
+            (std::fabs(delta) < MIN_WINDOW_DELTA && elapsed < MAX_WINDOW)) {
+        return false;
+    }
+
+    float rate = delta / (elapsed / MS_PER_HOUR);
+    bool learned = false;
+    if (std::fabs(rate) <= MAX_RATE) {
+        RateModel& model = direction == DIRECTION_HEATING ?
+            this->heating_ : this->cooling_;
+        model.update(this->window_gap_, rate);
+        learned = true;
+    }
+
+    this->window_start_ = now;
+    this->window_temperature_ = room_temperature;
+    this->window_gap_ = gap;
+    return learned;
+}
+
+uint32_t ThermalModel::lead_time(Mode mode, float room_temperature,
+                                 float target_temperature) const {
+    if (std::isnan(room_temperature) || std::isnan(target_temperature)) {
+        return 0;
+    }
+    Direction direction =
+        ThermalModel::direction(mode, room_temperature, target_temperature);
+    if (direction == DIRECTION_NONE) {
+        return 0;
+    }
+    const RateModel& model = direction == DIRECTION_HEATING ?
+        this->heating_ : this->cooling_;
+    float gap = direction == DIRECTION_HEATING ?
+        target_temperature - room_temperature :
+        room_temperature - target_temperature;
+
+    // The rate depends on the gap, so integrate over it in small steps.
+    float hours = 0;
+    while (gap > 0) {
+        float step = gap < LEAD_TIME_STEP ? gap : LEAD_TIME_STEP;
+        hours += step / model.rate(gap);
+        gap -= step;
+    }
+    return hours * MS_PER_HOUR;
+}
+
+const RateModel& ThermalModel::heating() const {
+    return this->heating_;
+}
+
+const RateModel& ThermalModel::cooling() const {
+    return this->cooling_;
+}
+
+static int16_t to_hundredths(float value) {
+    float scaled = std::round(value * 100);
+    if (scaled > INT16_MAX) {
+        return INT16_MAX;
+    }
+    if (scaled < INT16_MIN) {
+        return INT16_MIN;
+    }
+    return (int16_t) scaled;
+}
+
+ThermalModelState ThermalModel::save() const {
+    ThermalModelState state;
+    state.heating[0] = to_hundredths(this->heating_.theta(0));
+    state.heating[1] = to_hundredths(this->heating_.theta(1));
+    state.cooling[0] = to_hundredths(this->cooling_.theta(0));
+    state.cooling[1] = to_hundredths(this->cooling_.theta(1));
+    state.heating_samples = this->heating_.samples();
+    state.cooling_samples = this->cooling_.samples();
+    return state;
+}
+
+void ThermalModel::restore(const ThermalModelState& state) {
+    if (state.heating_samples > 0) {
+        this->heating_.restore(state.heating[0] / 100.0f,
+                               state.heating[1] / 100.0f,
+                               state.heating_samples);
+    }
+    if (state.cooling_samples > 0) {
+        this->cooling_.restore(state.cooling[0] / 100.0f,
+                               state.cooling[1] / 100.0f,
+                               state.cooling_samples);
+    }
+}
+
+static bool moved(int16_t saved, int16_t current) {
+    int32_t delta = (int32_t) current - saved;
+    return delta >= THERMAL_SAVE_THRESHOLD || -delta >= THERMAL_SAVE_THRESHOLD;
+}
+
+void ThermalSaveSchedule::loaded(uint32_t now,
+                                 const ThermalModelState& state) {
+    this->saved_ = state;
+    this->saved_at_ = now;
+}
+
+bool ThermalSaveSchedule::due(uint32_t now, const ThermalModelState& state) {
+    uint32_t elapsed = now - this->saved_at_;
+    bool significant = false;
+    bool changed = state.heating_samples != this->saved_.heating_samples ||
+        state.cooling_samples != this->saved_.cooling_samples;
+    for (size_t i = 0; i < 2; i++) {
+        significant |= moved(this->saved_.heating[i], state.heating[i]) ||
+            moved(this->saved_.cooling[i], state.cooling[i]);
+        changed |= state.heating[i] != this->saved_.heating[i] ||
+            state.cooling[i] != this->saved_.cooling[i];
+    }
+    if (!(significant && elapsed >= THERMAL_SAVE_MIN_INTERVAL) &&
+            !(changed && elapsed >= THERMAL_SAVE_MAX_INTERVAL)) {
+        return false;
+    }
+    this->loaded(now, state);
+    return true;
+}
+
+} // namespace espmhp
@@ -0,0 +1,147 @@
+/**
+ * espmhp_thermal.h
+ *
+ * Learned heating and cooling rates, for predictive preheat and precool
+ *
+ * License: BSD
+ *
+ * While the unit is operating, the room temperature is sampled over windows
+ * of a few minutes. The rate at which it moves towards the setpoint is
+ * fitted, per direction, as a linear function of the distance to the
+ * setpoint:
+ *
+ *   rate (degrees C per hour) = theta[0] + theta[1] * gap
+ *
+ * using recursive least squares with a forgetting factor, so the model
+ * follows the seasons. The model is then integrated over the gap to predict
+ * how long the room takes to reach a setpoint.
+ *
+ * The model learns from every window, but flash wears out, so the learned
+ * state is only written back when ThermalSaveSchedule says so.
+ */
+
+#ifndef ESPMHP_THERMAL_H
+#define ESPMHP_THERMAL_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "espmhp_core.h"
+
+namespace espmhp {
+
+// Rates are never assumed slower than this, in degrees C per hour, so that
+// predictions stay bounded.
+static const float THERMAL_MIN_RATE = 0.1;
+
+/**
+ * Recursive least squares fit of rate = theta[0] + theta[1] * gap.
+ */
+class RateModel {
+    public:
+        // Forget what was learned, and assume a constant rate.
+        void reset(float rate);
+
+        // Continue from parameters learned earlier, with less confidence
+        // than if they were learned in this session.
+        void restore(float theta0, float theta1, uint16_t samples);
+
+        void update(float gap, float rate);
+
+        // Predicted rate for a gap, at least THERMAL_MIN_RATE.
+        float rate(float gap) const;
+
+        float theta(size_t index) const;
+        uint16_t samples() const;
+
+    private:
+        float theta_[2] = {0, 0};
+        float p_[2][2] = {{0, 0}, {0, 0}};
+        uint16_t samples_ = 0;
+};
+
+// The learned parameters, in hundredths of a degree C per hour, small enough
+// to be saved as a preference.
+struct ThermalModelState {
+    int16_t heating[2];
+    int16_t cooling[2];
+    uint16_t heating_samples;
+    uint16_t cooling_samples;
+};
+
+class ThermalModel {
+    public:
+        ThermalModel();
+
+        // Rate assumed until something was learned, in degrees C per hour.
+        void set_default_rate(float rate);
+
+        /**
+         * Feed the model with the state of the unit, on every status update.
+         *
+         * Returns:
+         *   True if the model learned something, and should be saved.
+         */
+        bool observe(uint32_t now, Mode mode, bool operating,
+                     float room_temperature, float target_temperature);
+
+        // How long the room takes to get from room_temperature to
+        // target_temperature in mode, in ms. 0 if it is there already.
+        uint32_t lead_time(Mode mode, float room_temperature,
+                           float target_temperature) const;
+
+        const RateModel& heating() const;
+        const RateModel& cooling() const;
+
+        ThermalModelState save() const;
+        void restore(const ThermalModelState& state);
+
+    private:
+        enum Direction : uint8_t {
+            DIRECTION_NONE,
+            DIRECTION_HEATING,
+            DIRECTION_COOLING,
+        };
+
+        static Direction direction(Mode mode, float room_temperature,
+                                   float target_temperature);
+
+        float default_rate_;
+        RateModel heating_;
+        RateModel cooling_;
+
+        // The window over which the current rate is measured.
+        Direction window_direction_ = DIRECTION_NONE;
+        uint32_t window_start_ = 0;
+        float window_temperature_ = 0;
+        float window_gap_ = 0;
+};
+
+// A saved parameter which moved by this much, in hundredths of a degree C
+// per hour, is saved again after THERMAL_SAVE_MIN_INTERVAL.
+static const int16_t THERMAL_SAVE_THRESHOLD = 25;
+static const uint32_t THERMAL_SAVE_MIN_INTERVAL = 60 * 60 * 1000;
+// Smaller changes, e.g. to the sample counts, wait this long.
+static const uint32_t THERMAL_SAVE_MAX_INTERVAL = 12 * 60 * 60 * 1000;
+
+/**
+ * When to save the learned state: at most once an hour while it keeps
+ * moving, and twice a day when it has settled.
+ */
+class ThermalSaveSchedule {
+    public:
+        // The state found in flash at boot, or the model's state if none.
+        void loaded(uint32_t now, const ThermalModelState& state);
+
+        // Whether state should be saved now, in which case it is taken as
+        // saved.
+        bool due(uint32_t now, const ThermalModelState& state);
+
+    private:
+        ThermalModelState saved_{};
+        uint32_t saved_at_ = 0;
+};
+
+} // namespace espmhp
+
+#endif
@@ -0,0 +1,186 @@
+/**
+ * fuzz_decode.cpp
+ *
+ * Fuzz target for everything decoded from the unit or the network
+ *
+ * License: BSD
+ *
+ * The first byte of an input picks the decoder, the rest is what it is fed,
+ * see fuzz_decode.h. Decoded values are fed on to the code which acts on them, so
+ * that out of range enums and NaN reach it too.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "espmhp_command.h"
+#include "espmhp_coordination.h"
+#include "espmhp_core.h"
+#include "espmhp_polling.h"
+#include "fuzz_decode.h"
+
+using namespace espmhp;
+
+static const size_t SETTINGS_FIELDS = 5;
+static const size_t MAX_FIELD_LENGTH = 16;
+
+/*
+ * Settings as the library could hand them over after a garbled frame:
+ *
+ *   offset size field
+ *        0    1 bit i set if field i is null
+ *        1    4 temperature, a float in host order
+ *        5    - power, mode, fan, vane and wide vane, each NUL terminated
+ */
+static void fuzz_settings(const uint8_t* data, size_t size) {
+    if (size < 5) {
+        return;
+    }
+    uint8_t nulls = data[0];
+    UnitSettings settings{};
+    memcpy(&settings.temperature, data + 1, sizeof(float));
+    data += 5;
+    size -= 5;
+
+    char fields[SETTINGS_FIELDS][MAX_FIELD_LENGTH + 1] = {};
+    const char* values[SETTINGS_FIELDS] = {};
+    for (size_t i = 0; i < SETTINGS_FIELDS; i++) {
+        size_t length = 0;
+        while (length < size && data[length] != 0) {
+            length++;
+        }
+        size_t copied = length < MAX_FIELD_LENGTH ? length : MAX_FIELD_LENGTH;
+        memcpy(fields[i], data, copied);
+        values[i] = (nulls & (1 << i)) ? nullptr : fields[i];
+        size_t consumed = length < size ? length + 1 : length;
+        data += consumed;
+        size -= consumed;
+    }
+    settings.power = values[0];
+    settings.mode = values[1];
+    settings.fan = values[2];
+    settings.vane = values[3];
+    settings.wide_vane = values[4];
+
+    DecodedSettings decoded = decode_settings(settings);
+    settings_complete(settings);
+    status_action(decoded.mode, true, 20, decoded.temperature);
+    clamp_setpoint(decoded.temperature);
+
+    FailsafePolicy policy;
+    policy.min_room_temperature = 10;
+    policy.max_room_temperature = 30;
+    failsafe_guard(policy, 5, settings);
+    failsafe_guard(policy, 35, settings);
+}
+
+static void fuzz_group_command(const GroupCommand& command) {
+    mode_to_setting(command.mode);
+    fan_to_setting(command.fan);
+    const char* vane;
+    const char* wide_vane;
+    swing_to_settings(command.swing, &vane, &wide_vane);
+    starts_compressor(MODE_OFF, command.mode);
+    clamp_setpoint(command.target_temperature);
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    if (size < 1) {
+        return 0;
+    }
+    Target target = static_cast<Target>(data[0]);
+    data++;
+    size--;
+
+    switch (target) {
+        case TARGET_SETTINGS:
+            fuzz_settings(data, size);
+            break;
+        case TARGET_INFO_PACKET: {
+            bool request;
+            InfoPage page;
+            if (parse_info_packet(data, size, &request, &page)) {
+                PollScheduler scheduler;
+                scheduler.requested(page, 0);
+                scheduler.answered(page);
+                scheduler.next(200);
+            }
+            break;
+        }
+        case TARGET_PEER_STATUS: {
+            PeerStatus status;
+            if (decode_peer_status(data, size, FUZZ_KEY, FUZZ_KEY_LENGTH,
+                                   &status)) {
+                StartCoordinator coordinator;
+                coordinator.set_start_spacing(30000);
+                coordinator.set_operating(status.unit_id, status.operating,
+                                          false, 0);
+                coordinator.note_peer_start(0, status.last_start_age);
+            }
+            break;
+        }
+        case TARGET_GROUP_COMMAND: {
+            GroupCommand command;
+            if (decode_group_command(data, size, FUZZ_KEY, FUZZ_KEY_LENGTH,
+                                     &command)) {
+                fuzz_group_command(command);
+            }
+            break;
+        }
+        case TARGET_GROUP_RESULT: {
+            GroupResult result;
+            if (decode_group_result(data, size, FUZZ_KEY, FUZZ_KEY_LENGTH,
+                                    &result)) {
+                update_result_to_string(result.result);
+            }
+            break;
+        }
+        case TARGET_COMMAND: {
+            Command command;
+            if (decode_command(data, size, FUZZ_KEY, FUZZ_KEY_LENGTH,
+                               &command)) {
+                mode_to_setting(command.mode);
+                fan_to_setting(command.fan);
+                clamp_setpoint(command.target_temperature);
+                ReplayGuard guard;
+                guard.accept(command.client_id, command.sequence);
+            }
+            break;
+        }
+        case TARGET_COMMAND_ACK: {
+            CommandAck ack;
+            decode_command_ack(data, size, FUZZ_KEY, FUZZ_KEY_LENGTH, &ack);
+            break;
+        }
+        case TARGET_GROUP_CHALLENGE: {
+            GroupChallenge challenge;
+            decode_group_challenge(data, size, FUZZ_KEY, FUZZ_KEY_LENGTH,
+                                   &challenge);
+            break;
+        }
+        case TARGET_HISTORY_REQUEST: {
+            HistoryRequest request;
+            if (decode_history_request(data, size, FUZZ_KEY, FUZZ_KEY_LENGTH,
+                                       &request)) {
+                HistoryBucket fine[4], coarse[2];
+                History history(fine, 4, coarse, 2);
+                uint8_t buffer[COMMAND_HISTORY_MAX_SIZE];
+                HistoryReply reply{request.unit_id, request.session,
+                                   request.client_id, request.sequence,
+                                   nullptr, 0};
+                encode_history_reply(reply, history, request.tier,
+                                     request.first, 0, FUZZ_KEY,
+                                     FUZZ_KEY_LENGTH, buffer, sizeof(buffer));
+            }
+            break;
+        }
+        case TARGET_HISTORY_REPLY: {
+            HistoryReply reply;
+            decode_history_reply(data, size, FUZZ_KEY, FUZZ_KEY_LENGTH,
+                                 &reply);
+            break;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,33 @@
+/**
+ * fuzz_decode.h
+ *
+ * Input layout of the fuzz_decode target
+ *
+ * License: BSD
+ */
+
+#ifndef ESPMHP_FUZZ_DECODE_H
+#define ESPMHP_FUZZ_DECODE_H
+
+#include <cstddef>
+#include <cstdint>
+
+// The first byte of an input, the decoder the rest is fed to.
+enum Target : uint8_t {
+    TARGET_SETTINGS = 0,
+    TARGET_INFO_PACKET = 1,
+    TARGET_PEER_STATUS = 2,
+    TARGET_GROUP_COMMAND = 3,
+    TARGET_GROUP_RESULT = 4,
+    TARGET_COMMAND = 5,
+    TARGET_COMMAND_ACK = 6,
+    TARGET_GROUP_CHALLENGE = 7,
+    TARGET_HISTORY_REQUEST = 8,
+    TARGET_HISTORY_REPLY = 9,
+};
+
+// Key which authenticated messages in the corpus are signed with.
+static const uint8_t FUZZ_KEY[] = "espmhp fuzz key!";
+static const size_t FUZZ_KEY_LENGTH = 16;
+
+#endif
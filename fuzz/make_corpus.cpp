@@ -0,0 +1,155 @@
+/**
+ * make_corpus.cpp
+ *
+ * Writes the seed corpus for fuzz_decode, one valid input per file
+ *
+ * License: BSD
+ *
+ * Usage: make_fuzz_corpus DIRECTORY
+ *
+ * The seeds in corpus/ were written by this, and should be written again
+ * when a message layout changes.
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "espmhp_command.h"
+#include "espmhp_coordination.h"
+#include "espmhp_core.h"
+#include "fuzz_decode.h"
+
+using namespace espmhp;
+
+static std::string directory;
+
+static bool write_seed(const char* name, Target target, const void* data,
+                       size_t length) {
+    std::string path = directory + "/" + name;
+    FILE* file = std::fopen(path.c_str(), "wb");
+    if (file == nullptr) {
+        std::perror(path.c_str());
+        return false;
+    }
+    uint8_t first = target;
+    bool written = std::fwrite(&first, 1, 1, file) == 1 &&
+        std::fwrite(data, 1, length, file) == length;
+    return std::fclose(file) == 0 && written;
+}
+
+// See fuzz_settings() in fuzz_decode.cpp for the layout.
+static bool write_settings(const char* name, uint8_t nulls, float temperature,
+                           const char* power, const char* mode,
+                           const char* fan, const char* vane,
+                           const char* wide_vane) {
+    std::string data(1, (char) nulls);
+    data.append(reinterpret_cast<const char*>(&temperature), sizeof(float));
+    for (const char* field : {power, mode, fan, vane, wide_vane}) {
+        data.append(field);
+        data.push_back('\0');
+    }
+    return write_seed(name, TARGET_SETTINGS, data.data(), data.size());
+}
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        std::fprintf(stderr, "usage: %s DIRECTORY\n", argv[0]);
+        return 2;
+    }
+    directory = argv[1];
+    bool ok = true;
+
+    ok &= write_settings("settings_heat", 0, 21.5, "ON", "HEAT", "QUIET",
+                         "SWING", "<<");
+    ok &= write_settings("settings_off", 0, 24, "OFF", "COOL", "4", "AUTO",
+                         "SWING");
+    ok &= write_settings("settings_partial", 0x1C, 0, "ON", "AUTO", "", "",
+                         "");
+
+    const uint8_t settings_reply[] = {
+        0xFC, 0x62, 0x01, 0x30, 0x10, 0x02, 0x00, 0x00, 0x01, 0x01, 0x07,
+        0x00, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+    ok &= write_seed("info_settings_reply", TARGET_INFO_PACKET,
+                     settings_reply, sizeof(settings_reply));
+    const uint8_t status_request[] = {
+        0xFC, 0x42, 0x01, 0x30, 0x10, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x7B};
+    ok &= write_seed("info_status_request", TARGET_INFO_PACKET,
+                     status_request, sizeof(status_request));
+
+    uint8_t buffer[COMMAND_HISTORY_MAX_SIZE];
+    PeerStatus status{0x12345678, true, 1500, 0xFEEDFACE, 3};
+    ok &= write_seed("peer_status", TARGET_PEER_STATUS, buffer,
+                     encode_peer_status(status, FUZZ_KEY, FUZZ_KEY_LENGTH,
+                                        buffer, sizeof(buffer)));
+
+    GroupCommand group_command{};
+    group_command.group_id = 0x0BADF00D;
+    group_command.origin = 1;
+    group_command.origin_session = 0xFEEDFACE;
+    group_command.sequence = 7;
+    group_command.fields = GROUP_FIELD_MODE | GROUP_FIELD_TARGET_TEMPERATURE;
+    group_command.mode = MODE_HEAT;
+    group_command.target_temperature = 21;
+    ok &= write_seed("group_command", TARGET_GROUP_COMMAND, buffer,
+                     encode_group_command(group_command, FUZZ_KEY,
+                                          FUZZ_KEY_LENGTH, buffer,
+                                          sizeof(buffer)));
+
+    GroupChallenge group_challenge{0x0BADF00D, 1, 0xFEEDFACE, 7, 0xCAFEBABE};
+    ok &= write_seed("group_challenge", TARGET_GROUP_CHALLENGE, buffer,
+                     encode_group_challenge(group_challenge, FUZZ_KEY,
+                                            FUZZ_KEY_LENGTH, buffer,
+                                            sizeof(buffer)));
+
+    GroupResult group_result{0x0BADF00D, 0xFEEDFACE, 7, 0x12345678,
+                             UPDATE_DEFERRED};
+    ok &= write_seed("group_result", TARGET_GROUP_RESULT, buffer,
+                     encode_group_result(group_result, FUZZ_KEY,
+                                         FUZZ_KEY_LENGTH, buffer,
+                                         sizeof(buffer)));
+
+    Command command{};
+    command.unit_id = 0x12345678;
+    command.session = 0xCAFEBABE;
+    command.client_id = 42;
+    command.sequence = 1;
+    command.fields = COMMAND_FIELD_MODE | COMMAND_FIELD_TARGET_TEMPERATURE |
+        COMMAND_FIELD_VERTICAL_VANE;
+    command.mode = MODE_COOL;
+    command.target_temperature = 23.5;
+    command.vertical_vane = 3;
+    ok &= write_seed("command", TARGET_COMMAND, buffer,
+                     encode_command(command, FUZZ_KEY, FUZZ_KEY_LENGTH,
+                                    buffer, sizeof(buffer)));
+
+    CommandAck ack{0x12345678, 0xCAFEBABE, 42, 1, UPDATE_SENT, 35};
+    ok &= write_seed("command_ack", TARGET_COMMAND_ACK, buffer,
+                     encode_command_ack(ack, FUZZ_KEY, FUZZ_KEY_LENGTH,
+                                        buffer, sizeof(buffer)));
+
+    HistoryRequest history_request{0x12345678, 0xCAFEBABE, 42, 2,
+                                   HISTORY_COARSE, 0};
+    ok &= write_seed("history_request", TARGET_HISTORY_REQUEST, buffer,
+                     encode_history_request(history_request, FUZZ_KEY,
+                                            FUZZ_KEY_LENGTH, buffer,
+                                            sizeof(buffer)));
+
+    HistoryBucket fine[2], coarse[1];
+    History history(fine, 2, coarse, 1);
+    history.set_periods(1000, 2000);
+    HistorySample sample{21, 22, true, false};
+    for (uint32_t now = 0; now <= 3000; now += 500) {
+        history.record(now, sample);
+    }
+    HistoryReply history_reply{0x12345678, 0xCAFEBABE, 42, 2, nullptr, 0};
+    ok &= write_seed("history_reply", TARGET_HISTORY_REPLY, buffer,
+                     encode_history_reply(history_reply, history,
+                                          HISTORY_FINE, 0, 3000, FUZZ_KEY,
+                                          FUZZ_KEY_LENGTH, buffer,
+                                          sizeof(buffer)));
+
+    return ok ? 0 : 1;
+}
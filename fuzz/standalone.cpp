@@ -0,0 +1,36 @@
+/**
+ * standalone.cpp
+ *
+ * Runs fuzz targets over files, for compilers without libFuzzer and to
+ * check the seed corpus from CTest
+ *
+ * License: BSD
+ *
+ * Usage: fuzz_decode_standalone FILE...
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        FILE* file = std::fopen(argv[i], "rb");
+        if (file == nullptr) {
+            std::perror(argv[i]);
+            return 1;
+        }
+        std::vector<uint8_t> input;
+        uint8_t buffer[4096];
+        size_t read;
+        while ((read = std::fread(buffer, 1, sizeof(buffer), file)) > 0) {
+            input.insert(input.end(), buffer, buffer + read);
+        }
+        std::fclose(file);
+        LLVMFuzzerTestOneInput(input.data(), input.size());
+    }
+    std::printf("ran %d input(s)\n", argc - 1);
+    return 0;
+}
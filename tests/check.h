@@ -0,0 +1,36 @@
+/**
+ * check.h
+ *
+ * Minimal assertions for the host tests
+ *
+ * License: BSD
+ *
+ * CHECK() reports the failing expression and carries on, so one run shows
+ * every failure. A test's main() returns check_result().
+ */
+
+#ifndef ESPMHP_TESTS_CHECK_H
+#define ESPMHP_TESTS_CHECK_H
+
+#include <cstdio>
+
+static int check_failures = 0;
+
+#define CHECK(expression) \
+    do { \
+        if (!(expression)) { \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, \
+                         __LINE__, #expression); \
+            check_failures++; \
+        } \
+    } while (0)
+
+static inline int check_result() {
+    if (check_failures > 0) {
+        std::fprintf(stderr, "%d check(s) failed\n", check_failures);
+        return 1;
+    }
+    return 0;
+}
+
+#endif
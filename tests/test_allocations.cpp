@@ -0,0 +1,195 @@
+/**
+ * test_allocations.cpp
+ *
+ * Checks that the platform-free code run from MitsubishiHeatPump::update()
+ * and the packet callbacks doesn't allocate
+ *
+ * License: BSD
+ *
+ * On the device, free heap deltas also count what other tasks allocate in
+ * the meantime, so they can't tell whether we allocate. Here the global
+ * operator new is replaced to count calls instead.
+ *
+ * Only the espmhp core paths are covered: the adapter's setup() and update()
+ * themselves, the HeatPump library, ESPHome and the network stack aren't
+ * built here, so this says nothing about the device's heap totals.
+ */
+
+#include <cmath>
+#include <cstdlib>
+#include <new>
+
+#include "check.h"
+#include "espmhp_command.h"
+#include "espmhp_coordination.h"
+#include "espmhp_core.h"
+#include "espmhp_history.h"
+#include "espmhp_polling.h"
+#include "espmhp_thermal.h"
+
+static size_t allocations = 0;
+
+void* operator new(std::size_t size) {
+    allocations++;
+    void* pointer = std::malloc(size == 0 ? 1 : size);
+    if (pointer == nullptr) {
+        throw std::bad_alloc();
+    }
+    return pointer;
+}
+
+void* operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* pointer) noexcept {
+    std::free(pointer);
+}
+
+void operator delete[](void* pointer) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, std::size_t) noexcept {
+    std::free(pointer);
+}
+
+void operator delete[](void* pointer, std::size_t) noexcept {
+    std::free(pointer);
+}
+
+using namespace espmhp;
+
+static const uint8_t KEY[] = "0123456789abcdef";
+
+static void run_core() {
+    UnitSettings settings{"ON", "HEAT", 21, "AUTO", "SWING", "|"};
+    DecodedSettings decoded = decode_settings(settings);
+    CHECK(settings_complete(settings));
+    CHECK(status_action(decoded.mode, true, 19, 21) == ACTION_HEATING);
+
+    RemoteTemperatureMonitor monitor;
+    monitor.set_operating_timeout_minutes(5);
+    monitor.set_ping_timeout_minutes(2);
+    monitor.ping(0);
+    monitor.set_remote_temperature(0, 20);
+    CHECK(monitor.check(1000, true) == RemoteTemperatureMonitor::EVENT_NONE);
+
+    FailsafePolicy policy;
+    policy.min_room_temperature = 10;
+    CHECK(failsafe_guard(policy, 8, settings).action == GUARD_NONE);
+
+    SnapshotState state{};
+    uint8_t snapshot[ESPMHP_SNAPSHOT_SIZE];
+    CHECK(encode_snapshot(state, snapshot, sizeof(snapshot)) ==
+          ESPMHP_SNAPSHOT_SIZE);
+}
+
+static void run_polling() {
+    PollScheduler scheduler;
+    uint8_t reply[] = {0xFC, 0x62, 0x01, 0x30, 0x10, 0x02};
+    for (uint32_t now = 0; now < 60000; now += 100) {
+        if (scheduler.should_poll(now)) {
+            scheduler.requested(scheduler.next(now), now);
+        }
+        bool request;
+        InfoPage page;
+        if (parse_info_packet(reply, sizeof(reply), &request, &page)) {
+            scheduler.answered(page);
+        }
+    }
+}
+
+static void run_coordination() {
+    StartCoordinator coordinator;
+    coordinator.set_start_spacing(30000);
+    coordinator.set_max_operating_units(1);
+    coordinator.reserve_start(0);
+    coordinator.set_operating(1, true, true, 0);
+    coordinator.set_operating(2, true, false, 0);
+    CHECK(coordinator.should_relax(2, 1000));
+
+    coordinator.note_peer_start(2000, 500);
+
+    uint8_t buffer[PEER_GROUP_COMMAND_SIZE];
+    PeerStatus status{1, true, 0, 2, 3};
+    CHECK(encode_peer_status(status, KEY, 16, buffer, sizeof(buffer)) > 0);
+    CHECK(decode_peer_status(buffer, PEER_STATUS_SIZE, KEY, 16, &status));
+}
+
+static void run_history() {
+    HistoryBucket fine[16];
+    HistoryBucket coarse[8];
+    History history(fine, 16, coarse, 8);
+    history.set_periods(1000, 4000);
+    HistorySample sample{20, 21, true, false};
+    for (uint32_t now = 0; now < 100000; now += 250) {
+        sample.room_temperature = 20 + (now % 3000) / 1000.0f;
+        history.record(now, sample);
+        history.advance(now);
+    }
+    uint8_t buffer[COMMAND_HISTORY_MAX_SIZE];
+    CHECK(history.export_tier(HISTORY_FINE, 100000, 0, buffer,
+                              sizeof(buffer)) > 0);
+
+    // As answered on the command endpoint.
+    HistoryReply reply{1, 2, 3, 4, nullptr, 0};
+    size_t length = encode_history_reply(reply, history, HISTORY_COARSE, 0,
+                                         100000, KEY, 16, buffer,
+                                         sizeof(buffer));
+    CHECK(decode_history_reply(buffer, length, KEY, 16, &reply));
+}
+
+static void run_thermal() {
+    ThermalModel model;
+    model.set_default_rate(2);
+    for (uint32_t now = 0; now < 3600000; now += 60000) {
+        model.observe(now, MODE_HEAT, true, 18 + now / 1800000.0f, 22);
+    }
+    CHECK(model.lead_time(MODE_HEAT, 18, 22) > 0);
+    ThermalModelState saved = model.save();
+    model.restore(saved);
+}
+
+static void run_command() {
+    Command command{};
+    command.unit_id = 1;
+    command.session = 2;
+    command.client_id = 3;
+    command.sequence = 4;
+    command.fields = COMMAND_FIELD_MODE;
+    command.mode = MODE_COOL;
+    uint8_t buffer[COMMAND_SIZE];
+    CHECK(encode_command(command, KEY, 16, buffer, sizeof(buffer)) ==
+          COMMAND_SIZE);
+    Command decoded;
+    CHECK(decode_command(buffer, sizeof(buffer), KEY, 16, &decoded));
+
+    ReplayGuard guard;
+    CHECK(guard.accept(decoded.client_id, decoded.sequence));
+    CHECK(!guard.accept(decoded.client_id, decoded.sequence));
+}
+
+int main() {
+    struct {
+        const char* name;
+        void (*run)();
+    } paths[] = {
+        {"core", run_core},
+        {"polling", run_polling},
+        {"coordination", run_coordination},
+        {"history", run_history},
+        {"thermal", run_thermal},
+        {"command", run_command},
+    };
+    for (const auto& path : paths) {
+        size_t before = allocations;
+        path.run();
+        if (allocations != before) {
+            std::fprintf(stderr, "%s: %zu allocation(s)\n", path.name,
+                         allocations - before);
+            check_failures++;
+        }
+    }
+    return check_result();
+}
@@ -0,0 +1,91 @@
+/**
+ * test_auth.cpp
+ *
+ * Tests for espmhp_auth: HMAC-SHA256, tags and the replay guard
+ *
+ * License: BSD
+ */
+
+#include <cstring>
+
+#include "check.h"
+#include "espmhp_auth.h"
+
+using namespace espmhp;
+
+static void test_hmac() {
+    // RFC 4231, test case 2.
+    const uint8_t key[] = "Jefe";
+    const uint8_t data[] = "what do ya want for nothing?";
+    const uint8_t expected[32] = {
+        0x5b, 0xdc, 0xc1, 0x46, 0xbf, 0x60, 0x75, 0x4e, 0x6a, 0x04, 0x24,
+        0x26, 0x08, 0x95, 0x75, 0xc7, 0x5a, 0x00, 0x3f, 0x08, 0x9d, 0x27,
+        0x39, 0x83, 0x9d, 0xec, 0x58, 0xb9, 0x64, 0xec, 0x38, 0x43,
+    };
+    uint8_t digest[32];
+    hmac_sha256(key, 4, data, 28, digest);
+    CHECK(memcmp(digest, expected, sizeof(digest)) == 0);
+
+    // RFC 4231, test case 6: a key longer than the block is hashed first.
+    uint8_t long_key[131];
+    memset(long_key, 0xaa, sizeof(long_key));
+    const uint8_t long_data[] =
+        "Test Using Larger Than Block-Size Key - Hash Key First";
+    const uint8_t long_expected[32] = {
+        0x60, 0xe4, 0x31, 0x59, 0x1e, 0xe0, 0xb6, 0x7f, 0x0d, 0x8a, 0x26,
+        0xaa, 0xcb, 0xf5, 0xb7, 0x7f, 0x8e, 0x0b, 0xc6, 0x21, 0x37, 0x28,
+        0xc5, 0x14, 0x05, 0x46, 0x04, 0x0f, 0x0e, 0xe3, 0x7f, 0x54,
+    };
+    hmac_sha256(long_key, sizeof(long_key), long_data, 54, digest);
+    CHECK(memcmp(digest, long_expected, sizeof(digest)) == 0);
+}
+
+static void test_tags() {
+    const uint8_t key[] = "0123456789abcdef";
+    uint8_t buffer[16 + AUTH_TAG_SIZE] = "signed message.";
+    auth_sign(buffer, 16, key, 16);
+    CHECK(auth_verify(buffer, 16, key, 16));
+
+    // Another key, or any changed byte, fails.
+    CHECK(!auth_verify(buffer, 16, (const uint8_t*) "fedcba9876543210", 16));
+    buffer[3] ^= 1;
+    CHECK(!auth_verify(buffer, 16, key, 16));
+    buffer[3] ^= 1;
+    buffer[16 + AUTH_TAG_SIZE - 1] ^= 1;
+    CHECK(!auth_verify(buffer, 16, key, 16));
+}
+
+static void test_replay_guard() {
+    ReplayGuard guard;
+    CHECK(!guard.knows(1));
+    CHECK(guard.accept(1, 10));
+    CHECK(guard.knows(1));
+    CHECK(!guard.accept(1, 10));
+    CHECK(!guard.accept(1, 9));
+    CHECK(guard.accept(1, 11));
+
+    // Sequence numbers may wrap around.
+    CHECK(guard.accept(2, UINT32_MAX));
+    CHECK(guard.accept(2, 0));
+    CHECK(!guard.accept(2, UINT32_MAX));
+
+    // A new client evicts the least recently used one when the guard is
+    // full.
+    for (uint32_t client = 3; client < 2 + REPLAY_GUARD_CLIENTS; client++) {
+        CHECK(guard.accept(client, 1));
+    }
+    CHECK(guard.accept(2, 1));
+    CHECK(guard.accept(100, 1));
+    CHECK(!guard.knows(1));
+    CHECK(guard.knows(2));
+
+    guard.reset();
+    CHECK(!guard.knows(2));
+}
+
+int main() {
+    test_hmac();
+    test_tags();
+    test_replay_guard();
+    return check_result();
+}
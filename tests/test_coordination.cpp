@@ -0,0 +1,159 @@
+/**
+ * test_coordination.cpp
+ *
+ * Tests for espmhp_coordination: start slots, compressor modes and peer
+ * messages
+ *
+ * License: BSD
+ */
+
+#include "check.h"
+#include "espmhp_coordination.h"
+
+using namespace espmhp;
+
+static void test_start_slots() {
+    StartCoordinator coordinator;
+    coordinator.set_start_spacing(30000);
+    CHECK(coordinator.reserve_start(0) == 0);
+    CHECK(coordinator.reserve_start(1000) == 29000);
+
+    // Giving the second start back frees its slot.
+    coordinator.cancel_start(30000);
+    uint32_t start;
+    CHECK(coordinator.last_start(&start) && start == 0);
+    CHECK(coordinator.reserve_start(2000) == 28000);
+
+    // Only the latest start can be given back.
+    CHECK(coordinator.reserve_start(3000) == 57000);
+    coordinator.cancel_start(30000);
+    CHECK(coordinator.last_start(&start) && start == 60000);
+
+    StartCoordinator single;
+    single.set_start_spacing(1000);
+    single.reserve_start(0);
+    single.cancel_start(0);
+    CHECK(!single.last_start(&start));
+}
+
+static void test_peer_starts() {
+    StartCoordinator coordinator;
+    coordinator.set_start_spacing(30000);
+    uint32_t start;
+
+    // A start reserved ahead of time counts from now.
+    coordinator.note_peer_start(100000, (uint32_t) -3600000);
+    CHECK(coordinator.last_start(&start) && start == 100000);
+    CHECK(coordinator.reserve_start(100000) == 30000);
+
+    // Starts older than the spacing don't hold anything back.
+    StartCoordinator idle;
+    idle.set_start_spacing(30000);
+    idle.note_peer_start(100000, 30000);
+    CHECK(!idle.last_start(&start));
+    idle.note_peer_start(100000, 10000);
+    CHECK(idle.last_start(&start) && start == 90000);
+    CHECK(idle.reserve_start(100000) == 20000);
+}
+
+static void test_compressor_modes() {
+    CHECK(uses_compressor(MODE_HEAT));
+    CHECK(uses_compressor(MODE_DRY));
+    CHECK(!uses_compressor(MODE_OFF));
+    CHECK(!uses_compressor(MODE_FAN_ONLY));
+
+    CHECK(starts_compressor(MODE_OFF, MODE_HEAT));
+    CHECK(starts_compressor(MODE_HEAT, MODE_COOL));
+    CHECK(!starts_compressor(MODE_HEAT, MODE_HEAT));
+    CHECK(!starts_compressor(MODE_HEAT, MODE_OFF));
+}
+
+static const uint8_t KEY[] = "0123456789abcdef";
+static const uint8_t OTHER_KEY[] = "fedcba9876543210";
+
+static void test_peer_status() {
+    PeerStatus status{0x12345678, true, 1500, 0x11223344, 9};
+    uint8_t buffer[PEER_STATUS_SIZE];
+    CHECK(encode_peer_status(status, KEY, 16, buffer, sizeof(buffer)) ==
+          PEER_STATUS_SIZE);
+    PeerStatus decoded;
+    CHECK(decode_peer_status(buffer, sizeof(buffer), KEY, 16, &decoded));
+    CHECK(decoded.unit_id == 0x12345678 && decoded.operating);
+    CHECK(decoded.last_start_age == 1500);
+    CHECK(decoded.session == 0x11223344 && decoded.sequence == 9);
+
+    CHECK(!decode_peer_status(buffer, sizeof(buffer), OTHER_KEY, 16,
+                              &decoded));
+    // Claiming a more recent start breaks the tag.
+    buffer[8] = 0;
+    CHECK(!decode_peer_status(buffer, sizeof(buffer), KEY, 16, &decoded));
+}
+
+static void test_group_command() {
+    GroupCommand command{};
+    command.group_id = 5;
+    command.origin = 1;
+    command.origin_session = 0x11223344;
+    command.sequence = 7;
+    command.receiver_session = 0x55667788;
+    command.fields = GROUP_FIELD_MODE | GROUP_FIELD_TARGET_TEMPERATURE;
+    command.mode = MODE_HEAT;
+    command.target_temperature = 21.5f;
+
+    uint8_t buffer[PEER_GROUP_COMMAND_SIZE];
+    CHECK(encode_group_command(command, KEY, 16, buffer, sizeof(buffer)) ==
+          PEER_GROUP_COMMAND_SIZE);
+    GroupCommand decoded;
+    CHECK(decode_group_command(buffer, sizeof(buffer), KEY, 16, &decoded));
+    CHECK(decoded.group_id == 5 && decoded.origin == 1);
+    CHECK(decoded.origin_session == 0x11223344 && decoded.sequence == 7);
+    CHECK(decoded.receiver_session == 0x55667788);
+    CHECK(decoded.mode == MODE_HEAT && decoded.target_temperature == 21.5f);
+
+    CHECK(!decode_group_command(buffer, sizeof(buffer), OTHER_KEY, 16,
+                                &decoded));
+    CHECK(!decode_group_command(buffer, sizeof(buffer) - 1, KEY, 16,
+                                &decoded));
+    // Pointing a command at another session breaks the tag.
+    buffer[20] ^= 1;
+    CHECK(!decode_group_command(buffer, sizeof(buffer), KEY, 16, &decoded));
+}
+
+static void test_group_challenge_and_result() {
+    GroupChallenge challenge{5, 1, 0x11223344, 7, 0x55667788};
+    uint8_t buffer[PEER_GROUP_COMMAND_SIZE];
+    CHECK(encode_group_challenge(challenge, KEY, 16, buffer, sizeof(buffer)) ==
+          PEER_GROUP_CHALLENGE_SIZE);
+    GroupChallenge decoded_challenge;
+    CHECK(decode_group_challenge(buffer, PEER_GROUP_CHALLENGE_SIZE, KEY, 16,
+                                 &decoded_challenge));
+    CHECK(decoded_challenge.receiver_session == 0x55667788);
+    CHECK(decoded_challenge.sequence == 7);
+    // A challenge isn't taken for a command, nor a command for a result.
+    GroupCommand command;
+    CHECK(!decode_group_command(buffer, PEER_GROUP_CHALLENGE_SIZE, KEY, 16,
+                                &command));
+
+    GroupResult result{5, 0x11223344, 7, 9, UPDATE_DEFERRED};
+    CHECK(encode_group_result(result, KEY, 16, buffer, sizeof(buffer)) ==
+          PEER_GROUP_RESULT_SIZE);
+    GroupResult decoded_result;
+    CHECK(decode_group_result(buffer, PEER_GROUP_RESULT_SIZE, KEY, 16,
+                              &decoded_result));
+    CHECK(decoded_result.unit_id == 9);
+    CHECK(decoded_result.result == UPDATE_DEFERRED);
+    CHECK(!decode_group_result(buffer, PEER_GROUP_RESULT_SIZE, OTHER_KEY, 16,
+                               &decoded_result));
+    CHECK(!decode_group_challenge(buffer, PEER_GROUP_RESULT_SIZE, KEY, 16,
+                                  &decoded_challenge));
+}
+
+int main() {
+    test_start_slots();
+    test_peer_starts();
+    test_compressor_modes();
+    test_peer_status();
+    test_group_command();
+    test_group_challenge_and_result();
+    return check_result();
+}
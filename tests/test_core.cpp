@@ -0,0 +1,230 @@
+/**
+ * test_core.cpp
+ *
+ * Tests for espmhp_core: settings decoding, remembered setpoints, the
+ * fail-safe guard, the remote temperature timeouts and snapshots
+ *
+ * License: BSD
+ */
+
+#include <cmath>
+
+#include "check.h"
+#include "espmhp_core.h"
+
+using namespace espmhp;
+
+static const uint32_t MINUTE = 60 * 1000;
+
+static void test_decode_settings() {
+    UnitSettings settings{"ON", "HEAT", 21.5, "QUIET", "SWING", "<<"};
+    DecodedSettings decoded = decode_settings(settings);
+    CHECK(decoded.mode_known);
+    CHECK(decoded.mode == MODE_HEAT);
+    CHECK(decoded.action == ACTION_IDLE);
+    CHECK(decoded.fan == FAN_DIFFUSE);
+    CHECK(decoded.swing == SWING_VERTICAL);
+    CHECK(decoded.vertical_vane == 0);   // "swing"
+    CHECK(decoded.horizontal_vane == 2); // "left"
+    CHECK(decoded.temperature == 21.5f);
+    CHECK(decoded.temperature_valid);
+    CHECK(settings_complete(settings));
+
+    settings = {"ON", "AUTO", 24, "4", "SWING", "SWING"};
+    decoded = decode_settings(settings);
+    CHECK(decoded.mode == MODE_HEAT_COOL);
+    CHECK(decoded.fan == FAN_HIGH);
+    CHECK(decoded.swing == SWING_BOTH);
+
+    // Power off wins over whatever the mode says.
+    settings = {"OFF", "COOL", 24, "AUTO", "AUTO", "|"};
+    decoded = decode_settings(settings);
+    CHECK(decoded.mode_known);
+    CHECK(decoded.mode == MODE_OFF);
+    CHECK(decoded.action == ACTION_OFF);
+    CHECK(decoded.swing == SWING_OFF);
+}
+
+static void test_decode_incomplete_settings() {
+    // Nothing decoded yet.
+    UnitSettings settings{nullptr, nullptr, NAN, nullptr, nullptr, nullptr};
+    DecodedSettings decoded = decode_settings(settings);
+    CHECK(decoded.mode == MODE_OFF);
+    CHECK(decoded.fan == FAN_AUTO);
+    CHECK(decoded.swing == SWING_OFF);
+    CHECK(decoded.vertical_vane == VANE_UNKNOWN);
+    CHECK(decoded.horizontal_vane == VANE_UNKNOWN);
+    CHECK(!decoded.temperature_valid);
+    CHECK(!settings_complete(settings));
+
+    // A mode we don't know leaves mode and action alone.
+    settings = {"ON", "BOGUS", 22, "AUTO", "AUTO", "|"};
+    decoded = decode_settings(settings);
+    CHECK(!decoded.mode_known);
+    CHECK(settings_complete(settings));
+
+    settings = {"ON", "COOL", 45, "AUTO", "AUTO", nullptr};
+    decoded = decode_settings(settings);
+    CHECK(decoded.mode == MODE_COOL);
+    CHECK(!decoded.temperature_valid);
+    CHECK(decoded.horizontal_vane == VANE_UNKNOWN);
+    CHECK(!settings_complete(settings));
+}
+
+static void test_failsafe_guard() {
+    FailsafePolicy policy;
+    CHECK(!policy.configured());
+    policy.min_room_temperature = 10;
+    policy.max_room_temperature = 35;
+    CHECK(policy.configured());
+
+    UnitSettings off{"OFF", "COOL", 24, "AUTO", "AUTO", "|"};
+    UnitSettings heating{"ON", "HEAT", 20, "AUTO", "AUTO", "|"};
+    UnitSettings cooling{"ON", "COOL", 24, "AUTO", "AUTO", "|"};
+
+    // Within bounds, or nothing known about the room.
+    CHECK(failsafe_guard(policy, 20, off).action == GUARD_NONE);
+    CHECK(failsafe_guard(policy, NAN, off).action == GUARD_NONE);
+
+    // Too cold: heat, with the bound clamped to what the hardware accepts.
+    GuardDecision decision = failsafe_guard(policy, 8, off);
+    CHECK(decision.action == GUARD_HEAT);
+    CHECK(decision.setpoint == ESPMHP_MIN_TEMPERATURE);
+    CHECK(failsafe_guard(policy, 8, cooling).action == GUARD_HEAT);
+    // Already heating to at least the bound.
+    CHECK(failsafe_guard(policy, 8, heating).action == GUARD_NONE);
+
+    // Too warm: cool.
+    decision = failsafe_guard(policy, 38, heating);
+    CHECK(decision.action == GUARD_COOL);
+    CHECK(decision.setpoint == ESPMHP_MAX_TEMPERATURE);
+    CHECK(failsafe_guard(policy, 38, cooling).action == GUARD_NONE);
+
+    // Settings not decoded yet.
+    UnitSettings unknown{nullptr, nullptr, NAN, nullptr, nullptr, nullptr};
+    CHECK(failsafe_guard(policy, 8, unknown).action == GUARD_NONE);
+}
+
+// What the adapter keeps per mode, fed from the settings read from the unit.
+struct Setpoints {
+    float heat = NAN;
+    float cool = NAN;
+    int saves = 0;
+
+    void read(const UnitSettings& settings, bool failsafe) {
+        DecodedSettings decoded = decode_settings(settings);
+        float* slot;
+        switch (setpoint_slot(decoded, false, failsafe)) {
+            case SETPOINT_HEAT:
+                slot = &heat;
+                break;
+            case SETPOINT_COOL:
+                slot = &cool;
+                break;
+            default:
+                return;
+        }
+        if (*slot != decoded.temperature) {
+            *slot = decoded.temperature;
+            saves++;
+        }
+    }
+};
+
+static void test_setpoints_across_failsafe() {
+    UnitSettings user{"ON", "HEAT", 21, "AUTO", "AUTO", "|"};
+    UnitSettings failsafe{"ON", "HEAT", 16, "AUTO", "AUTO", "|"};
+    UnitSettings guard{"ON", "COOL", 31, "AUTO", "AUTO", "|"};
+
+    Setpoints setpoints;
+    setpoints.read(user, false);
+    CHECK(setpoints.heat == 21 && setpoints.saves == 1);
+
+    // Entering the fail-safe policy, then a guard forcing COOL, then
+    // restoring the user's settings on exit.
+    setpoints.read(failsafe, true);
+    setpoints.read(guard, true);
+    setpoints.read(user, false);
+    CHECK(setpoints.heat == 21);
+    CHECK(std::isnan(setpoints.cool));
+    CHECK(setpoints.saves == 1);
+
+    // Nor while relaxed for the operating units budget.
+    DecodedSettings relaxed = decode_settings(failsafe);
+    CHECK(setpoint_slot(relaxed, true, false) == SETPOINT_NONE);
+    CHECK(setpoint_slot(relaxed, false, false) == SETPOINT_HEAT);
+}
+
+static void test_remote_temperature_timeouts() {
+    RemoteTemperatureMonitor monitor;
+    monitor.set_operating_timeout_minutes(5);
+    monitor.set_idle_timeout_minutes(10);
+    monitor.set_ping_timeout_minutes(2);
+
+    // Nothing to time out yet.
+    CHECK(monitor.check(60 * MINUTE, true) ==
+          RemoteTemperatureMonitor::EVENT_NONE);
+
+    uint32_t start = 1000;
+    monitor.set_remote_temperature(start, 21);
+    CHECK(monitor.remote_temperature_active());
+    CHECK(monitor.check(start + 5 * MINUTE, true) ==
+          RemoteTemperatureMonitor::EVENT_NONE);
+    CHECK(monitor.check(start + 5 * MINUTE + 1, true) ==
+          RemoteTemperatureMonitor::EVENT_REMOTE_TEMPERATURE_TIMEOUT);
+    // The idle timeout is longer.
+    CHECK(monitor.check(start + 5 * MINUTE + 1, false) ==
+          RemoteTemperatureMonitor::EVENT_NONE);
+
+    // Refreshing restarts the window; a temperature <= 0 disarms it.
+    monitor.refresh_remote_temperature(start + 4 * MINUTE);
+    CHECK(monitor.check(start + 8 * MINUTE, true) ==
+          RemoteTemperatureMonitor::EVENT_NONE);
+    monitor.set_remote_temperature(start + 8 * MINUTE, 0);
+    CHECK(!monitor.remote_temperature_active());
+    CHECK(monitor.check(start + 60 * MINUTE, true) ==
+          RemoteTemperatureMonitor::EVENT_NONE);
+
+    // A ping timeout fires once, then waits for the next ping.
+    monitor.ping(start);
+    CHECK(monitor.check(start + 2 * MINUTE + 1, false) ==
+          RemoteTemperatureMonitor::EVENT_PING_TIMEOUT);
+    CHECK(monitor.check(start + 3 * MINUTE, false) ==
+          RemoteTemperatureMonitor::EVENT_NONE);
+    CHECK(monitor.ping_age(start + 3 * MINUTE) == ESPMHP_SNAPSHOT_NO_AGE);
+
+    // Timeouts hold across millis() wrapping around.
+    uint32_t before_wrap = 0xFFFFFFFF - MINUTE;
+    monitor.ping(before_wrap);
+    CHECK(monitor.check(before_wrap + MINUTE + 1, false) ==
+          RemoteTemperatureMonitor::EVENT_NONE);
+    CHECK(monitor.check(before_wrap + 2 * MINUTE + 1, false) ==
+          RemoteTemperatureMonitor::EVENT_PING_TIMEOUT);
+}
+
+static void test_snapshot() {
+    SnapshotState state{};
+    state.unit_id = 0x8A1F03C2;
+    state.target_temperature = 21.5;
+    uint8_t buffer[ESPMHP_SNAPSHOT_SIZE];
+    CHECK(encode_snapshot(state, buffer, sizeof(buffer)) ==
+          ESPMHP_SNAPSHOT_SIZE);
+    CHECK(buffer[0] == ESPMHP_SNAPSHOT_MAGIC);
+    CHECK(buffer[1] == 1);
+    CHECK((buffer[2] | (buffer[3] << 8)) == ESPMHP_SNAPSHOT_SIZE);
+    // The id commands and groups use.
+    CHECK(buffer[4] == 0xC2 && buffer[5] == 0x03 && buffer[6] == 0x1F &&
+          buffer[7] == 0x8A);
+    CHECK((buffer[20] | (buffer[21] << 8)) == 215);
+    CHECK(encode_snapshot(state, buffer, sizeof(buffer) - 1) == 0);
+}
+
+int main() {
+    test_decode_settings();
+    test_decode_incomplete_settings();
+    test_failsafe_guard();
+    test_setpoints_across_failsafe();
+    test_remote_temperature_timeouts();
+    test_snapshot();
+    return check_result();
+}
@@ -0,0 +1,101 @@
+/**
+ * test_history.cpp
+ *
+ * Tests for espmhp_history: bucket storage and export, also over the
+ * command endpoint
+ *
+ * License: BSD
+ */
+
+#include "check.h"
+#include "espmhp_command.h"
+#include "espmhp_history.h"
+
+using namespace espmhp;
+
+static void feed(History* history, uint32_t until) {
+    HistorySample sample{20, 21, true, false};
+    for (uint32_t now = 0; now <= until; now += 250) {
+        history->record(now, sample);
+    }
+}
+
+static void test_without_storage() {
+    History history(nullptr, 0, nullptr, 0);
+    history.set_periods(1000, 4000);
+    feed(&history, 20000);
+    CHECK(history.tier(HISTORY_FINE).size() == 0);
+    CHECK(history.tier(HISTORY_COARSE).size() == 0);
+
+    uint8_t buffer[64];
+    CHECK(history.export_tier(HISTORY_FINE, 20000, 0, buffer,
+                              sizeof(buffer)) == HISTORY_HEADER_SIZE);
+    CHECK(buffer[12] == 0);
+}
+
+static void test_storage_sizes() {
+    // Two histories with rings of different sizes, as two units would have.
+    HistoryBucket small_fine[2], small_coarse[1];
+    HistoryBucket large_fine[8], large_coarse[4];
+    History small(small_fine, 2, small_coarse, 1);
+    History large(nullptr, 0, nullptr, 0);
+    large.set_storage(large_fine, 8, large_coarse, 4);
+    small.set_periods(1000, 4000);
+    large.set_periods(1000, 4000);
+    feed(&small, 20000);
+    feed(&large, 20000);
+
+    CHECK(small.tier(HISTORY_FINE).size() == 2);
+    CHECK(small.tier(HISTORY_COARSE).size() == 1);
+    CHECK(large.tier(HISTORY_FINE).size() == 8);
+    CHECK(large.tier(HISTORY_COARSE).size() == 4);
+    CHECK(large.tier(HISTORY_FINE).at(7).duty_cycle == 100);
+    CHECK(large.tier(HISTORY_FINE).at(7).mean_temperature == 200);
+}
+
+static void test_command_export() {
+    static const uint8_t KEY[] = "0123456789abcdef";
+    HistoryBucket fine[100], coarse[1];
+    History history(fine, 100, coarse, 1);
+    history.set_periods(1000, 100000);
+    feed(&history, 100000);
+
+    HistoryRequest request{0x12345678, 7, 42, 3, HISTORY_FINE, 10};
+    uint8_t buffer[COMMAND_HISTORY_MAX_SIZE + 16];
+    size_t length = encode_history_request(request, KEY, 16, buffer,
+                                           sizeof(buffer));
+    CHECK(length == COMMAND_HISTORY_REQUEST_SIZE);
+    HistoryRequest decoded;
+    CHECK(decode_history_request(buffer, length, KEY, 16, &decoded));
+    CHECK(decoded.tier == HISTORY_FINE && decoded.first == 10);
+    CHECK(decoded.client_id == 42 && decoded.sequence == 3);
+    // Not a command.
+    Command command;
+    CHECK(!decode_command(buffer, length, KEY, 16, &command));
+
+    // Chunks are capped, whatever the buffer.
+    HistoryReply reply{0x12345678, 7, 42, 3, nullptr, 0};
+    length = encode_history_reply(reply, history, HISTORY_FINE, 10, 100000,
+                                  KEY, 16, buffer, sizeof(buffer));
+    CHECK(length == COMMAND_HISTORY_MAX_SIZE);
+    HistoryReply answer;
+    CHECK(decode_history_reply(buffer, length, KEY, 16, &answer));
+    CHECK(answer.sequence == 3);
+    CHECK(answer.chunk_length ==
+          HISTORY_HEADER_SIZE + COMMAND_HISTORY_BUCKETS * HISTORY_BUCKET_SIZE);
+    CHECK(answer.chunk[0] == HISTORY_MAGIC);
+    CHECK((answer.chunk[8] | (answer.chunk[9] << 8)) == 100);
+    CHECK((answer.chunk[10] | (answer.chunk[11] << 8)) == 10);
+    CHECK((answer.chunk[12] | (answer.chunk[13] << 8)) ==
+          COMMAND_HISTORY_BUCKETS);
+
+    buffer[30] ^= 1;
+    CHECK(!decode_history_reply(buffer, length, KEY, 16, &answer));
+}
+
+int main() {
+    test_without_storage();
+    test_storage_sizes();
+    test_command_export();
+    return check_result();
+}
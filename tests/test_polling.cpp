@@ -0,0 +1,103 @@
+/**
+ * test_polling.cpp
+ *
+ * Tests for espmhp_polling: info packet parsing and the PollScheduler
+ *
+ * License: BSD
+ */
+
+#include "check.h"
+#include "espmhp_polling.h"
+
+using namespace espmhp;
+
+static void test_parse_info_packet() {
+    uint8_t packet[] = {0xFC, 0x62, 0x01, 0x30, 0x10, 0x06};
+    bool request = true;
+    InfoPage page = PAGE_SETTINGS;
+    CHECK(parse_info_packet(packet, sizeof(packet), &request, &page));
+    CHECK(!request);
+    CHECK(page == PAGE_STATUS);
+
+    packet[1] = 0x42;
+    packet[5] = 0x02;
+    CHECK(parse_info_packet(packet, sizeof(packet), &request, &page));
+    CHECK(request);
+    CHECK(page == PAGE_SETTINGS);
+
+    packet[5] = 0x20; // not scheduled
+    CHECK(!parse_info_packet(packet, sizeof(packet), &request, &page));
+    packet[1] = 0x41; // a set request
+    CHECK(!parse_info_packet(packet, sizeof(packet), &request, &page));
+    CHECK(!parse_info_packet(packet, 5, &request, &page));
+}
+
+// Request and answer every page once, a ms apart from start.
+static void poll_all(PollScheduler* scheduler, uint32_t start) {
+    for (uint32_t i = 0; i < 5; i++) {
+        InfoPage page = scheduler->next(start + i);
+        scheduler->requested(page, start + i);
+        scheduler->answered(page);
+    }
+}
+
+static void test_reply_window() {
+    PollScheduler scheduler;
+    poll_all(&scheduler, 0);
+    // The settings and status pages are due again at 3 s.
+    CHECK(!scheduler.should_poll(100));
+
+    uint32_t sent = 100;
+    scheduler.requested(PAGE_ROOM_TEMP, sent);
+    // The library can't read the reply before POLL_READ_DELAY, so sync()
+    // must still be called after that, until the timeout.
+    CHECK(POLL_REPLY_TIMEOUT >= POLL_READ_DELAY + 500);
+    CHECK(scheduler.should_poll(sent + POLL_READ_DELAY));
+    CHECK(scheduler.should_poll(sent + POLL_READ_DELAY + 400));
+    CHECK(scheduler.should_poll(sent + POLL_REPLY_TIMEOUT - 1));
+    CHECK(!scheduler.should_poll(sent + POLL_REPLY_TIMEOUT));
+
+    // A reply ends the window early.
+    scheduler.requested(PAGE_ROOM_TEMP, sent);
+    scheduler.answered(PAGE_ROOM_TEMP);
+    CHECK(!scheduler.should_poll(sent + POLL_READ_DELAY));
+}
+
+static void test_adaptive_intervals() {
+    PollScheduler scheduler;
+    // Unrequested pages go first, in order.
+    CHECK(scheduler.next(0) == PAGE_SETTINGS);
+    poll_all(&scheduler, 0);
+
+    // Unchanged replies stretch the interval: settings went from 2 s to 3 s.
+    CHECK(!scheduler.should_poll(2500));
+    CHECK(scheduler.should_poll(3000));
+    CHECK(scheduler.next(3000) == PAGE_SETTINGS);
+
+    // A change snaps it back to 2 s, while the unchanged status page
+    // stretches to 4.5 s.
+    scheduler.requested(PAGE_SETTINGS, 3000);
+    scheduler.answered(PAGE_SETTINGS);
+    scheduler.last_answer_changed();
+    scheduler.requested(PAGE_STATUS, 3001);
+    scheduler.answered(PAGE_STATUS);
+    CHECK(scheduler.max_lateness() == 0);
+    CHECK(!scheduler.should_poll(4900));
+    CHECK(scheduler.next(5001) == PAGE_SETTINGS);
+
+    // An expedited page goes ahead of everything.
+    scheduler.expedite(PAGE_TIMERS);
+    CHECK(scheduler.should_poll(3100));
+    CHECK(scheduler.next(3100) == PAGE_TIMERS);
+
+    // Requested a second after it was due.
+    scheduler.requested(PAGE_ROOM_TEMP, 7002);
+    CHECK(scheduler.max_lateness() == 1000);
+}
+
+int main() {
+    test_parse_info_packet();
+    test_reply_window();
+    test_adaptive_intervals();
+    return check_result();
+}
@@ -0,0 +1,67 @@
+/**
+ * test_thermal.cpp
+ *
+ * Tests for espmhp_thermal: when the learned state is saved
+ *
+ * License: BSD
+ */
+
+#include "check.h"
+#include "espmhp_thermal.h"
+
+using namespace espmhp;
+
+static const uint32_t MINUTE = 60 * 1000;
+
+static void test_save_schedule() {
+    ThermalSaveSchedule schedule;
+    ThermalModelState state{{200, 0}, {200, 0}, 0, 0};
+    schedule.loaded(0, state);
+
+    // Nothing new to save.
+    CHECK(!schedule.due(24 * 60 * MINUTE, state));
+
+    // A few samples learned, and the rates barely moved: saved half a day
+    // after the last save only.
+    schedule.loaded(0, state);
+    state.heating_samples = 3;
+    state.heating[0] = 210;
+    CHECK(!schedule.due(5 * MINUTE, state));
+    CHECK(!schedule.due(11 * 60 * MINUTE, state));
+    CHECK(schedule.due(12 * 60 * MINUTE, state));
+    CHECK(!schedule.due(12 * 60 * MINUTE + 5 * MINUTE, state));
+
+    // A rate which moved noticeably waits an hour, not every window.
+    state.heating[1] = -30;
+    CHECK(!schedule.due(12 * 60 * MINUTE + 30 * MINUTE, state));
+    CHECK(schedule.due(13 * 60 * MINUTE, state));
+    CHECK(!schedule.due(14 * 60 * MINUTE, state));
+}
+
+static void test_learning_writes() {
+    // A day of heating, status updates every 10 s: the model learns from
+    // many windows, but only a few of them are saved.
+    ThermalModel model;
+    model.set_default_rate(2);
+    ThermalSaveSchedule schedule;
+    schedule.loaded(0, model.save());
+
+    size_t learned = 0;
+    size_t saves = 0;
+    for (uint32_t now = 0; now < 24 * 60 * MINUTE; now += 10000) {
+        // The room warms by 1.5 C over each hour, then starts over.
+        float room = 18 + (now % (60 * MINUTE)) / (40.0f * MINUTE);
+        if (model.observe(now, MODE_HEAT, true, room, 22)) {
+            learned++;
+            saves += schedule.due(now, model.save());
+        }
+    }
+    CHECK(learned > 50);
+    CHECK(saves >= 1 && saves <= 24);
+}
+
+int main() {
+    test_save_schedule();
+    test_learning_writes();
+    return check_result();
+}
@@ -0,0 +1,533 @@
+#!/usr/bin/env python3
+"""Client and load generator for the mitsubishi_heatpump command endpoint.
+
+Sends authenticated commands to units with a `command_endpoint` block, as
+described in components/mitsubishi_heatpump/espmhp_command.h. Only needs the
+Python standard library.
+
+Send one command:
+
+    espmhp_command.py send --host 192.168.1.20 --key "$KEY" \\
+        --node livingroom --object-id living_room_heatpump \\
+        --mode HEAT --temperature 21.5
+
+Measure throughput and latency on one or more units:
+
+    espmhp_command.py load --key "$KEY" --duration 60 \\
+        --target 192.168.1.20:9997:livingroom/living_room_heatpump \\
+        --target 192.168.1.21:9997:0x8A1F03C2
+
+Fetch the coarse history of a unit with a `history` block, as CSV:
+
+    espmhp_command.py history --host 192.168.1.20 --key "$KEY" \\
+        --node livingroom --object-id living_room_heatpump --tier coarse
+"""
+
+import argparse
+import hashlib
+import hmac
+import os
+import selectors
+import socket
+import struct
+import sys
+import time
+
+MAGIC = 0x43
+VERSION = 1
+MESSAGE_COMMAND = 1
+MESSAGE_ACK = 2
+MESSAGE_HISTORY_REQUEST = 3
+MESSAGE_HISTORY = 4
+COMMAND_SIZE = 36
+ACK_SIZE = 32
+HISTORY_HEADER_SIZE = 20
+TAG_SIZE = 8
+
+# See espmhp_history.h.
+HISTORY_TIERS = {"fine": 0, "coarse": 1}
+HISTORY_CHUNK_HEADER_SIZE = 18
+HISTORY_BUCKET_SIZE = 10
+NO_TEMPERATURE = -32768
+
+FIELD_MODE = 1 << 0
+FIELD_TARGET_TEMPERATURE = 1 << 1
+FIELD_FAN_MODE = 1 << 2
+FIELD_SWING_MODE = 1 << 3
+FIELD_VERTICAL_VANE = 1 << 4
+FIELD_HORIZONTAL_VANE = 1 << 5
+
+STALE_SESSION = 0x80
+CHALLENGE = 0x81
+RESULTS = {
+    0: "sent",
+    1: "deferred",
+    2: "failed",
+    3: "unsupported",
+    4: "queued",
+    5: "rejected",
+    STALE_SESSION: "stale session",
+    CHALLENGE: "challenge",
+}
+
+# The esphome::climate enums.
+MODES = {"OFF": 0, "HEAT_COOL": 1, "COOL": 2, "HEAT": 3, "FAN_ONLY": 4, "DRY": 5}
+FAN_MODES = {
+    "ON": 0, "OFF": 1, "AUTO": 2, "LOW": 3, "MEDIUM": 4, "HIGH": 5,
+    "MIDDLE": 6, "FOCUS": 7, "DIFFUSE": 8,
+}
+SWING_MODES = {"OFF": 0, "BOTH": 1, "VERTICAL": 2, "HORIZONTAL": 3}
+
+# In the order of the vane selects in climate.py.
+VERTICAL_VANE_OPTIONS = [
+    "swing", "auto", "up", "up_center", "center", "down_center", "down",
+]
+HORIZONTAL_VANE_OPTIONS = [
+    "auto", "swing", "left", "left_center", "center", "right_center", "right",
+]
+
+
+def fnv1_hash(text):
+    """ESPHome's fnv1_hash()."""
+    value = 2166136261
+    for byte in text.encode():
+        value = (value * 16777619) & 0xFFFFFFFF
+        value ^= byte
+    return value
+
+
+def unit_id(node, object_id):
+    """The id reported by MitsubishiHeatPump::get_unit_id()."""
+    return fnv1_hash(f"{node}/{object_id}")
+
+
+def parse_unit(text):
+    """A unit id as hex (0x...) or as node/object_id."""
+    if "/" in text:
+        node, object_id = text.split("/", 1)
+        return unit_id(node, object_id)
+    return int(text, 16)
+
+
+def tag(key, data):
+    return hmac.new(key, data, hashlib.sha256).digest()[:TAG_SIZE]
+
+
+class Command:
+    def __init__(self, mode=None, temperature=None, fan=None, swing=None,
+                 vertical_vane=None, horizontal_vane=None):
+        self.mode = mode
+        self.temperature = temperature
+        self.fan = fan
+        self.swing = swing
+        self.vertical_vane = vertical_vane
+        self.horizontal_vane = horizontal_vane
+
+    def encode(self, key, unit, session, client_id, sequence):
+        fields = 0
+        if self.mode is not None:
+            fields |= FIELD_MODE
+        if self.temperature is not None:
+            fields |= FIELD_TARGET_TEMPERATURE
+        if self.fan is not None:
+            fields |= FIELD_FAN_MODE
+        if self.swing is not None:
+            fields |= FIELD_SWING_MODE
+        if self.vertical_vane is not None:
+            fields |= FIELD_VERTICAL_VANE
+        if self.horizontal_vane is not None:
+            fields |= FIELD_HORIZONTAL_VANE
+        body = struct.pack(
+            "<BBBBIIIIBBBBBBh",
+            MAGIC, VERSION, MESSAGE_COMMAND, fields,
+            unit, session, client_id, sequence,
+            MODES.get(self.mode, 0),
+            FAN_MODES.get(self.fan, 0),
+            SWING_MODES.get(self.swing, 0),
+            VERTICAL_VANE_OPTIONS.index(self.vertical_vane)
+            if self.vertical_vane is not None else 0,
+            HORIZONTAL_VANE_OPTIONS.index(self.horizontal_vane)
+            if self.horizontal_vane is not None else 0,
+            0,
+            round(self.temperature * 10) if self.temperature is not None else 0,
+        )
+        return body + tag(key, body)
+
+
+class Ack:
+    def __init__(self, result, unit, session, client_id, sequence, elapsed):
+        self.result = result
+        self.unit = unit
+        self.session = session
+        self.client_id = client_id
+        self.sequence = sequence
+        self.elapsed = elapsed
+
+    @staticmethod
+    def decode(key, data):
+        """The ack in data, or None if it isn't an authentic ack."""
+        if len(data) < ACK_SIZE:
+            return None
+        body = data[:ACK_SIZE - TAG_SIZE]
+        if not hmac.compare_digest(tag(key, body), data[len(body):ACK_SIZE]):
+            return None
+        magic, version, kind, result, unit, session, client_id, sequence, \
+            elapsed = struct.unpack("<BBBBIIIII", body)
+        if magic != MAGIC or version != VERSION or kind != MESSAGE_ACK:
+            return None
+        return Ack(result, unit, session, client_id, sequence, elapsed)
+
+
+class HistoryRequest:
+    def __init__(self, tier, first):
+        self.tier = tier
+        self.first = first
+
+    def encode(self, key, unit, session, client_id, sequence):
+        body = struct.pack(
+            "<BBBBIIIIHH",
+            MAGIC, VERSION, MESSAGE_HISTORY_REQUEST, self.tier,
+            unit, session, client_id, sequence, self.first, 0,
+        )
+        return body + tag(key, body)
+
+
+class History:
+    """A chunk of history, answering a HistoryRequest."""
+
+    # Not an ack result; lets Unit.command() treat both alike.
+    result = None
+
+    def __init__(self, unit, session, client_id, sequence, chunk):
+        self.unit = unit
+        self.session = session
+        self.client_id = client_id
+        self.sequence = sequence
+        _, _, self.tier, _, self.period, self.total, self.first, count, \
+            self.age = struct.unpack(
+                "<BBBBIHHHI", chunk[:HISTORY_CHUNK_HEADER_SIZE])
+        self.buckets = [
+            struct.unpack_from("<hhhhBB", chunk,
+                               HISTORY_CHUNK_HEADER_SIZE +
+                               i * HISTORY_BUCKET_SIZE)
+            for i in range(count)
+        ]
+
+    @staticmethod
+    def decode(key, data):
+        """The history in data, or None if it isn't authentic history."""
+        if len(data) < HISTORY_HEADER_SIZE + HISTORY_CHUNK_HEADER_SIZE + \
+                TAG_SIZE:
+            return None
+        body = data[:-TAG_SIZE]
+        if not hmac.compare_digest(tag(key, body), data[-TAG_SIZE:]):
+            return None
+        magic, version, kind, _, unit, session, client_id, sequence = \
+            struct.unpack("<BBBBIIII", body[:HISTORY_HEADER_SIZE])
+        if magic != MAGIC or version != VERSION or kind != MESSAGE_HISTORY:
+            return None
+        return History(unit, session, client_id, sequence,
+                       body[HISTORY_HEADER_SIZE:])
+
+
+class Unit:
+    """Commands to one unit, over one socket."""
+
+    def __init__(self, host, port, key, unit, client_id=None):
+        self.key = key
+        self.unit = unit
+        self.client_id = client_id if client_id is not None else \
+            struct.unpack("<I", os.urandom(4))[0]
+        self.session = 0
+        self.challenge = None
+        self.sequence = 0
+        self.socket = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.socket.connect((host, port))
+
+    def send(self, command):
+        """Send command, returning its sequence number. Answers the last
+        challenge, if any."""
+        self.sequence = (self.sequence + 1) & 0xFFFFFFFF
+        session = self.session if self.challenge is None else self.challenge
+        self.challenge = None
+        self.socket.send(command.encode(
+            self.key, self.unit, session, self.client_id, self.sequence))
+        return self.sequence
+
+    def receive(self):
+        """An ack or history for this client, or None if the datagram isn't
+        one."""
+        try:
+            data = self.socket.recv(2048)
+        except ConnectionRefusedError:
+            # Nothing listening on the port (yet); the ack times out.
+            return None
+        if len(data) > 2 and data[2] == MESSAGE_HISTORY:
+            ack = History.decode(self.key, data)
+        else:
+            ack = Ack.decode(self.key, data)
+        if ack is None or ack.unit != self.unit or \
+                ack.client_id != self.client_id:
+            return None
+        return ack
+
+    def command(self, command, timeout=2.0):
+        """Send command and wait for its ack, joining the unit's session and
+        answering its challenge first if needed. Returns the ack and the round
+        trip in seconds, or None on timeout."""
+        for _ in range(3):
+            start = time.monotonic()
+            sequence = self.send(command)
+            deadline = start + timeout
+            while True:
+                remaining = deadline - time.monotonic()
+                if remaining <= 0:
+                    return None
+                self.socket.settimeout(remaining)
+                try:
+                    ack = self.receive()
+                except socket.timeout:
+                    return None
+                if ack is not None and ack.sequence == sequence:
+                    break
+            if ack.result == CHALLENGE:
+                self.challenge = ack.session
+            else:
+                self.session = ack.session
+                if ack.result != STALE_SESSION:
+                    return ack, time.monotonic() - start
+        return None
+
+
+def percentile_label(fraction):
+    return "max" if fraction == 1.0 else f"p{int(fraction * 100)}"
+
+
+def percentile(values, fraction):
+    if not values:
+        return float("nan")
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, int(fraction * len(ordered)))]
+
+
+def command_from_args(args):
+    return Command(
+        mode=args.mode,
+        temperature=args.temperature,
+        fan=args.fan,
+        swing=args.swing,
+        vertical_vane=args.vertical_vane,
+        horizontal_vane=args.horizontal_vane,
+    )
+
+
+def unit_from_args(args):
+    if args.unit_id is not None:
+        return int(args.unit_id, 16)
+    if args.node is not None and args.object_id is not None:
+        return unit_id(args.node, args.object_id)
+    sys.exit("Either --unit-id or both --node and --object-id are required.")
+
+
+def send(args):
+    unit = unit_from_args(args)
+    client = Unit(args.host, args.port, args.key.encode(), unit)
+    answer = client.command(command_from_args(args), args.timeout)
+    if answer is None:
+        sys.exit(f"No ack from unit {unit:08X} within {args.timeout} s.")
+    ack, round_trip = answer
+    print(f"unit {unit:08X}: {RESULTS.get(ack.result, ack.result)} in "
+          f"{round_trip * 1000:.1f} ms ({ack.elapsed} ms on the node)")
+
+
+def history(args):
+    unit = unit_from_args(args)
+    client = Unit(args.host, args.port, args.key.encode(), unit)
+
+    def temperature(tenths):
+        return "" if tenths == NO_TEMPERATURE else f"{tenths / 10:.1f}"
+
+    print("minutes_ago,min,max,mean,setpoint,duty_cycle,remote_share")
+    first = 0
+    while True:
+        answer = client.command(
+            HistoryRequest(HISTORY_TIERS[args.tier], first), args.timeout)
+        if answer is None:
+            sys.exit(f"No answer from unit {unit:08X} within {args.timeout} s.")
+        chunk = answer[0]
+        if not isinstance(chunk, History):
+            sys.exit(f"unit {unit:08X}: {RESULTS.get(chunk.result, chunk.result)}")
+        for index, bucket in enumerate(chunk.buckets, chunk.first):
+            # When the bucket closed, the newest one age ms ago.
+            ago = chunk.age + (chunk.total - 1 - index) * chunk.period
+            low, high, mean, setpoint, duty, remote = bucket
+            print(f"{ago / 60000:.0f},{temperature(low)},{temperature(high)},"
+                  f"{temperature(mean)},{temperature(setpoint)},{duty},{remote}")
+        first = chunk.first + len(chunk.buckets)
+        if not chunk.buckets or first >= chunk.total:
+            break
+
+
+class Load:
+    """Pipelined commands to one unit, with per-command latency."""
+
+    def __init__(self, unit, window, interval, commands, timeout):
+        self.unit = unit
+        self.window = window
+        self.interval = interval
+        self.commands = commands
+        self.timeout = timeout
+        self.outstanding = {}  # sequence -> send time
+        self.next_send = 0.0
+        self.sent = 0
+        self.latencies = []
+        self.node_times = []
+        self.results = {}
+        self.lost = 0
+
+    def send_due(self, now):
+        while len(self.outstanding) < self.window and now >= self.next_send:
+            command = self.commands[self.sent % len(self.commands)]
+            self.outstanding[self.unit.send(command)] = now
+            self.sent += 1
+            self.next_send = max(self.next_send + self.interval, now) \
+                if self.interval > 0 else now
+
+    def receive(self, now):
+        ack = self.unit.receive()
+        if ack is None or ack.sequence not in self.outstanding:
+            return
+        sent = self.outstanding.pop(ack.sequence)
+        if ack.result == STALE_SESSION:
+            # Only happens if the unit rebooted during the run.
+            self.unit.session = ack.session
+        elif ack.result == CHALLENGE:
+            # Or if it forgot this client, to more clients than it remembers.
+            self.unit.challenge = ack.session
+        else:
+            self.latencies.append(now - sent)
+            self.node_times.append(ack.elapsed / 1000)
+        name = RESULTS.get(ack.result, str(ack.result))
+        self.results[name] = self.results.get(name, 0) + 1
+
+    def expire(self, now):
+        for sequence, sent in list(self.outstanding.items()):
+            if now - sent > self.timeout:
+                del self.outstanding[sequence]
+                self.lost += 1
+
+    def report(self, label, elapsed):
+        acked = len(self.latencies)
+        print(f"{label}: {self.sent} sent, {acked} acked, {self.lost} lost, "
+              f"{acked / elapsed:.1f} commands/s")
+        print("  results: " + ", ".join(
+            f"{name} {count}" for name, count in sorted(self.results.items())))
+        if acked:
+            print("  round trip ms: " + ", ".join(
+                f"{percentile_label(p)} {percentile(self.latencies, p) * 1000:.1f}"
+                for p in (0.5, 0.9, 0.99, 1.0)))
+            print("  on the node ms: " + ", ".join(
+                f"{percentile_label(p)} {percentile(self.node_times, p) * 1000:.1f}"
+                for p in (0.5, 0.99, 1.0)))
+
+
+def load(args):
+    if args.ping:
+        # Acked without contacting the unit: measures the endpoint and the
+        # network alone.
+        commands = [Command()]
+    else:
+        # Alternate setpoints, so that every command changes something.
+        commands = [Command(temperature=float(value))
+                    for value in args.temperatures.split(",")]
+
+    loads = {}
+    selector = selectors.DefaultSelector()
+    for target in args.target:
+        host, port, unit = target.split(":", 2)
+        client = Unit(host, int(port), args.key.encode(), parse_unit(unit))
+        if client.command(Command(), args.timeout) is None:
+            sys.exit(f"No answer from {target}.")
+        interval = 1.0 / args.rate if args.rate > 0 else 0
+        loads[target] = Load(client, args.window, interval, commands,
+                             args.timeout)
+        selector.register(client.socket, selectors.EVENT_READ, loads[target])
+
+    start = time.monotonic()
+    end = start + args.duration
+    now = start
+    while now < end or any(load.outstanding for load in loads.values()):
+        if now < end:
+            for target_load in loads.values():
+                target_load.send_due(now)
+        for key, _ in selector.select(timeout=0.001):
+            key.data.receive(time.monotonic())
+        now = time.monotonic()
+        for target_load in loads.values():
+            target_load.expire(now)
+
+    elapsed = min(now, end) - start
+    for target, target_load in loads.items():
+        target_load.report(target, elapsed)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--key", required=True,
+                        help="key of the command_endpoint block")
+    parser.add_argument("--timeout", type=float, default=2.0,
+                        help="seconds to wait for an ack")
+    subparsers = parser.add_subparsers(dest="action", required=True)
+
+    send_parser = subparsers.add_parser("send", help="send one command")
+    send_parser.add_argument("--host", required=True)
+    send_parser.add_argument("--port", type=int, default=9997)
+    send_parser.add_argument("--unit-id", help="unit id, in hex")
+    send_parser.add_argument("--node", help="ESPHome node name")
+    send_parser.add_argument("--object-id", help="object id of the climate")
+    send_parser.add_argument("--mode", choices=MODES)
+    send_parser.add_argument("--temperature", type=float)
+    send_parser.add_argument("--fan", choices=FAN_MODES)
+    send_parser.add_argument("--swing", choices=SWING_MODES)
+    send_parser.add_argument("--vertical-vane", choices=VERTICAL_VANE_OPTIONS)
+    send_parser.add_argument("--horizontal-vane",
+                             choices=HORIZONTAL_VANE_OPTIONS)
+    send_parser.set_defaults(func=send)
+
+    load_parser = subparsers.add_parser(
+        "load", help="measure command throughput and latency")
+    load_parser.add_argument(
+        "--target", action="append", required=True,
+        help="HOST:PORT:UNIT, UNIT being a hex id or node/object_id; repeat "
+             "for several units")
+    load_parser.add_argument("--duration", type=float, default=30,
+                             help="seconds to send commands for")
+    load_parser.add_argument("--rate", type=float, default=0,
+                             help="commands per second per unit, 0 for as "
+                                  "fast as the window allows")
+    load_parser.add_argument("--window", type=int, default=1,
+                             help="commands in flight per unit")
+    load_parser.add_argument("--temperatures", default="21,21.5",
+                             help="setpoints to cycle through")
+    load_parser.add_argument("--ping", action="store_true",
+                             help="send empty commands, which don't reach "
+                                  "the unit")
+    load_parser.set_defaults(func=load)
+
+    history_parser = subparsers.add_parser(
+        "history", help="fetch the history of a unit as CSV")
+    history_parser.add_argument("--host", required=True)
+    history_parser.add_argument("--port", type=int, default=9997)
+    history_parser.add_argument("--unit-id", help="unit id, in hex")
+    history_parser.add_argument("--node", help="ESPHome node name")
+    history_parser.add_argument("--object-id", help="object id of the climate")
+    history_parser.add_argument("--tier", choices=HISTORY_TIERS,
+                                default="coarse")
+    history_parser.set_defaults(func=history)
+
+    args = parser.parse_args()
+    args.func(args)
+
+
+if __name__ == "__main__":
+    main()